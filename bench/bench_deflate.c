@@ -0,0 +1,217 @@
+//gcc -O2 bench/bench_deflate.c -o bench_deflate -lz
+//./bench_deflate [mensajes]
+
+// Bytes en el cable y CPU por mensaje de permessage-deflate (RFC 7692) sobre
+// el tráfico que envía el servidor, con distintos niveles, ventanas y un
+// tamaño mínimo por debajo del cual el mensaje sale sin comprimir.
+//
+// Se reproduce lo que hace la extensión en cada conexión: un flujo deflate
+// crudo con contexto compartido entre mensajes, Z_SYNC_FLUSH al final de
+// cada uno y sin los 4 bytes 00 00 ff ff finales. Los bytes en el cable
+// incluyen la cabecera WebSocket del servidor (sin máscara). La CPU es la de
+// comprimir en el servidor más la de descomprimir en el cliente.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define NUM_USUARIOS 50
+
+static const char *frases[] = {
+    "Hola a todos, ¿cómo van con el proyecto?",
+    "Ya subí los cambios al repositorio",
+    "¿Alguien sabe a qué hora es la reunión?",
+    "Te mando el archivo en un rato",
+    "jaja sí",
+    "ok",
+    "El servidor se cayó otra vez, lo estoy revisando",
+    "Mañana presento la parte del cliente",
+};
+#define NUM_FRASES (sizeof(frases) / sizeof(frases[0]))
+
+static const char *estados[] = { "ACTIVO", "OCUPADO", "AUSENTE" };
+
+typedef struct {
+    char *data;
+    size_t len;
+} Mensaje;
+
+static double ahora_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Genera una sesión típica: sobre todo broadcasts, algunos privados, cambios
+// de estado y de vez en cuando la lista de usuarios
+static Mensaje *generar(int n) {
+    Mensaje *m = malloc(n * sizeof(Mensaje));
+    unsigned int semilla = 12345;
+    char buf[4096];
+
+    for (int i = 0; i < n; i++) {
+        semilla = semilla * 1103515245 + 12345;
+        unsigned int r = (semilla >> 8) % 100;
+        int de = (semilla >> 4) % NUM_USUARIOS;
+        int para = (de + 1 + (semilla >> 12) % (NUM_USUARIOS - 1)) % NUM_USUARIOS;
+        const char *frase = frases[(semilla >> 16) % NUM_FRASES];
+        int seg = i / 10;
+        char ts[32];
+        snprintf(ts, sizeof(ts), "2025-03-14T10:%02d:%02d", (seg / 60) % 60, seg % 60);
+
+        int len;
+        if (r < 70) {
+            len = snprintf(buf, sizeof(buf),
+                           "{\"type\":\"broadcast\",\"sender\":\"usuario%d\","
+                           "\"content\":\"%s\",\"timestamp\":\"%s\"}", de, frase, ts);
+        } else if (r < 85) {
+            len = snprintf(buf, sizeof(buf),
+                           "{\"type\":\"private\",\"sender\":\"usuario%d\",\"target\":\"usuario%d\","
+                           "\"content\":\"%s\",\"timestamp\":\"%s\"}", de, para, frase, ts);
+        } else if (r < 97) {
+            len = snprintf(buf, sizeof(buf),
+                           "{\"type\":\"status_update\",\"sender\":\"server\",\"content\":"
+                           "{\"user\":\"usuario%d\",\"status\":\"%s\"},\"timestamp\":\"%s\"}",
+                           de, estados[(semilla >> 20) % 3], ts);
+        } else {
+            len = snprintf(buf, sizeof(buf),
+                           "{\"type\":\"list_users_response\",\"sender\":\"server\",\"content\":[");
+            for (int u = 0; u < NUM_USUARIOS; u++) {
+                len += snprintf(buf + len, sizeof(buf) - len, "%s\"usuario%d\"", u ? "," : "", u);
+            }
+            len += snprintf(buf + len, sizeof(buf) - len, "],\"timestamp\":\"%s\"}", ts);
+        }
+        m[i].data = malloc(len);
+        memcpy(m[i].data, buf, len);
+        m[i].len = (size_t)len;
+    }
+    return m;
+}
+
+static size_t cabecera_ws(size_t len) {
+    return len < 126 ? 2 : len < 65536 ? 4 : 10;
+}
+
+typedef struct {
+    double bytes;    // Bytes en el cable por mensaje
+    double ns_tx;    // Comprimir, por mensaje
+    double ns_rx;    // Descomprimir, por mensaje
+    int comprimidos; // Mensajes que salieron comprimidos
+} Resultado;
+
+// nivel 0: sin extensión
+static int medir(const Mensaje *m, int n, int nivel, int ventana, size_t minimo,
+                 Resultado *res) {
+    memset(res, 0, sizeof(*res));
+    if (nivel == 0) {
+        for (int i = 0; i < n; i++) {
+            res->bytes += cabecera_ws(m[i].len) + m[i].len;
+        }
+        res->bytes /= n;
+        return 0;
+    }
+
+    z_stream tx, rx;
+    memset(&tx, 0, sizeof(tx));
+    memset(&rx, 0, sizeof(rx));
+    // memLevel 8 es el valor por omisión de zlib y de lws
+    if (deflateInit2(&tx, nivel, Z_DEFLATED, -ventana, 8, Z_DEFAULT_STRATEGY) != Z_OK ||
+        inflateInit2(&rx, -ventana) != Z_OK) {
+        return -1;
+    }
+
+    size_t cap = 8192;
+    unsigned char *comprimido = malloc(cap);
+    unsigned char *plano = malloc(cap);
+    double t_tx = 0, t_rx = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (m[i].len < minimo) {
+            res->bytes += cabecera_ws(m[i].len) + m[i].len;
+            continue;
+        }
+
+        double t0 = ahora_ns();
+        tx.next_in = (unsigned char *)m[i].data;
+        tx.avail_in = (unsigned int)m[i].len;
+        tx.next_out = comprimido;
+        tx.avail_out = (unsigned int)cap;
+        deflate(&tx, Z_SYNC_FLUSH);
+        size_t clen = cap - tx.avail_out - 4; // Sin 00 00 ff ff
+        double t1 = ahora_ns();
+
+        // El receptor vuelve a agregar la cola antes de inflar
+        static const unsigned char cola[4] = { 0x00, 0x00, 0xff, 0xff };
+        memcpy(comprimido + clen, cola, 4);
+        rx.next_in = comprimido;
+        rx.avail_in = (unsigned int)(clen + 4);
+        rx.next_out = plano;
+        rx.avail_out = (unsigned int)cap;
+        inflate(&rx, Z_SYNC_FLUSH);
+        double t2 = ahora_ns();
+
+        if (cap - rx.avail_out != m[i].len || memcmp(plano, m[i].data, m[i].len) != 0) {
+            printf("El mensaje %d no se recuperó igual\n", i);
+            return -1;
+        }
+
+        t_tx += t1 - t0;
+        t_rx += t2 - t1;
+        res->bytes += cabecera_ws(clen) + clen;
+        res->comprimidos++;
+    }
+
+    res->bytes /= n;
+    res->ns_tx = t_tx / n;
+    res->ns_rx = t_rx / n;
+    deflateEnd(&tx);
+    inflateEnd(&rx);
+    free(comprimido);
+    free(plano);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    if (n <= 0) {
+        printf("Uso: %s [mensajes]\n", argv[0]);
+        return 1;
+    }
+
+    Mensaje *m = generar(n);
+    static const int niveles[] = { 1, 6, 9 };
+    static const int ventanas[] = { 9, 12, 15 };
+    static const size_t minimos[] = { 0, 64, 128 };
+
+    Resultado base;
+    medir(m, n, 0, 0, 0, &base);
+    printf("%d mensajes del servidor\n\n", n);
+    printf("%-6s %-8s %-7s %11s %7s %9s %9s %11s\n",
+           "nivel", "ventana", "mínimo", "bytes/msg", "ratio", "ns tx", "ns rx", "comprimidos");
+    printf("%-6s %-8s %-7s %11.1f %7.2f %9s %9s %11s\n",
+           "-", "-", "-", base.bytes, 1.0, "-", "-", "0%");
+
+    for (size_t a = 0; a < sizeof(niveles) / sizeof(niveles[0]); a++) {
+        for (size_t b = 0; b < sizeof(ventanas) / sizeof(ventanas[0]); b++) {
+            for (size_t c = 0; c < sizeof(minimos) / sizeof(minimos[0]); c++) {
+                Resultado r;
+                if (medir(m, n, niveles[a], ventanas[b], minimos[c], &r) != 0) {
+                    return 1;
+                }
+                char porc[16];
+                snprintf(porc, sizeof(porc), "%d%%", (int)(100.0 * r.comprimidos / n));
+                printf("%-6d %-8d %-7zu %11.1f %7.2f %9.1f %9.1f %11s\n",
+                       niveles[a], ventanas[b], minimos[c], r.bytes,
+                       base.bytes / r.bytes, r.ns_tx, r.ns_rx, porc);
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        free(m[i].data);
+    }
+    free(m);
+    return 0;
+}
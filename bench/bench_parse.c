@@ -0,0 +1,110 @@
+//gcc -O2 -I. bench/bench_parse.c frame.c -o bench_parse -ljansson
+//./bench_parse [iteraciones]
+
+// Costo por mensaje de reconocer los frames entrantes del chat:
+//  - jansson: copia a un búfer de 2048 bytes, json_loads y json_object_get,
+//    como hacía LWS_CALLBACK_RECEIVE antes de frame_parse
+//  - frame_parse: vistas sobre el mismo búfer, sin reservar memoria
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <jansson.h>
+
+#include "frame.h"
+
+static const char *mensajes[] = {
+    "{\"type\": \"register\", \"sender\": \"usuario42\"}",
+    "{\"type\": \"broadcast\", \"sender\": \"usuario42\", \"content\": \"Hola a todos, ¿cómo van con el proyecto?\"}",
+    "{\"type\": \"private\", \"sender\": \"usuario42\", \"target\": \"usuario7\", \"content\": \"Te mando el archivo en un rato\"}",
+    "{\"type\": \"list_users\", \"sender\": \"usuario42\"}",
+    "{\"type\": \"user_info\", \"sender\": \"usuario42\", \"target\": \"usuario7\"}",
+    "{\"type\": \"change_status\", \"sender\": \"usuario42\", \"content\": \"OCUPADO\"}",
+    "{\"type\": \"broadcast\", \"sender\": \"usuario42\", \"content\": \"con \\\"comillas\\\" y \\u00e9scapes\"}",
+};
+#define NUM_MENSAJES (sizeof(mensajes) / sizeof(mensajes[0]))
+
+static double ahora_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Evita que el compilador descarte el trabajo medido
+static volatile size_t sumidero;
+
+static void bench_jansson(const char *in, size_t len) {
+    char msg[2048];
+    memset(msg, 0, sizeof(msg));
+    if (len >= sizeof(msg)) len = sizeof(msg) - 1;
+    memcpy(msg, in, len);
+    msg[len] = '\0';
+
+    json_error_t error;
+    json_t *root = json_loads(msg, 0, &error);
+    if (!root) {
+        return;
+    }
+    const char *type = json_string_value(json_object_get(root, "type"));
+    const char *sender = json_string_value(json_object_get(root, "sender"));
+    const char *target = json_string_value(json_object_get(root, "target"));
+    const char *content = json_string_value(json_object_get(root, "content"));
+    sumidero += (type ? strlen(type) : 0) + (sender ? strlen(sender) : 0) +
+                (target ? strlen(target) : 0) + (content ? strlen(content) : 0);
+    json_decref(root);
+}
+
+static void bench_frame(const char *in, size_t len) {
+    ChatFrame f;
+    if (frame_parse(in, len, &f) != 0) {
+        return;
+    }
+    // El servidor copia sin escapes el emisor para buscarlo en el directorio
+    char sender[256];
+    sumidero += f.type.len + strview_copy(f.sender, sender, sizeof(sender)) +
+                f.target.len + f.content.len;
+}
+
+static double medir(void (*fn)(const char *, size_t), long iteraciones) {
+    size_t lens[NUM_MENSAJES];
+    for (size_t i = 0; i < NUM_MENSAJES; i++) {
+        lens[i] = strlen(mensajes[i]);
+    }
+
+    double inicio = ahora_ns();
+    for (long it = 0; it < iteraciones; it++) {
+        size_t i = (size_t)it % NUM_MENSAJES;
+        fn(mensajes[i], lens[i]);
+    }
+    return (ahora_ns() - inicio) / iteraciones;
+}
+
+int main(int argc, char *argv[]) {
+    long iteraciones = argc > 1 ? atol(argv[1]) : 2000000;
+    if (iteraciones <= 0) {
+        printf("Uso: %s [iteraciones]\n", argv[0]);
+        return 1;
+    }
+
+    // Verificar que ambos caminos reconocen los mismos mensajes
+    for (size_t i = 0; i < NUM_MENSAJES; i++) {
+        ChatFrame f;
+        if (frame_parse(mensajes[i], strlen(mensajes[i]), &f) != 0) {
+            printf("frame_parse rechazó el mensaje %zu\n", i);
+            return 1;
+        }
+    }
+
+    // Calentamiento
+    medir(bench_jansson, iteraciones / 10 + 1);
+    medir(bench_frame, iteraciones / 10 + 1);
+
+    double ns_jansson = medir(bench_jansson, iteraciones);
+    double ns_frame = medir(bench_frame, iteraciones);
+
+    printf("%ld mensajes\n", iteraciones);
+    printf("jansson:     %8.1f ns/mensaje\n", ns_jansson);
+    printf("frame_parse: %8.1f ns/mensaje (%.1fx)\n", ns_frame, ns_jansson / ns_frame);
+    return 0;
+}
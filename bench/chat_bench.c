@@ -0,0 +1,487 @@
+//gcc -O2 -I. bench/chat_bench.c -o chat_bench -lwebsockets
+//./chat_bench <IPdelservidor> <puerto> [--sessions N] [--rate N] [--secs N] [--size N] [--mix B,P,L,S]
+
+// Generador de carga contra un servidor local: abre N sesiones WebSocket
+// desde un solo contexto de lws, las registra y envía una mezcla de
+// broadcast, private, list_users y change_status a la tasa pedida.
+//
+// Cada broadcast y privado lleva en el contenido la hora en que debía
+// enviarse según la tasa (no la hora en que salió), así que si el cliente o
+// el servidor se atrasan la espera cuenta en la latencia. La latencia es de
+// extremo a extremo: de esa hora hasta que el destinatario lo recibe; un
+// broadcast da una muestra por cada sesión que lo recibe. Cliente y
+// servidor deben estar en la misma máquina (reloj monotónico).
+
+#define _GNU_SOURCE // memmem
+#include <libwebsockets.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PENDING 16      // Mensajes por enviar en cada sesión
+#define BENCH_MSG_MAX 1024    // Tamaño máximo de un mensaje generado
+#define BENCH_TICK_US 1000    // Cada cuánto se generan los mensajes que tocan
+#define BENCH_DRAIN_SECS 1    // Espera al final para lo que aún viaja
+#define HIST_SUB_BITS 6       // 64 cubetas por potencia de 2 (~1.5% de error)
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+enum { MIX_BROADCAST, MIX_PRIVATE, MIX_LIST_USERS, MIX_CHANGE_STATUS, MIX_TIPOS };
+
+typedef struct {
+    size_t len;
+    unsigned char buf[LWS_PRE + BENCH_MSG_MAX];
+} Pending;
+
+typedef struct {
+    struct lws *wsi;
+    int idx;
+    int registered;
+    int closed;
+    int status;              // Alterna ACTIVO y OCUPADO
+    Pending pend[BENCH_PENDING];
+    int p_head;
+    int p_count;
+} BenchSession;
+
+// Histograma log-lineal de latencias en nanosegundos
+typedef struct {
+    unsigned long long count[HIST_SIZE];
+    unsigned long long total;
+    long long max;
+} Hist;
+
+static BenchSession *sessions;
+static int num_sessions = 100;
+static int registered = 0;
+static int closed = 0;
+static char prefijo[16];
+
+static double rate = 1000;    // Mensajes por segundo en total
+static int secs = 10;
+static size_t size = 64;      // Bytes de contenido de broadcast y privados
+static char relleno[BENCH_MSG_MAX];
+static int mix[MIX_TIPOS] = { 70, 20, 5, 5 };
+static int mix_total = 100;
+
+static struct lws_context *context;
+static lws_sorted_usec_list_t tick_sul;
+static long long start_ns;         // Inicio del tráfico, 0 mientras se registran
+static long long generated = 0;    // Mensajes generados desde start_ns
+static long long sent = 0;
+static long long received = 0;
+static long long atrasados = 0;    // Sesión con la cola llena: no se generó
+static int terminado = 0;
+
+static Hist total_hist;
+static Hist intervalo_hist;
+static long long intervalo_sent, intervalo_received;
+static int segundo = 0;
+
+static unsigned int semilla = 12345;
+
+static long long ahora_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int aleatorio(void) {
+    semilla = semilla * 1103515245 + 12345;
+    return semilla >> 8;
+}
+
+static int hist_index(long long v) {
+    if (v < (1 << HIST_SUB_BITS)) {
+        return v < 0 ? 0 : (int)v;
+    }
+    int e = 63 - __builtin_clzll((unsigned long long)v);
+    int sub = (int)((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+// Límite inferior de la cubeta i
+static long long hist_value(int i) {
+    if (i < (1 << HIST_SUB_BITS)) {
+        return i;
+    }
+    int e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    long long sub = i & ((1 << HIST_SUB_BITS) - 1);
+    return (1LL << e) | (sub << (e - HIST_SUB_BITS));
+}
+
+static void hist_add(Hist *h, long long v) {
+    h->count[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static double hist_percentil_ms(const Hist *h, double p) {
+    if (!h->total) {
+        return 0;
+    }
+    unsigned long long objetivo = (unsigned long long)(p * h->total);
+    unsigned long long acumulado = 0;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        acumulado += h->count[i];
+        if (acumulado > objetivo) {
+            return hist_value(i) / 1e6;
+        }
+    }
+    return h->max / 1e6;
+}
+
+static void session_name(int idx, char *out, size_t cap) {
+    snprintf(out, cap, "%s%d", prefijo, idx);
+}
+
+// Encola un mensaje ya formateado; -1 si la sesión tiene la cola llena
+static int session_queue(BenchSession *s, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static int session_queue(BenchSession *s, const char *fmt, ...) {
+    if (s->p_count == BENCH_PENDING) {
+        return -1;
+    }
+    Pending *p = &s->pend[(s->p_head + s->p_count) % BENCH_PENDING];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf((char *)&p->buf[LWS_PRE], BENCH_MSG_MAX, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= BENCH_MSG_MAX) {
+        return -1;
+    }
+    p->len = (size_t)n;
+    s->p_count++;
+    lws_callback_on_writable(s->wsi);
+    return 0;
+}
+
+// Genera un mensaje del tipo que toque según la mezcla, con la hora prevista
+static void generar(long long previsto) {
+    BenchSession *s = NULL;
+    for (int intentos = 0; intentos < 8 && !s; intentos++) {
+        BenchSession *c = &sessions[aleatorio() % num_sessions];
+        if (c->registered && !c->closed) {
+            s = c;
+        }
+    }
+    if (!s) {
+        atrasados++;
+        return;
+    }
+
+    int r = (int)(aleatorio() % mix_total);
+    int tipo = 0;
+    while (r >= mix[tipo]) {
+        r -= mix[tipo++];
+    }
+
+    char nombre[32];
+    session_name(s->idx, nombre, sizeof(nombre));
+    int rc;
+    switch (tipo) {
+    case MIX_BROADCAST:
+        rc = session_queue(s, "{\"type\":\"broadcast\",\"sender\":\"%s\","
+                           "\"content\":\"bench %lld %.*s\"}", nombre, previsto,
+                           (int)size, relleno);
+        break;
+    case MIX_PRIVATE: {
+        char destino[32];
+        session_name((s->idx + 1 + (int)(aleatorio() % (num_sessions > 1 ? num_sessions - 1 : 1))) %
+                     num_sessions, destino, sizeof(destino));
+        rc = session_queue(s, "{\"type\":\"private\",\"sender\":\"%s\",\"target\":\"%s\","
+                           "\"content\":\"bench %lld %.*s\"}", nombre, destino, previsto,
+                           (int)size, relleno);
+        break;
+    }
+    case MIX_LIST_USERS:
+        rc = session_queue(s, "{\"type\":\"list_users\",\"sender\":\"%s\"}", nombre);
+        break;
+    default:
+        s->status = !s->status;
+        rc = session_queue(s, "{\"type\":\"change_status\",\"sender\":\"%s\",\"content\":\"%s\"}",
+                           nombre, s->status ? "OCUPADO" : "ACTIVO");
+        break;
+    }
+    if (rc != 0) {
+        atrasados++;
+    }
+}
+
+static void reportar_intervalo(void) {
+    segundo++;
+    printf("%3ds  enviados %7lld/s  recibidos %8lld/s  p50 %7.3f ms  p99 %7.3f ms  "
+           "atrasados %lld\n", segundo, intervalo_sent, intervalo_received,
+           hist_percentil_ms(&intervalo_hist, 0.50), hist_percentil_ms(&intervalo_hist, 0.99),
+           atrasados);
+    intervalo_sent = intervalo_received = 0;
+    memset(&intervalo_hist, 0, sizeof(intervalo_hist));
+}
+
+static void tick(lws_sorted_usec_list_t *sul) {
+    long long ahora = ahora_ns();
+
+    if (!start_ns) {
+        // Se empieza cuando todas las sesiones terminaron de registrarse
+        if (registered + closed < num_sessions) {
+            lws_sul_schedule(context, 0, sul, tick, BENCH_TICK_US);
+            return;
+        }
+        printf("%d sesiones registradas (%d fallaron); enviando %.0f mensajes/s durante %d s\n",
+               registered, closed, rate, secs);
+        start_ns = ahora;
+    }
+
+    long long transcurrido = ahora - start_ns;
+    if (transcurrido < (long long)secs * 1000000000) {
+        long long objetivo = (long long)(rate * transcurrido / 1e9);
+        for (; generated < objetivo; generated++) {
+            generar(start_ns + (long long)(generated * 1e9 / rate));
+        }
+    }
+    if (transcurrido >= (long long)(segundo + 1) * 1000000000 && segundo < secs) {
+        reportar_intervalo();
+    }
+    if (transcurrido >= (long long)(secs + BENCH_DRAIN_SECS) * 1000000000) {
+        terminado = 1;
+        lws_cancel_service(context);
+        return;
+    }
+    lws_sul_schedule(context, 0, sul, tick, BENCH_TICK_US);
+}
+
+// Busca la hora prevista en el contenido de un broadcast o privado
+static void medir(const char *in, size_t len) {
+    static const char marca[] = "\"content\":\"bench ";
+    const char *p = memmem(in, len, marca, sizeof(marca) - 1);
+    if (!p) {
+        return;
+    }
+    p += sizeof(marca) - 1;
+    long long previsto = 0;
+    while (p < in + len && *p >= '0' && *p <= '9') {
+        previsto = previsto * 10 + (*p++ - '0');
+    }
+    // Un contenido de otra ejecución (o anterior al arranque) no es de esta medición
+    if (previsto < start_ns) {
+        return;
+    }
+    long long latencia = ahora_ns() - previsto;
+    hist_add(&total_hist, latencia);
+    hist_add(&intervalo_hist, latencia);
+}
+
+static int callback_bench(struct lws *wsi, enum lws_callback_reasons reason,
+                          void *user, void *in, size_t len) {
+    BenchSession *s = (BenchSession *)user;
+
+    switch (reason) {
+
+    case LWS_CALLBACK_CLIENT_ESTABLISHED: {
+        char nombre[32];
+        session_name(s->idx, nombre, sizeof(nombre));
+        session_queue(s, "{\"type\":\"register\",\"sender\":\"%s\"}", nombre);
+        break;
+    }
+
+    case LWS_CALLBACK_CLIENT_WRITEABLE: {
+        if (!s->p_count) {
+            break;
+        }
+        Pending *p = &s->pend[s->p_head];
+        if (lws_write(wsi, &p->buf[LWS_PRE], p->len, LWS_WRITE_TEXT) < (int)p->len) {
+            return -1;
+        }
+        s->p_head = (s->p_head + 1) % BENCH_PENDING;
+        s->p_count--;
+        if (s->registered) {
+            sent++;
+            intervalo_sent++;
+        }
+        if (s->p_count) {
+            lws_callback_on_writable(wsi);
+        }
+        break;
+    }
+
+    case LWS_CALLBACK_CLIENT_RECEIVE: {
+        // Solo interesa el mensaje completo; los grandes (list_users con
+        // muchas sesiones) llegan en trozos y se cuentan en el último
+        if (!lws_is_final_fragment(wsi)) {
+            break;
+        }
+        if (!s->registered) {
+            if (memmem(in, len, "\"register_success\"", 18)) {
+                s->registered = 1;
+                registered++;
+            } else if (memmem(in, len, "\"register_error\"", 16)) {
+                printf("Registro rechazado para la sesión %d\n", s->idx);
+                s->closed = 1;
+                closed++;
+                return -1;
+            }
+            break;
+        }
+        // El historial que el servidor reenvía al registrarse (replay u
+        // offline) y lo que llega antes de arrancar el tráfico no cuentan
+        if (!start_ns || memmem(in, len, "\"replay\":true", 13) ||
+            memmem(in, len, "\"offline\":true", 14)) {
+            break;
+        }
+        received++;
+        intervalo_received++;
+        if (lws_is_first_fragment(wsi)) {
+            medir((const char *)in, len);
+        }
+        break;
+    }
+
+    case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+    case LWS_CALLBACK_CLIENT_CLOSED:
+        if (s && !s->closed) {
+            s->closed = 1;
+            closed++;
+            if (s->registered) {
+                registered--;
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+static struct lws_protocols protocols[] = {
+    { "chat-protocol", callback_bench, 0, 0 },
+    { NULL, NULL, 0, 0 }
+};
+
+// "70,20,5,5" -> pesos de broadcast, private, list_users y change_status
+static int parse_mix(const char *texto) {
+    int total = 0;
+    for (int i = 0; i < MIX_TIPOS; i++) {
+        char *fin;
+        long v = strtol(texto, &fin, 10);
+        if (fin == texto || v < 0 || (i < MIX_TIPOS - 1 && *fin != ',')) {
+            return -1;
+        }
+        mix[i] = (int)v;
+        total += mix[i];
+        texto = fin + 1;
+    }
+    if (total <= 0) {
+        return -1;
+    }
+    mix_total = total;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Uso: %s <IPdelservidor> <puerto> [--sessions N] [--rate N] [--secs N] "
+               "[--size N] [--mix B,P,L,S]\n", argv[0]);
+        return 1;
+    }
+    const char *server_ip = argv[1];
+    int server_port = atoi(argv[2]);
+    if (server_port <= 0 || server_port > 65535) {
+        printf("Error: Puerto inválido.\n");
+        return 1;
+    }
+
+    const char *opt = lws_cmdline_option(argc, (const char **)argv, "--sessions");
+    if (opt && (num_sessions = atoi(opt)) <= 0) {
+        printf("Error: --sessions debe ser mayor que 0.\n");
+        return 1;
+    }
+    opt = lws_cmdline_option(argc, (const char **)argv, "--rate");
+    if (opt && (rate = atof(opt)) <= 0) {
+        printf("Error: --rate debe ser mayor que 0.\n");
+        return 1;
+    }
+    opt = lws_cmdline_option(argc, (const char **)argv, "--secs");
+    if (opt && (secs = atoi(opt)) <= 0) {
+        printf("Error: --secs debe ser mayor que 0.\n");
+        return 1;
+    }
+    opt = lws_cmdline_option(argc, (const char **)argv, "--size");
+    if (opt) {
+        size = (size_t)atoi(opt);
+        if (size > BENCH_MSG_MAX - 256) {
+            printf("Error: --size debe ser menor que %d.\n", BENCH_MSG_MAX - 256);
+            return 1;
+        }
+    }
+    opt = lws_cmdline_option(argc, (const char **)argv, "--mix");
+    if (opt && parse_mix(opt) != 0) {
+        printf("Error: --mix espera cuatro pesos: broadcast,private,list_users,change_status.\n");
+        return 1;
+    }
+
+    memset(relleno, 'x', sizeof(relleno));
+
+    // Nombres distintos en cada corrida por si el servidor aún recuerda la anterior
+    snprintf(prefijo, sizeof(prefijo), "b%d_", (int)(getpid() % 100000));
+    semilla ^= (unsigned int)getpid();
+
+    sessions = calloc(num_sessions, sizeof(BenchSession));
+    if (!sessions) {
+        fprintf(stderr, "Error al reservar las sesiones\n");
+        return 1;
+    }
+
+    struct lws_context_creation_info info = {0};
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = protocols;
+    info.fd_limit_per_thread = (unsigned int)num_sessions + 16;
+    lws_set_log_level(LLL_ERR, NULL);
+
+    context = lws_create_context(&info);
+    if (!context) {
+        fprintf(stderr, "Error al crear contexto\n");
+        return 1;
+    }
+
+    for (int i = 0; i < num_sessions; i++) {
+        sessions[i].idx = i;
+        struct lws_client_connect_info ccinfo = {0};
+        ccinfo.context = context;
+        ccinfo.address = server_ip;
+        ccinfo.port = server_port;
+        ccinfo.path = "/";
+        ccinfo.host = ccinfo.address;
+        ccinfo.origin = ccinfo.address;
+        ccinfo.protocol = "chat-protocol";
+        ccinfo.userdata = &sessions[i];
+        ccinfo.pwsi = &sessions[i].wsi;
+        if (!lws_client_connect_via_info(&ccinfo)) {
+            sessions[i].closed = 1;
+            closed++;
+        }
+    }
+    printf("Conectando %d sesiones a %s:%d\n", num_sessions, server_ip, server_port);
+
+    lws_sul_schedule(context, 0, &tick_sul, tick, BENCH_TICK_US);
+    while (!terminado && lws_service(context, 1000) >= 0) {
+    }
+
+    double duracion = secs;
+    printf("\nEnviados: %lld (%.0f/s)  recibidos: %lld (%.0f/s)  atrasados: %lld\n",
+           sent, sent / duracion, received, received / duracion, atrasados);
+    printf("Latencia de %llu entregas: p50 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  máx %.3f ms\n",
+           total_hist.total, hist_percentil_ms(&total_hist, 0.50),
+           hist_percentil_ms(&total_hist, 0.99), hist_percentil_ms(&total_hist, 0.999),
+           total_hist.max / 1e6);
+
+    lws_context_destroy(context);
+    free(sessions);
+    return 0;
+}
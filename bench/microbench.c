@@ -0,0 +1,250 @@
+//gcc -O2 -I. bench/microbench.c frame.c outmsg.c directory.c encode.c userlist.c idle.c -o microbench -ljansson -lpthread
+//./microbench [iteraciones]
+
+// Microbenchmarks de las piezas del camino caliente del servidor, sin
+// sockets: se enlaza con los mismos módulos que usa server.c para medir las
+// funciones que llama callback_chat. Reporta ns/op y asignaciones/op; las
+// asignaciones se cuentan interponiendo malloc, así que incluyen las de
+// jansson.
+//
+//  - reconocer un frame entrante: frame_parse y jansson
+//  - codificar status_update, register_success y broadcast
+//  - buscar un nombre en el directorio con 100, 10k y 100k usuarios
+//  - gen_timestamp
+//  - un tick de la rueda de inactividad (lo que era monitor_inactividad)
+
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "directory.h"
+#include "encode.h"
+#include "frame.h"
+#include "idle.h"
+#include "outmsg.h"
+#include "userlist.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long long asignaciones = 0;
+
+void *malloc(size_t size) {
+    asignaciones++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    asignaciones++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    asignaciones++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+#define IDLE_SESSIONS 10000
+#define IDLE_SECS 10 // El plazo por defecto del servidor (--away-secs)
+
+static const char frame_broadcast[] =
+    "{\"type\": \"broadcast\", \"sender\": \"usuario42\", "
+    "\"content\": \"Hola a todos, ¿cómo van con el proyecto?\"}";
+
+static User *bench_user;
+static UserlistCache bench_cache;
+static StrView bench_content;
+static char **nombres;
+static int num_nombres;
+static volatile unsigned long sumidero; // Evita que el compilador quite el trabajo
+
+static double ahora_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void medir(const char *nombre, int iter, void (*fn)(int)) {
+    for (int i = 0; i < iter / 10; i++) {
+        fn(i);
+    }
+    unsigned long long a0 = asignaciones;
+    double t0 = ahora_ns();
+    for (int i = 0; i < iter; i++) {
+        fn(i);
+    }
+    double t1 = ahora_ns();
+    printf("%-40s %10.1f ns/op %8.2f asign/op\n", nombre, (t1 - t0) / iter,
+           (double)(asignaciones - a0) / iter);
+}
+
+static void op_frame_parse(int i) {
+    (void)i;
+    ChatFrame f;
+    sumidero += frame_parse(frame_broadcast, sizeof(frame_broadcast) - 1, &f) + f.content.len;
+}
+
+static void op_jansson(int i) {
+    (void)i;
+    json_error_t error;
+    json_t *root = json_loadb(frame_broadcast, sizeof(frame_broadcast) - 1, 0, &error);
+    sumidero += strlen(json_string_value(json_object_get(root, "content")));
+    json_decref(root);
+}
+
+static void op_status_update(int i) {
+    Outbound o = {{ NULL, NULL }};
+    status_encode(bench_user, i & 1 ? "OCUPADO" : "ACTIVO", &o);
+    outbound_release(&o);
+}
+
+static void op_broadcast(int i) {
+    (void)i;
+    Outbound o = {{ NULL, NULL }};
+    broadcast_encode(bench_user, bench_content, &o);
+    outbound_release(&o);
+}
+
+// Respuesta compartida: todos los registros del mismo segundo la reutilizan
+static void op_register_cached(int i) {
+    (void)i;
+    outmsg_unref(userlist_response(&bench_cache, 1, FMT_JSON));
+}
+
+// Con la caché invalidada, como tras cada alta o baja
+static void op_register_nueva(int i) {
+    (void)i;
+    bench_cache.version = 0;
+    outmsg_unref(userlist_response(&bench_cache, 1, FMT_JSON));
+}
+
+static void op_lookup(int i) {
+    const char *nombre = nombres[(unsigned int)i * 2654435761u % num_nombres];
+    unsigned int h = hash_username(nombre);
+    UserShard *sh = shard_for(h);
+    pthread_mutex_lock(&sh->lock);
+    sumidero += directory_find(sh, nombre, h) != NULL;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+static void op_lookup_miss(int i) {
+    char nombre[32];
+    snprintf(nombre, sizeof(nombre), "nadie%d", i & 1023);
+    unsigned int h = hash_username(nombre);
+    UserShard *sh = shard_for(h);
+    pthread_mutex_lock(&sh->lock);
+    sumidero += directory_find(sh, nombre, h) != NULL;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+static void op_timestamp(int i) {
+    (void)i;
+    char timestamp[64];
+    gen_timestamp(timestamp, sizeof(timestamp));
+    sumidero += timestamp[0];
+}
+
+// Un segundo simulado: la cubeta que vence se recorre y sus sesiones, que
+// tuvieron actividad, se reubican
+static IdleWheel rueda;
+static time_t idle_ahora;
+
+static void idle_vencida(IdleEntry *e) {
+    (void)e;
+    sumidero++;
+}
+
+static void op_idle_scan(int i) {
+    (void)i;
+    idle_scan(&rueda, ++idle_ahora, idle_vencida);
+}
+
+// Agrega usuarios hasta tener total en el directorio y en la lista
+static void poblar(int total) {
+    nombres = realloc(nombres, total * sizeof(char *));
+    for (int i = num_nombres; i < total; i++) {
+        User *u = user_alloc();
+        snprintf(u->username, sizeof(u->username), "usuario%d", i);
+        strcpy(u->status, "ACTIVO");
+        u->id = (uint32_t)i + 1;
+        u->hash = hash_username(u->username);
+        UserShard *sh = shard_for(u->hash);
+        pthread_mutex_lock(&sh->lock);
+        directory_insert(sh, u);
+        pthread_mutex_unlock(&sh->lock);
+        userlist_add(u);
+        nombres[i] = u->username;
+    }
+    num_nombres = total;
+}
+
+int main(int argc, char *argv[]) {
+    int iter = argc > 1 ? atoi(argv[1]) : 1000000;
+    if (iter <= 0) {
+        printf("Uso: %s [iteraciones]\n", argv[0]);
+        return 1;
+    }
+
+    // Estado mínimo del servidor: un hilo de servicio, sin sesiones
+    max_users = 1 << 20;
+    for (int i = 0; i < USER_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    atomic_store(&format_sessions[FMT_JSON], 1);
+
+    poblar(100);
+    bench_user = directory_find(shard_for(hash_username("usuario42")), "usuario42",
+                                hash_username("usuario42"));
+    ChatFrame f;
+    frame_parse(frame_broadcast, sizeof(frame_broadcast) - 1, &f);
+    bench_content = f.content;
+
+    medir("frame_parse (broadcast)", iter, op_frame_parse);
+    medir("jansson (broadcast)", iter / 4, op_jansson);
+    medir("status_update JSON", iter / 4, op_status_update);
+    medir("broadcast JSON", iter, op_broadcast);
+    medir("register_success, 100 usuarios (caché)", iter, op_register_cached);
+    medir("register_success, 100 usuarios (nueva)", iter / 10, op_register_nueva);
+
+    atomic_store(&format_sessions[FMT_JSON], 0);
+    atomic_store(&format_sessions[FMT_BIN], 1);
+    medir("status_update binario", iter, op_status_update);
+    medir("broadcast binario", iter, op_broadcast);
+
+    medir("gen_timestamp", iter, op_timestamp);
+
+    static const int tamanos[] = { 100, 10000, 100000 };
+    for (size_t t = 0; t < sizeof(tamanos) / sizeof(tamanos[0]); t++) {
+        char nombre[64];
+        poblar(tamanos[t]);
+        snprintf(nombre, sizeof(nombre), "búsqueda, %d usuarios", tamanos[t]);
+        medir(nombre, iter, op_lookup);
+        snprintf(nombre, sizeof(nombre), "búsqueda fallida, %d usuarios", tamanos[t]);
+        medir(nombre, iter, op_lookup_miss);
+    }
+
+    // Rueda con IDLE_SESSIONS sesiones cuyo plazo nunca vence
+    idle_ahora = time(NULL);
+    IdleEntry *sesiones = calloc(IDLE_SESSIONS, sizeof(IdleEntry));
+    if (idle_wheel_init(&rueda, IDLE_SECS, idle_ahora) != 0 || !sesiones) {
+        printf("Sin memoria para la rueda de inactividad\n");
+        return 1;
+    }
+    for (int i = 0; i < IDLE_SESSIONS; i++) {
+        sesiones[i].deadline = ((time_t)1 << 40) + i;
+        idle_wheel_insert(&rueda, &sesiones[i]);
+    }
+    char nombre[64];
+    snprintf(nombre, sizeof(nombre), "tick de inactividad, %d sesiones", IDLE_SESSIONS);
+    medir(nombre, iter / 100, op_idle_scan);
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+// Subprotocolo binario "chat-protocol-bin". Cada frame WebSocket binario es
+// un mensaje:
+//
+//   cliente -> servidor: tipo (u8) y sus campos
+//   servidor -> cliente: tipo (u8), timestamp (u32, segundos Unix) y campos
+//
+// Enteros en big endian. Las cadenas van como largo (varint LEB128) y bytes
+// UTF-8 sin terminador. Los usuarios se nombran por un id u32 que el servidor
+// asigna al registrarse; el nombre viaja una sola vez en BIN_S_USER_JOINED
+// o en la lista de usuarios. El emisor de los mensajes del cliente es
+// siempre el usuario registrado en la conexión.
+//
+// Cualquier solicitud puede terminar con un id (varint) opcional; las
+// respuestas BIN_S_LIST_USERS, BIN_S_USER_INFO y BIN_S_ROOM_RESPONSE lo
+// devuelven al final, después de sus campos. Un varint tiene como mucho 20
+// cifras decimales, así que nunca pasa de REQUEST_ID_MAX_LEN (frame.h), el
+// límite del "id" en JSON.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BIN_PROTOCOL "chat-protocol-bin"
+
+// Cliente -> servidor
+#define BIN_REGISTER       0x01 // nombre
+#define BIN_BROADCAST      0x02 // contenido
+#define BIN_PRIVATE        0x03 // nombre destino, contenido
+#define BIN_LIST_USERS     0x04
+#define BIN_USER_INFO      0x05 // nombre destino
+#define BIN_CHANGE_STATUS  0x06 // estado
+#define BIN_DISCONNECT     0x07
+#define BIN_HISTORY        0x08 // desde (hora como en los timestamps JSON)
+#define BIN_JOIN_ROOM      0x09 // sala
+#define BIN_LEAVE_ROOM     0x0a // sala
+#define BIN_ROOM_MESSAGE   0x0b // sala, contenido
+
+// Servidor -> cliente
+#define BIN_S_REGISTER_SUCCESS   0x81 // id propio
+#define BIN_S_REGISTER_ERROR     0x82 // motivo
+#define BIN_S_BROADCAST          0x83 // id emisor, contenido
+#define BIN_S_PRIVATE            0x84 // id emisor, id destino, contenido
+#define BIN_S_LIST_USERS         0x85 // cantidad (u32), {id, nombre}...
+#define BIN_S_USER_INFO          0x86 // id (0 si no existe), ip, estado
+#define BIN_S_STATUS_UPDATE      0x87 // id, estado
+#define BIN_S_USER_DISCONNECTED  0x88 // id
+#define BIN_S_STATUS_BATCH       0x89 // cantidad (u32), {id, estado}...
+#define BIN_S_USER_JOINED        0x8a // id, nombre
+#define BIN_S_HISTORY            0x8b // nombre emisor, nombre destino (vacío en
+                                      // broadcast), contenido; hora original
+#define BIN_S_QUEUED             0x8c // nombre destino, guardado (u8: 1 sí, 0 buzón lleno)
+#define BIN_S_OFFLINE            0x8d // como BIN_S_HISTORY: privado guardado en el buzón
+#define BIN_S_ROOM_RESPONSE      0x8e // sala, unirse (u8: 1) o salir (0), "ok" o motivo
+#define BIN_S_ROOM_MESSAGE       0x8f // id emisor, sala, contenido
+
+#define BIN_HEADER_LEN 5 // tipo + timestamp de los mensajes del servidor
+
+static inline unsigned char *bin_put_u8(unsigned char *p, unsigned int v) {
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+static inline unsigned char *bin_put_u32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+    return p + 4;
+}
+
+static inline size_t bin_varint_len(size_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline unsigned char *bin_put_varint(unsigned char *p, size_t v) {
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+// Bytes que ocupa una cadena de len bytes ya codificada
+static inline size_t bin_str_len(size_t len) {
+    return bin_varint_len(len) + len;
+}
+
+static inline unsigned char *bin_put_str(unsigned char *p, const char *s, size_t len) {
+    p = bin_put_varint(p, len);
+    for (size_t i = 0; i < len; i++) {
+        p[i] = (unsigned char)s[i];
+    }
+    return p + len;
+}
+
+// Lectura con verificación de límites: tras el primer error err queda en 1
+// y todas las lecturas devuelven cero.
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    int err;
+} BinReader;
+
+static inline unsigned int bin_get_u8(BinReader *r) {
+    if (r->err || r->end - r->p < 1) {
+        r->err = 1;
+        return 0;
+    }
+    return *r->p++;
+}
+
+static inline uint32_t bin_get_u32(BinReader *r) {
+    if (r->err || r->end - r->p < 4) {
+        r->err = 1;
+        return 0;
+    }
+    uint32_t v = (uint32_t)r->p[0] << 24 | (uint32_t)r->p[1] << 16 |
+                 (uint32_t)r->p[2] << 8 | (uint32_t)r->p[3];
+    r->p += 4;
+    return v;
+}
+
+static inline size_t bin_get_varint(BinReader *r) {
+    size_t v = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (r->err || r->p >= r->end) {
+            break;
+        }
+        unsigned char b = *r->p++;
+        v |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+    r->err = 1;
+    return 0;
+}
+
+// Devuelve un puntero a los bytes de la cadena dentro del frame
+static inline const char *bin_get_str(BinReader *r, size_t *len) {
+    size_t n = bin_get_varint(r);
+    if (r->err || (size_t)(r->end - r->p) < n) {
+        r->err = 1;
+        *len = 0;
+        return NULL;
+    }
+    const char *s = (const char *)r->p;
+    r->p += n;
+    *len = n;
+    return s;
+}
+
+#endif
@@ -7,221 +7,1590 @@
 #include <stdlib.h>
 #include <jansson.h>
 #include <termios.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "binproto.h"
 
 #define MAX_MESSAGE_LEN 512
-#define MAX_PRIVATE_MESSAGES 100
+#define MAX_PRIVATE_MESSAGES 100 // Por conversación
 #define MAX_NAME_LEN 50
 #define MAX_BROADCAST_MESSAGES 10
+#define MAX_INCOMING_LEN (1024 * 1024) // Tamaño máximo de un mensaje reensamblado
 
-typedef struct {
-    char sender[MAX_MESSAGE_LEN];
-    char content[MAX_MESSAGE_LEN];
-    char target[MAX_MESSAGE_LEN];
-} private_message_t;
-
-private_message_t private_messages[MAX_PRIVATE_MESSAGES];
-int private_message_count = 0;
-char broadcast_messages[MAX_BROADCAST_MESSAGES][MAX_MESSAGE_LEN];
-int broadcast_count = 0;
 int in_broadcast_mode = 0;
 int in_private_chat = 0;
 char current_private_chat[MAX_NAME_LEN] = "";
 
 static struct lws *global_wsi;
 static char username[MAX_NAME_LEN];
-static int awaiting_response = 0;
-int is_writing = 0;
-pthread_mutex_t writing_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Función para leer un carácter sin esperar Enter
-char getch() {
-    struct termios oldt, newt;
-    char ch;
-    tcgetattr(STDIN_FILENO, &oldt); // Obtener atributos actuales del terminal
-    newt = oldt;
-    newt.c_lflag &= ~(ICANON | ECHO); // Desactivar modo canónico y eco
-    tcsetattr(STDIN_FILENO, TCSANOW, &newt); // Aplicar cambios
+// Reensamblado de mensajes del servidor que llegan en varios trozos
+static char *rx_buf = NULL;
+static size_t rx_len = 0;
+static size_t rx_cap = 0;
+
+// Se negoció chat-protocol-bin con el servidor
+static int binary_mode = 0;
+
+// permessage-deflate opcional (--deflate); ventana y nivel de lo que envía
+// el cliente
+static int deflate_enabled = 0;
+static int deflate_window_bits = 15;
+static int deflate_level = 6;
+
+static const struct lws_extension extensions[] = {
+    {
+        "permessage-deflate",
+        lws_extension_callback_pm_deflate,
+        "permessage-deflate; client_max_window_bits"
+    },
+    { NULL, NULL, NULL }
+};
 
-    ch = getchar(); // Leer un solo carácter
+// Nombres de los usuarios según el id que les asignó el servidor (modo binario)
+typedef struct {
+    uint32_t id;
+    char name[MAX_NAME_LEN];
+} known_user_t;
 
-    tcsetattr(STDIN_FILENO, TCSANOW, &oldt); // Restaurar configuración original
-    return ch;
+static known_user_t *known_users = NULL;
+static int known_count = 0;
+static int known_cap = 0;
+
+static void remember_user(uint32_t id, const char *name, size_t len) {
+    if (len >= MAX_NAME_LEN) {
+        len = MAX_NAME_LEN - 1;
+    }
+    for (int i = 0; i < known_count; i++) {
+        if (known_users[i].id == id) {
+            return;
+        }
+    }
+    if (known_count == known_cap) {
+        int cap = known_cap ? known_cap * 2 : 64;
+        known_user_t *nuevo = realloc(known_users, cap * sizeof(known_user_t));
+        if (!nuevo) {
+            return;
+        }
+        known_users = nuevo;
+        known_cap = cap;
+    }
+    known_users[known_count].id = id;
+    memcpy(known_users[known_count].name, name, len);
+    known_users[known_count].name[len] = '\0';
+    known_count++;
 }
 
-void redraw_broadcast_screen() {
-    system("clear");
+static const char *user_name(uint32_t id) {
+    for (int i = known_count - 1; i >= 0; i--) {
+        if (known_users[i].id == id) {
+            return known_users[i].name;
+        }
+    }
+    return "?";
+}
+
+// ---------------- Historial de conversaciones ----------------
+// Cada conversación (la de broadcast y una por cada usuario con el que hay
+// mensajes privados) tiene su propio anillo de mensajes, así que agregar uno
+// es O(1) y dibujar un chat solo recorre sus mensajes. Los nombres se
+// internan una vez; los textos van a un arena por conversación y se guardan
+// como desplazamientos para que el arena pueda crecer con realloc.
+
+#define CONV_HASH_INITIAL 16
+
+typedef struct {
+    const char *sender; // Nombre internado
+    size_t content;     // Desplazamiento dentro del arena de la conversación
+    size_t len;
+} chat_line_t;
+
+typedef struct conversation {
+    struct conversation *next; // Cadena de la tabla hash
+    const char *peer;          // Nombre internado; NULL para broadcast
+    int max;                   // Mensajes que se conservan
+    chat_line_t *lines;        // Anillo
+    int cap;
+    int head;                  // Índice del mensaje más antiguo
+    int count;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    size_t arena_live;         // Bytes de mensajes que siguen en el anillo
+} conversation_t;
+
+// Tabla de nombres internados; no se liberan porque son pocos
+typedef struct interned {
+    struct interned *next;
+    unsigned int hash;
+    char name[];
+} interned_t;
+
+static interned_t **intern_table = NULL;
+static unsigned int intern_size = 0;
+static unsigned int intern_count = 0;
+
+static conversation_t **conv_table = NULL;
+static unsigned int conv_size = 0;
+static unsigned int conv_count = 0;
+
+static conversation_t broadcast_conv = { .max = MAX_BROADCAST_MESSAGES };
+
+static unsigned int name_hash(const char *s) {
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+static const char *intern(const char *name) {
+    unsigned int h = name_hash(name);
+    if (intern_size) {
+        for (interned_t *e = intern_table[h & (intern_size - 1)]; e; e = e->next) {
+            if (e->hash == h && strcmp(e->name, name) == 0) {
+                return e->name;
+            }
+        }
+    }
+
+    if (intern_count >= intern_size) {
+        unsigned int size = intern_size ? intern_size * 2 : CONV_HASH_INITIAL;
+        interned_t **tabla = calloc(size, sizeof(interned_t *));
+        if (!tabla) {
+            return NULL;
+        }
+        for (unsigned int i = 0; i < intern_size; i++) {
+            while (intern_table[i]) {
+                interned_t *e = intern_table[i];
+                intern_table[i] = e->next;
+                e->next = tabla[e->hash & (size - 1)];
+                tabla[e->hash & (size - 1)] = e;
+            }
+        }
+        free(intern_table);
+        intern_table = tabla;
+        intern_size = size;
+    }
+
+    size_t len = strlen(name);
+    interned_t *e = malloc(sizeof(interned_t) + len + 1);
+    if (!e) {
+        return NULL;
+    }
+    memcpy(e->name, name, len + 1);
+    e->hash = h;
+    e->next = intern_table[h & (intern_size - 1)];
+    intern_table[h & (intern_size - 1)] = e;
+    intern_count++;
+    return e->name;
+}
+
+// Busca la conversación con peer; si crear es 0 y no existe devuelve NULL
+static conversation_t *conversation_get(const char *peer, int crear) {
+    unsigned int h = name_hash(peer);
+    if (conv_size) {
+        for (conversation_t *c = conv_table[h & (conv_size - 1)]; c; c = c->next) {
+            if (strcmp(c->peer, peer) == 0) {
+                return c;
+            }
+        }
+    }
+    if (!crear) {
+        return NULL;
+    }
+
+    if (conv_count >= conv_size) {
+        unsigned int size = conv_size ? conv_size * 2 : CONV_HASH_INITIAL;
+        conversation_t **tabla = calloc(size, sizeof(conversation_t *));
+        if (!tabla) {
+            return NULL;
+        }
+        for (unsigned int i = 0; i < conv_size; i++) {
+            while (conv_table[i]) {
+                conversation_t *c = conv_table[i];
+                unsigned int b = name_hash(c->peer) & (size - 1);
+                conv_table[i] = c->next;
+                c->next = tabla[b];
+                tabla[b] = c;
+            }
+        }
+        free(conv_table);
+        conv_table = tabla;
+        conv_size = size;
+    }
+
+    conversation_t *c = calloc(1, sizeof(conversation_t));
+    const char *nombre = intern(peer);
+    if (!c || !nombre) {
+        free(c);
+        return NULL;
+    }
+    c->peer = nombre;
+    c->max = MAX_PRIVATE_MESSAGES;
+    c->next = conv_table[h & (conv_size - 1)];
+    conv_table[h & (conv_size - 1)] = c;
+    conv_count++;
+    return c;
+}
+
+static const chat_line_t *conversation_line(const conversation_t *c, int i) {
+    return &c->lines[(c->head + i) % c->cap];
+}
+
+static const char *conversation_text(const conversation_t *c, const chat_line_t *l) {
+    return &c->arena[l->content];
+}
+
+// Copia al inicio del arena solo los textos que siguen en el anillo
+static void conversation_compact(conversation_t *c) {
+    size_t pos = 0;
+    for (int i = 0; i < c->count; i++) {
+        chat_line_t *l = &c->lines[(c->head + i) % c->cap];
+        memmove(&c->arena[pos], &c->arena[l->content], l->len + 1);
+        l->content = pos;
+        pos += l->len + 1;
+    }
+    c->arena_len = pos;
+}
+
+static int conversation_append(conversation_t *c, const char *sender, const char *content) {
+    const char *nombre = intern(sender);
+    if (!nombre) {
+        return -1;
+    }
+    size_t len = strlen(content);
 
-    // Imprimir los últimos mensajes de broadcast
-    for (int i = 0; i < broadcast_count; i++) {
-        printf("%s\n", broadcast_messages[i]);
+    if (c->count == c->cap && c->cap < c->max) {
+        // Crecer el anillo dejándolo desenrollado desde 0
+        int cap = c->cap ? c->cap * 2 : 16;
+        if (cap > c->max) {
+            cap = c->max;
+        }
+        chat_line_t *lines = malloc(cap * sizeof(chat_line_t));
+        if (!lines) {
+            return -1;
+        }
+        for (int i = 0; i < c->count; i++) {
+            lines[i] = c->lines[(c->head + i) % c->cap];
+        }
+        free(c->lines);
+        c->lines = lines;
+        c->cap = cap;
+        c->head = 0;
+    } else if (c->count == c->cap) {
+        // Lleno: se descarta el más antiguo
+        c->arena_live -= c->lines[c->head].len + 1;
+        c->head = (c->head + 1) % c->cap;
+        c->count--;
+    }
+
+    if (c->arena_len + len + 1 > c->arena_cap) {
+        // Si más de la mitad del arena es de mensajes descartados se compacta;
+        // si no, se duplica. Cada byte se mueve O(1) veces en promedio.
+        if (c->arena_live + len + 1 <= c->arena_cap / 2) {
+            conversation_compact(c);
+        } else {
+            size_t cap = c->arena_cap ? c->arena_cap : 1024;
+            while (cap < c->arena_live + len + 1 || cap < c->arena_len + len + 1) {
+                cap *= 2;
+            }
+            char *arena = realloc(c->arena, cap);
+            if (!arena) {
+                return -1;
+            }
+            c->arena = arena;
+            c->arena_cap = cap;
+        }
     }
-    printf("\nModo broadcast activado. Presiona ESC para volver al menú.\n");
+
+    chat_line_t *l = &c->lines[(c->head + c->count) % c->cap];
+    l->sender = nombre;
+    l->content = c->arena_len;
+    l->len = len;
+    memcpy(&c->arena[c->arena_len], content, len + 1);
+    c->arena_len += len + 1;
+    c->arena_live += len + 1;
+    c->count++;
+    return 0;
+}
+
+// Id de solicitud opcional al final de una respuesta binaria
+static void bin_get_request_id(BinReader *r, json_t *root) {
+    if (!r->err && r->p < r->end) {
+        size_t id = bin_get_varint(r);
+        if (!r->err) {
+            json_object_set_new(root, "id", json_integer((json_int_t)id));
+        }
+    }
+}
+
+// Codifica una solicitud con la misma forma que el JSON en chat-protocol-bin.
+// Devuelve un búfer con LWS_PRE libre al inicio; *out_len es el largo útil.
+// NULL si el tipo no existe en binproto.h, falta un campo o el id no sirve.
+static unsigned char *bin_encode_request(json_t *mensaje, size_t *out_len) {
+    static const char *tipos[] = {
+        NULL, "register", "broadcast", "private", "list_users",
+        "user_info", "change_status", "disconnect", "history",
+        "join_room", "leave_room", "room_message"
+    };
+    // Campos de cada tipo en el orden que define binproto.h; todos obligatorios
+    static const char *campos_por_tipo[][2] = {
+        { NULL, NULL },          // 0x00 sin uso
+        { "sender", NULL },      // BIN_REGISTER
+        { "content", NULL },     // BIN_BROADCAST
+        { "target", "content" }, // BIN_PRIVATE
+        { NULL, NULL },          // BIN_LIST_USERS
+        { "target", NULL },      // BIN_USER_INFO
+        { "content", NULL },     // BIN_CHANGE_STATUS
+        { NULL, NULL },          // BIN_DISCONNECT
+        { "content", NULL },     // BIN_HISTORY
+        { "target", NULL },      // BIN_JOIN_ROOM
+        { "target", NULL },      // BIN_LEAVE_ROOM
+        { "target", "content" }, // BIN_ROOM_MESSAGE
+    };
+    const char *type = json_string_value(json_object_get(mensaje, "type"));
+
+    unsigned int code = 0;
+    for (unsigned int i = 1; type && i < sizeof(tipos) / sizeof(tipos[0]); i++) {
+        if (strcmp(type, tipos[i]) == 0) {
+            code = i;
+        }
+    }
+    if (!code) {
+        return NULL;
+    }
+
+    const char *campos[2] = { NULL, NULL };
+    for (int i = 0; i < 2; i++) {
+        if (campos_por_tipo[code][i]) {
+            campos[i] = json_string_value(json_object_get(mensaje, campos_por_tipo[code][i]));
+            if (!campos[i]) {
+                return NULL; // Falta un campo obligatorio o no es cadena
+            }
+        }
+    }
+
+    // El id de la solicitud, si lo hay, va al final como varint: debe ser un
+    // entero entre 0 y UINT32_MAX, lo que el lector de varints acepta
+    json_t *id = json_object_get(mensaje, "id");
+    size_t id_value = 0;
+    if (id) {
+        if (!json_is_integer(id) || json_integer_value(id) < 0 ||
+            json_integer_value(id) > (json_int_t)UINT32_MAX) {
+            return NULL;
+        }
+        id_value = (size_t)json_integer_value(id);
+    }
+
+    size_t len = 1;
+    for (int i = 0; i < 2; i++) {
+        if (campos[i]) {
+            len += bin_str_len(strlen(campos[i]));
+        }
+    }
+    if (id) {
+        len += bin_varint_len(id_value);
+    }
+    unsigned char *buf = malloc(LWS_PRE + len);
+    if (!buf) {
+        return NULL;
+    }
+    unsigned char *p = bin_put_u8(&buf[LWS_PRE], code);
+    for (int i = 0; i < 2; i++) {
+        if (campos[i]) {
+            p = bin_put_str(p, campos[i], strlen(campos[i]));
+        }
+    }
+    if (id) {
+        bin_put_varint(p, id_value);
+    }
+    *out_len = len;
+    return buf;
+}
+
+// Traduce un mensaje binario del servidor al JSON equivalente, para que el
+// resto del cliente no dependa del protocolo negociado. Un tipo que este
+// cliente no conoce devuelve NULL con *desconocido en ese tipo, para que se
+// ignore en vez de tratarlo como un mensaje inválido.
+static json_t *bin_decode_message(const char *in, size_t len, unsigned int *desconocido) {
+    BinReader r = { (const unsigned char *)in, (const unsigned char *)in + len, 0 };
+    *desconocido = 0;
+    unsigned int type = bin_get_u8(&r);
+    time_t ts = (time_t)bin_get_u32(&r);
+    if (r.err) {
+        return NULL;
+    }
+
+    char timestamp[64];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&ts));
+
+    json_t *root = json_object();
+    json_object_set_new(root, "sender", json_string("server"));
+    json_object_set_new(root, "timestamp", json_string(timestamp));
+
+    size_t n;
+    const char *s;
+    switch (type) {
+        case BIN_S_REGISTER_SUCCESS:
+            bin_get_u32(&r);
+            json_object_set_new(root, "type", json_string("register_success"));
+            json_object_set_new(root, "content", json_string("Registro exitoso"));
+            break;
+
+        case BIN_S_REGISTER_ERROR:
+            s = bin_get_str(&r, &n);
+            json_object_set_new(root, "type", json_string("register_error"));
+            json_object_set_new(root, "content", json_stringn(s ? s : "", n));
+            break;
+
+        case BIN_S_BROADCAST:
+        case BIN_S_PRIVATE: {
+            uint32_t de = bin_get_u32(&r);
+            uint32_t para = type == BIN_S_PRIVATE ? bin_get_u32(&r) : 0;
+            s = bin_get_str(&r, &n);
+            json_object_set_new(root, "type", json_string(type == BIN_S_PRIVATE ? "private" : "broadcast"));
+            json_object_set_new(root, "sender", json_string(user_name(de)));
+            if (type == BIN_S_PRIVATE) {
+                json_object_set_new(root, "target", json_string(user_name(para)));
+            }
+            json_object_set_new(root, "content", json_stringn(s ? s : "", n));
+            break;
+        }
+
+        case BIN_S_LIST_USERS: {
+            uint32_t count = bin_get_u32(&r);
+            json_t *lista = json_array();
+            for (uint32_t i = 0; i < count && !r.err; i++) {
+                uint32_t id = bin_get_u32(&r);
+                s = bin_get_str(&r, &n);
+                if (!r.err) {
+                    remember_user(id, s, n);
+                    json_array_append_new(lista, json_string(user_name(id)));
+                }
+            }
+            json_object_set_new(root, "type", json_string("list_users_response"));
+            json_object_set_new(root, "content", lista);
+            bin_get_request_id(&r, root);
+            break;
+        }
+
+        case BIN_S_USER_INFO: {
+            uint32_t id = bin_get_u32(&r);
+            size_t ip_len, st_len;
+            const char *ip = bin_get_str(&r, &ip_len);
+            const char *st = bin_get_str(&r, &st_len);
+            json_object_set_new(root, "type", json_string("user_info_response"));
+            // id 0: el usuario no existe; el nombre sale de la solicitud
+            if (id) {
+                json_t *info = json_object();
+                json_object_set_new(info, "ip", json_stringn(ip ? ip : "", ip_len));
+                json_object_set_new(info, "status", json_stringn(st ? st : "", st_len));
+                json_object_set_new(root, "target", json_string(user_name(id)));
+                json_object_set_new(root, "content", info);
+            }
+            bin_get_request_id(&r, root);
+            break;
+        }
+
+        case BIN_S_STATUS_UPDATE: {
+            uint32_t id = bin_get_u32(&r);
+            s = bin_get_str(&r, &n);
+            json_t *estado = json_object();
+            json_object_set_new(estado, "user", json_string(user_name(id)));
+            json_object_set_new(estado, "status", json_stringn(s ? s : "", n));
+            json_object_set_new(root, "type", json_string("status_update"));
+            json_object_set_new(root, "content", estado);
+            break;
+        }
+
+        case BIN_S_USER_DISCONNECTED: {
+            char texto[MAX_NAME_LEN + 16];
+            snprintf(texto, sizeof(texto), "%s ha salido", user_name(bin_get_u32(&r)));
+            json_object_set_new(root, "type", json_string("user_disconnected"));
+            json_object_set_new(root, "content", json_string(texto));
+            break;
+        }
+
+        case BIN_S_STATUS_BATCH: {
+            uint32_t count = bin_get_u32(&r);
+            json_t *lista = json_array();
+            for (uint32_t i = 0; i < count && !r.err; i++) {
+                uint32_t id = bin_get_u32(&r);
+                s = bin_get_str(&r, &n);
+                json_t *estado = json_object();
+                json_object_set_new(estado, "user", json_string(user_name(id)));
+                json_object_set_new(estado, "status", json_stringn(s ? s : "", n));
+                json_array_append_new(lista, estado);
+            }
+            json_object_set_new(root, "type", json_string("status_batch"));
+            json_object_set_new(root, "content", lista);
+            break;
+        }
+
+        case BIN_S_HISTORY:
+        case BIN_S_OFFLINE: {
+            // Mensaje anterior a la conexión: los nombres van completos
+            size_t fl, tl;
+            const char *de = bin_get_str(&r, &fl);
+            const char *para = bin_get_str(&r, &tl);
+            s = bin_get_str(&r, &n);
+            if (r.err) {
+                break;
+            }
+            json_object_set_new(root, "type", json_string(tl ? "private" : "broadcast"));
+            json_object_set_new(root, "sender", json_stringn(de, fl));
+            if (tl) {
+                json_object_set_new(root, "target", json_stringn(para, tl));
+            }
+            json_object_set_new(root, "content", json_stringn(s, n));
+            json_object_set_new(root, type == BIN_S_OFFLINE ? "offline" : "replay", json_true());
+            break;
+        }
+
+        case BIN_S_QUEUED: {
+            s = bin_get_str(&r, &n);
+            unsigned int ok = bin_get_u8(&r);
+            json_object_set_new(root, "type", json_string(ok ? "queued" : "queue_full"));
+            json_object_set_new(root, "target", json_stringn(s ? s : "", n));
+            break;
+        }
+
+        case BIN_S_USER_JOINED: {
+            uint32_t id = bin_get_u32(&r);
+            s = bin_get_str(&r, &n);
+            if (!r.err) {
+                remember_user(id, s, n);
+            }
+            json_object_set_new(root, "type", json_string("user_joined"));
+            json_object_set_new(root, "content", json_string(user_name(id)));
+            break;
+        }
+
+        case BIN_S_ROOM_RESPONSE: {
+            size_t tl;
+            const char *sala = bin_get_str(&r, &n);
+            unsigned int join = bin_get_u8(&r);
+            s = bin_get_str(&r, &tl);
+            json_object_set_new(root, "type", json_string(join ? "join_room_response" : "leave_room_response"));
+            json_object_set_new(root, "target", json_stringn(sala ? sala : "", n));
+            json_object_set_new(root, "content", json_stringn(s ? s : "", tl));
+            bin_get_request_id(&r, root);
+            break;
+        }
+
+        case BIN_S_ROOM_MESSAGE: {
+            uint32_t de = bin_get_u32(&r);
+            size_t sl;
+            const char *sala = bin_get_str(&r, &sl);
+            s = bin_get_str(&r, &n);
+            json_object_set_new(root, "type", json_string("room_message"));
+            json_object_set_new(root, "sender", json_string(user_name(de)));
+            json_object_set_new(root, "target", json_stringn(sala ? sala : "", sl));
+            json_object_set_new(root, "content", json_stringn(s ? s : "", n));
+            break;
+        }
+
+        default:
+            // Un servidor más nuevo puede tener tipos que aquí no existen
+            *desconocido = type;
+            json_decref(root);
+            return NULL;
+    }
+
+    if (r.err) {
+        json_decref(root);
+        return NULL;
+    }
+    return root;
+}
+
+// Mensaje serializado que espera a LWS_CALLBACK_CLIENT_WRITEABLE
+typedef struct salida {
+    struct salida *next;
+    unsigned char *buf; // Con LWS_PRE libre al inicio
+    size_t len;
+    int binary;
+} salida_t;
+
+static salida_t *salida_head = NULL;
+static salida_t *salida_tail = NULL;
+static int salida_count = 0;
+
+// Serializa el mensaje y lo deja en la cola de salida; se escribe cuando el
+// socket acepta datos
+static int send_json(json_t *mensaje) {
+    unsigned char *buf;
+    size_t len;
+
+    if (binary_mode) {
+        buf = bin_encode_request(mensaje, &len);
+        json_decref(mensaje);
+        if (!buf) {
+            return -1;
+        }
+    } else {
+        char *texto = json_dumps(mensaje, JSON_COMPACT);
+        json_decref(mensaje);
+        if (!texto) {
+            return -1;
+        }
+        len = strlen(texto);
+        buf = malloc(LWS_PRE + len);
+        if (buf) {
+            memcpy(&buf[LWS_PRE], texto, len);
+        }
+        free(texto);
+        if (!buf) {
+            return -1;
+        }
+    }
+
+    salida_t *s = malloc(sizeof(salida_t));
+    if (!s || !global_wsi) {
+        free(s);
+        free(buf);
+        return -1;
+    }
+    s->next = NULL;
+    s->buf = buf;
+    s->len = len;
+    s->binary = binary_mode;
+    if (salida_tail) {
+        salida_tail->next = s;
+    } else {
+        salida_head = s;
+    }
+    salida_tail = s;
+    salida_count++;
+    lws_callback_on_writable(global_wsi);
+    return 0;
+}
+
+static void salida_free_all(void) {
+    while (salida_head) {
+        salida_t *next = salida_head->next;
+        free(salida_head->buf);
+        free(salida_head);
+        salida_head = next;
+    }
+    salida_tail = NULL;
+    salida_count = 0;
+}
+
+// ---------------- Solicitudes en curso ----------------
+// list_users y user_info llevan un "id" que el servidor devuelve en la
+// respuesta, así que puede haber varias en vuelo sin bloquear el menú. Si
+// el servidor no devuelve id, se empareja con la más antigua del mismo tipo
+// (responde en orden).
+
+#define MAX_PENDING_REQUESTS 64
+
+typedef struct {
+    uint32_t id;
+    char response[32];         // Tipo de la respuesta esperada
+    char target[MAX_NAME_LEN]; // Usuario consultado, si aplica
+} pending_request_t;
+
+static pending_request_t pending[MAX_PENDING_REQUESTS];
+static int pending_count = 0;
+static uint32_t next_request_id = 1;
+
+// Asigna un id a la solicitud, la registra y la envía
+static int send_request(json_t *mensaje, const char *target) {
+    const char *type = json_string_value(json_object_get(mensaje, "type"));
+    if (pending_count == MAX_PENDING_REQUESTS) {
+        // Sin lugar: se olvida la más antigua
+        memmove(&pending[0], &pending[1], (MAX_PENDING_REQUESTS - 1) * sizeof(pending_request_t));
+        pending_count--;
+    }
+    pending_request_t *p = &pending[pending_count++];
+    p->id = next_request_id++;
+    snprintf(p->response, sizeof(p->response), "%s_response", type ? type : "");
+    snprintf(p->target, sizeof(p->target), "%s", target ? target : "");
+
+    json_object_set_new(mensaje, "id", json_integer(p->id));
+    return send_json(mensaje);
+}
+
+// Quita la solicitud que corresponde a la respuesta; copia su target si se
+// pide. Devuelve 0 si no había ninguna.
+static int pending_take(const char *response, json_t *id, char *target) {
+    int i = 0;
+    while (i < pending_count &&
+           (json_is_integer(id) ? pending[i].id != (uint32_t)json_integer_value(id)
+                                : strcmp(pending[i].response, response) != 0)) {
+        i++;
+    }
+    if (i == pending_count) {
+        return 0;
+    }
+    if (target) {
+        snprintf(target, MAX_NAME_LEN, "%s", pending[i].target);
+    }
+    pending_count--;
+    memmove(&pending[i], &pending[i + 1], (pending_count - i) * sizeof(pending_request_t));
+    return 1;
+}
+
+// ---------------- Entrada del teclado ----------------
+// stdin se atiende en el mismo bucle de lws que el websocket: la terminal va
+// sin modo canónico ni eco y la línea se edita aquí, así que los mensajes que
+// llegan mientras se escribe se muestran sin perder lo escrito.
+
+typedef enum {
+    UI_MENU,           // Esperando una opción del menú
+    UI_BROADCAST,      // Chat con todos
+    UI_PRIVATE_TARGET, // Pidiendo el nombre del otro usuario
+    UI_PRIVATE,        // Chat privado con current_private_chat
+    UI_STATUS,         // Eligiendo el nuevo estado
+    UI_INFO_TARGET     // Pidiendo el usuario para user_info
+} ui_state_t;
+
+static ui_state_t ui_state = UI_MENU;
+static char linea[MAX_MESSAGE_LEN];
+static size_t linea_len = 0;
+static int salir = 0;
+static int codigo_salida = 0; // Lo que devuelve main
+
+static struct termios term_original;
+static int term_raw = 0;
+
+static void term_restore(void) {
+    if (term_raw) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &term_original);
+        term_raw = 0;
+    }
+}
+
+static void term_set_raw(void) {
+    if (tcgetattr(STDIN_FILENO, &term_original) != 0) {
+        return; // No es una terminal
+    }
+    struct termios t = term_original;
+    t.c_lflag &= ~(ICANON | ECHO); // Desactivar modo canónico y eco
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &t);
+    term_raw = 1;
+    atexit(term_restore);
+}
+
+static const char *prompt_actual(void) {
+    switch (ui_state) {
+        case UI_MENU:
+        case UI_STATUS:
+            return "Seleccione una opción: ";
+        case UI_PRIVATE_TARGET:
+        case UI_INFO_TARGET:
+            return "Ingrese el nombre del usuario: ";
+        default:
+            return "";
+    }
+}
+
+// Vuelve a escribir el prompt y lo que lleva escrito el usuario
+static void prompt_redraw(void) {
+    printf("%s%.*s", prompt_actual(), (int)linea_len, linea);
+    fflush(stdout);
+}
+
+// Borra la línea que se está editando antes de imprimir otra cosa
+static void prompt_clear(void) {
+    printf("\r\033[K");
+}
+
+// ---------------- Pantalla ----------------
+// Los mensajes nuevos se agregan encima de la línea que se está editando; la
+// pantalla solo se limpia y se repinta al cambiar de modo o de tamaño.
+
+// SIGWINCH solo marca repintar y escribe un byte en resize_pipe, cuyo
+// extremo de lectura atiende el bucle de lws (protocolo "ventana")
+static volatile sig_atomic_t repintar = 0;
+static int resize_pipe[2] = { -1, -1 };
+
+static void on_sigwinch(int sig) {
+    (void)sig;
+    int guardado = errno;
+    repintar = 1;
+    // Si la tubería está llena ya hay un aviso pendiente
+    ssize_t n = write(resize_pipe[1], "", 1);
+    (void)n;
+    errno = guardado;
+}
+
+static int resize_pipe_open(void) {
+    if (pipe(resize_pipe) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(resize_pipe[i], F_SETFL, fcntl(resize_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(resize_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
+// Filas de la terminal disponibles para el historial
+static int screen_history_rows(void) {
+    struct winsize ws;
+    int filas = 24;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0) {
+        filas = ws.ws_row;
+    }
+    filas -= 3; // Encabezado, línea en blanco y la línea de entrada
+    return filas > 1 ? filas : 1;
+}
+
+// Imprime una línea por encima de la entrada sin perder lo escrito
+static void print_above(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void print_above(const char *fmt, ...) {
+    va_list ap;
+    prompt_clear();
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    prompt_redraw();
+}
+
+static void screen_clear(void) {
+    printf("\033[H\033[2J");
+}
+
+void redraw_broadcast_screen() {
+    screen_clear();
+    printf("Modo broadcast activado. Presiona ESC para volver al menú.\n\n");
+
+    // Imprimir solo los últimos mensajes que caben en la pantalla
+    int desde = broadcast_conv.count - screen_history_rows();
+    for (int i = desde > 0 ? desde : 0; i < broadcast_conv.count; i++) {
+        const chat_line_t *l = conversation_line(&broadcast_conv, i);
+        printf("%s: %s\n", l->sender, conversation_text(&broadcast_conv, l));
+    }
+    prompt_redraw();
 }
 
 void redraw_private_chat_screen() {
-    system("clear");
+    screen_clear();
+    printf("Chateando con %s. Presiona ESC para volver al menú.\n\n", current_private_chat);
+
+    conversation_t *c = conversation_get(current_private_chat, 0);
+    int desde = c ? c->count - screen_history_rows() : 0;
+    for (int i = desde > 0 ? desde : 0; c && i < c->count; i++) {
+        const chat_line_t *l = conversation_line(c, i);
+        printf("[Privado] %s: %s\n", l->sender, conversation_text(c, l));
+    }
+    prompt_redraw();
+}
 
-    // Mostrar los mensajes privados
-    for (int i = 0; i < private_message_count; i++) {
-        if (strcmp(private_messages[i].sender, current_private_chat) == 0 || (strcmp(private_messages[i].sender, username) == 0 && strcmp(private_messages[i].target, current_private_chat) == 0)) {
-            printf("[Privado] %s: %s\n", private_messages[i].sender, private_messages[i].content);
+// Repinta tras un cambio de tamaño; en el menú no hay nada que repintar
+static void screen_resized(void) {
+    repintar = 0;
+    if (ui_state == UI_BROADCAST) {
+        redraw_broadcast_screen();
+    } else if (ui_state == UI_PRIVATE) {
+        redraw_private_chat_screen();
+    }
+}
+
+static int callback_resize(struct lws *wsi, enum lws_callback_reasons reason,
+                           void *user, void *in, size_t len) {
+    if (reason == LWS_CALLBACK_RAW_RX_FILE) {
+        // Varias señales seguidas se atienden con un solo repintado
+        char buf[64];
+        while (read(resize_pipe[0], buf, sizeof(buf)) > 0) {
+        }
+        if (repintar) {
+            screen_resized();
         }
     }
+    return 0;
+}
+
+static void show_menu(void) {
+    ui_state = UI_MENU;
+    printf("\n--- MENÚ DE OPCIONES ---\n");
+    printf("1. Chatear con todos los usuarios (broadcasting)\n");
+    printf("2. Mensajes directos\n");
+    printf("3. Cambiar de estado\n");
+    printf("4. Usuarios conectados\n");
+    printf("5. Información de un usuario\n");
+    printf("6. Ayuda\n");
+    printf("7. Salir\n");
+    prompt_redraw();
+}
 
-    printf("\nChateando con %s. Presiona ESC para volver al menú.\n", current_private_chat);
+// Guarda el mensaje en la conversación con el otro usuario, sea quien sea el remitente
+static void store_private(const char *sender, const char *target, const char *content) {
+    conversation_t *c = conversation_get(strcmp(sender, username) == 0 ? target : sender, 1);
+    if (c) {
+        conversation_append(c, sender, content);
+    }
 }
 
-// Función para manejar la recepción de mensajes
-void *receive_messages(void *arg) {
-    struct lws_context *context = (struct lws_context *)arg;
-    while (1) {
-        pthread_mutex_lock(&writing_mutex);
-        if (!is_writing) {
-            lws_service(context, 0);
+// Atiende una línea completa según lo que se le pidió al usuario
+static void handle_line(const char *texto) {
+    switch (ui_state) {
+        case UI_MENU: {
+            int opcion = atoi(texto);
+            switch (opcion) {
+                case 1:
+                    ui_state = UI_BROADCAST;
+                    in_broadcast_mode = 1;
+                    redraw_broadcast_screen();
+                    break;
+                case 2:
+                    ui_state = UI_PRIVATE_TARGET;
+                    prompt_redraw();
+                    break;
+                case 3:
+                    ui_state = UI_STATUS;
+                    printf("\nSeleccione un nuevo estado:\n");
+                    printf("1. ACTIVO\n");
+                    printf("2. OCUPADO\n");
+                    printf("3. INACTIVO\n");
+                    prompt_redraw();
+                    break;
+                case 4: {
+                    // Crear mensaje JSON para solicitar la lista de usuarios
+                    json_t *json_list_request = json_object();
+                    json_object_set_new(json_list_request, "type", json_string("list_users"));
+                    json_object_set_new(json_list_request, "sender", json_string(username));
+                    printf("Solicitando lista de usuarios...\n");
+                    send_request(json_list_request, NULL);
+                    show_menu();
+                    break;
+                }
+                case 5:
+                    ui_state = UI_INFO_TARGET;
+                    prompt_redraw();
+                    break;
+                case 6:
+                    printf("Ayuda: Elija una opción y siga las instrucciones.\n");
+                    show_menu();
+                    break;
+                case 7:
+                    printf("Saliendo del chat...\n");
+                    salir = 1;
+                    break;
+                default:
+                    printf("Opción inválida. Intente de nuevo.\n");
+                    show_menu();
+            }
+            break;
+        }
+
+        case UI_BROADCAST: {
+            // No enviar si no escribió nada
+            if (!texto[0]) {
+                break;
+            }
+            // Crear JSON {"type": "broadcast", "sender": "usuario", "content": "texto"}
+            json_t *json_mensaje = json_object();
+            json_object_set_new(json_mensaje, "type", json_string("broadcast"));
+            json_object_set_new(json_mensaje, "sender", json_string(username));
+            json_object_set_new(json_mensaje, "content", json_string(texto));
+            send_json(json_mensaje);
+            break;
+        }
+
+        case UI_PRIVATE_TARGET:
+            snprintf(current_private_chat, sizeof(current_private_chat), "%s", texto);
+            ui_state = UI_PRIVATE;
+            in_private_chat = 1;
+            redraw_private_chat_screen();
+            break;
+
+        case UI_PRIVATE: {
+            if (!texto[0]) {
+                break;
+            }
+            // Crear JSON {"type": "private", "sender": "usuario", "target": "destino", "content": "mensaje"}
+            json_t *json_mensaje = json_object();
+            json_object_set_new(json_mensaje, "type", json_string("private"));
+            json_object_set_new(json_mensaje, "sender", json_string(username));
+            json_object_set_new(json_mensaje, "target", json_string(current_private_chat));
+            json_object_set_new(json_mensaje, "content", json_string(texto));
+            store_private(username, current_private_chat, texto);
+
+            // El remitente ve su propio mensaje sin repintar el chat
+            print_above("[Privado] %s: %s\n", username, texto);
+            send_json(json_mensaje);
+            break;
+        }
+
+        case UI_STATUS: {
+            static const char *estados[] = { "ACTIVO", "OCUPADO", "INACTIVO" };
+            int estado_opcion = atoi(texto);
+            if (estado_opcion < 1 || estado_opcion > 3) {
+                printf("Opción inválida. Estado no cambiado.\n");
+                show_menu();
+                break;
+            }
+            const char *nuevo_estado = estados[estado_opcion - 1];
+
+            // Crear mensaje JSON para cambiar estado
+            json_t *json_status = json_object();
+            json_object_set_new(json_status, "type", json_string("change_status"));
+            json_object_set_new(json_status, "sender", json_string(username));
+            json_object_set_new(json_status, "content", json_string(nuevo_estado));
+            send_json(json_status);
+
+            printf("Estado cambiado a: %s\n", nuevo_estado);
+            show_menu();
+            break;
+        }
+
+        case UI_INFO_TARGET: {
+            printf("Solicitando información sobre el usuario %s...\n", texto);
+
+            // Crear mensaje JSON para solicitar la información del usuario
+            json_t *json_user_info_request = json_object();
+            json_object_set_new(json_user_info_request, "type", json_string("user_info"));
+            json_object_set_new(json_user_info_request, "sender", json_string(username));
+            json_object_set_new(json_user_info_request, "target", json_string(texto));
+            send_request(json_user_info_request, texto);
+            show_menu();
+            break;
+        }
+    }
+}
+
+// Procesa las teclas que llegaron por stdin
+static void handle_input(const char *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)buf[i];
+
+        if (c == 27) { // 27 es el código ASCII de ESC
+            // Las flechas y demás teclas especiales llegan como ESC [ ...
+            if (i + 1 < n && buf[i + 1] == '[') {
+                i++;
+                while (i + 1 < n && !((buf[i + 1] >= 'A' && buf[i + 1] <= 'Z') || buf[i + 1] == '~')) {
+                    i++;
+                }
+                i++;
+                continue;
+            }
+            if (ui_state == UI_BROADCAST) {
+                printf("\nSaliendo del modo broadcast...\n");
+                in_broadcast_mode = 0;
+            } else if (ui_state == UI_PRIVATE) {
+                printf("\nSaliendo del chat privado con %s...\n", current_private_chat);
+                in_private_chat = 0;
+            } else {
+                continue;
+            }
+            linea_len = 0;
+            show_menu();
+        } else if (c == '\n' || c == '\r') {
+            // En los chats la línea escrita se borra: el mensaje vuelve formateado
+            if (ui_state == UI_BROADCAST || ui_state == UI_PRIVATE) {
+                prompt_clear();
+            } else {
+                printf("\n");
+            }
+            linea[linea_len] = '\0';
+            linea_len = 0;
+            handle_line(linea);
+        } else if (c == 127 || c == '\b') {
+            // Borrar un carácter completo aunque ocupe varios bytes UTF-8
+            while (linea_len > 0 && ((unsigned char)linea[linea_len - 1] & 0xc0) == 0x80) {
+                linea_len--;
+            }
+            if (linea_len > 0) {
+                linea_len--;
+                printf("\b \b");
+            }
+        } else if (c == 4 && linea_len == 0) { // Ctrl-D
+            salir = 1;
+        } else if ((c >= 32 || c == '\t') && linea_len < sizeof(linea) - 1) {
+            linea[linea_len++] = (char)c;
+            putchar(c);
+        }
+    }
+    fflush(stdout);
+}
+
+// ---------------- Modo script ----------------
+// Con --script el cliente no muestra menú: lee una orden por línea de un
+// archivo o de stdin, la encola y la envía en CLIENT_WRITEABLE, y escribe
+// cada mensaje del servidor como una línea JSON en stdout (NDJSON). Las
+// líneas pueden ser:
+//   {...}                 solicitud JSON tal cual (sender se completa)
+//   /msg <usuario> <txt>  mensaje privado
+//   /status <ESTADO>      cambio de estado
+//   /list                 usuarios conectados
+//   /info <usuario>       información de un usuario
+//   cualquier otro texto  broadcast
+
+#define SCRIPT_READ_LEN (64 * 1024)
+#define SCRIPT_MAX_PENDING 4096 // Mensajes encolados antes de dejar de leer
+#define SCRIPT_LINGER_SECS 1    // Espera por respuestas al terminar la entrada
+
+static int script_mode = 0;
+static int entrada_fd = STDIN_FILENO;
+static struct lws *entrada_wsi = NULL;
+static int script_eof = 0;
+static int script_paused = 0;
+static int script_skipping = 0; // Descartando una línea demasiado larga hasta su '\n'
+static unsigned long script_lineno = 0;
+static time_t script_last_rx = 0;
+
+static char *script_buf = NULL; // Línea incompleta de la lectura anterior
+static size_t script_len = 0;
+static size_t script_cap = 0;
+
+static json_t *script_request(const char *type) {
+    json_t *mensaje = json_object();
+    json_object_set_new(mensaje, "type", json_string(type));
+    json_object_set_new(mensaje, "sender", json_string(username));
+    return mensaje;
+}
+
+// Separa "<palabra> <resto>"; devuelve el resto o NULL si no hay palabra
+static char *script_split(char *s) {
+    while (*s == ' ') {
+        s++;
+    }
+    char *resto = strchr(s, ' ');
+    if (!resto || resto == s) {
+        return NULL;
+    }
+    *resto++ = '\0';
+    return resto;
+}
+
+static void script_line(char *line, size_t len) {
+    json_t *mensaje = NULL;
+
+    script_lineno++;
+    if (len && line[len - 1] == '\r') {
+        line[--len] = '\0';
+    }
+    if (!len) {
+        return;
+    }
+
+    if (line[0] == '{') {
+        json_error_t error;
+        mensaje = json_loadb(line, len, 0, &error);
+        if (!json_is_object(mensaje)) {
+            fprintf(stderr, "Línea %lu: JSON inválido: %s\n", script_lineno,
+                    mensaje ? "no es un objeto" : error.text);
+            json_decref(mensaje);
+            return;
+        }
+        if (!json_object_get(mensaje, "sender")) {
+            json_object_set_new(mensaje, "sender", json_string(username));
+        }
+    } else if (strncmp(line, "/msg ", 5) == 0) {
+        char *content = script_split(&line[5]);
+        if (!content) {
+            fprintf(stderr, "Línea %lu: uso /msg <usuario> <mensaje>\n", script_lineno);
+            return;
+        }
+        mensaje = script_request("private");
+        json_object_set_new(mensaje, "target", json_string(line + 5 + strspn(line + 5, " ")));
+        json_object_set_new(mensaje, "content", json_string(content));
+    } else if (strncmp(line, "/status ", 8) == 0) {
+        mensaje = script_request("change_status");
+        json_object_set_new(mensaje, "content", json_string(&line[8]));
+    } else if (strcmp(line, "/list") == 0) {
+        mensaje = script_request("list_users");
+    } else if (strncmp(line, "/info ", 6) == 0) {
+        mensaje = script_request("user_info");
+        json_object_set_new(mensaje, "target", json_string(&line[6]));
+    } else {
+        mensaje = script_request("broadcast");
+        json_object_set_new(mensaje, "content", json_string(line));
+    }
+
+    if (send_json(mensaje) < 0) {
+        fprintf(stderr, "Línea %lu: no se pudo codificar la solicitud "
+                "(tipo desconocido, falta un campo o id inválido)\n", script_lineno);
+    }
+}
+
+// Procesa las líneas completas que hay en script_buf
+static void script_consume(void) {
+    size_t inicio = 0;
+    char *nl;
+    if (script_skipping) {
+        nl = memchr(script_buf, '\n', script_len);
+        if (!nl) {
+            script_len = 0;
+            return;
+        }
+        // Termina la línea descartada; cuenta como una más
+        script_skipping = 0;
+        script_lineno++;
+        inicio = nl - script_buf + 1;
+    }
+    while ((nl = memchr(&script_buf[inicio], '\n', script_len - inicio))) {
+        *nl = '\0';
+        script_line(&script_buf[inicio], nl - &script_buf[inicio]);
+        inicio = nl - script_buf + 1;
+    }
+    script_len -= inicio;
+    memmove(script_buf, &script_buf[inicio], script_len);
+}
+
+// Lee lo que haya disponible; devuelve -1 al terminar la entrada
+static int script_read(struct lws *wsi) {
+    if (script_cap - script_len < SCRIPT_READ_LEN) {
+        if (script_len > MAX_INCOMING_LEN) {
+            fprintf(stderr, "Línea %lu demasiado larga, descartada\n", script_lineno + 1);
+            script_len = 0;
+            script_skipping = 1;
+        }
+        size_t cap = script_len + 2 * SCRIPT_READ_LEN;
+        char *nuevo = realloc(script_buf, cap);
+        if (!nuevo) {
+            return -1;
+        }
+        script_buf = nuevo;
+        script_cap = cap;
+    }
+
+    ssize_t n = read(entrada_fd, &script_buf[script_len], SCRIPT_READ_LEN);
+    if (n <= 0) {
+        // La última línea puede no terminar en salto de línea
+        if (script_len) {
+            script_buf[script_len] = '\0';
+            script_line(script_buf, script_len);
+            script_len = 0;
+        }
+        script_eof = 1;
+        script_last_rx = time(NULL);
+        return -1;
+    }
+    script_len += (size_t)n;
+    script_consume();
+
+    // Si el servidor no da abasto se deja de leer hasta vaciar la cola
+    if (salida_count >= SCRIPT_MAX_PENDING) {
+        lws_rx_flow_control(wsi, 0);
+        script_paused = 1;
+    }
+    return 0;
+}
+
+// Escribe un mensaje del servidor como una línea de NDJSON; stdout va con
+// búfer completo y se vacía una vez por vuelta del bucle
+static void script_emit(const char *datos, size_t len) {
+    if (binary_mode) {
+        unsigned int desconocido;
+        json_t *root = bin_decode_message(datos, len, &desconocido);
+        if (desconocido) {
+            fprintf(stderr, "Mensaje binario de tipo desconocido 0x%02x, ignorado\n", desconocido);
+            return;
+        }
+        if (!root) {
+            fprintf(stderr, "Mensaje binario inválido del servidor\n");
+            return;
+        }
+        json_dumpf(root, stdout, JSON_COMPACT);
+        json_decref(root);
+    } else {
+        // El servidor ya envía JSON compacto en una línea
+        fwrite(datos, 1, len, stdout);
+    }
+    putchar('\n');
+    script_last_rx = time(NULL);
+}
+
+static int callback_stdin(struct lws *wsi, enum lws_callback_reasons reason,
+                          void *user, void *in, size_t len) {
+    switch (reason) {
+        case LWS_CALLBACK_RAW_RX_FILE: {
+            if (script_mode) {
+                return script_read(wsi);
+            }
+            char buf[256];
+            ssize_t n = read(entrada_fd, buf, sizeof(buf));
+            if (n <= 0) {
+                salir = 1;
+                return -1;
+            }
+            handle_input(buf, (size_t)n);
+            if (salir) {
+                lws_cancel_service(lws_get_context(wsi));
+            }
+            break;
+        }
+
+        case LWS_CALLBACK_RAW_CLOSE_FILE:
+            // En modo script se sigue hasta vaciar la cola de salida
+            entrada_wsi = NULL;
+            if (!script_mode) {
+                salir = 1;
+            }
+            break;
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+// ---------------- Mensajes del servidor ----------------
+
+static void handle_server_message(json_t *root) {
+    const char *type = json_string_value(json_object_get(root, "type"));
+    if (!type) {
+        return;
+    }
+
+    if (strcmp(type, "register_error") == 0) {
+        // Sin registro el servidor ignora los mensajes de esta conexión
+        const char *content = json_string_value(json_object_get(root, "content"));
+        print_above("No se pudo registrar a %s: %s\n", username, content ? content : "sin motivo");
+        codigo_salida = 1;
+        salir = 1;
+    }
+    else if (strcmp(type, "broadcast") == 0) {
+        const char *sender = json_string_value(json_object_get(root, "sender"));
+        const char *content = json_string_value(json_object_get(root, "content"));
+
+        if (sender && content) {
+            // Agregar el mensaje al historial; si está lleno se pierde el más antiguo
+            conversation_append(&broadcast_conv, sender, content);
+
+            // En modo broadcast basta con agregar la línea
+            if (in_broadcast_mode) {
+                print_above("%s: %s\n", sender, content);
+            }
+        }
+    }
+    else if (strcmp(type, "queued") == 0 || strcmp(type, "queue_full") == 0) {
+        const char *target = json_string_value(json_object_get(root, "target"));
+        if (strcmp(type, "queued") == 0) {
+            print_above("%s no está conectado: el mensaje se entregará cuando entre\n", target ? target : "?");
+        } else {
+            print_above("El buzón de %s está lleno, el mensaje no se guardó\n", target ? target : "?");
+        }
+    }
+    else if (strcmp(type, "private") == 0) {
+        const char *sender = json_string_value(json_object_get(root, "sender"));
+        const char *target = json_string_value(json_object_get(root, "target"));
+        const char *content = json_string_value(json_object_get(root, "content"));
+
+        if (sender && target && content) {
+            // Guardar mensaje en el historial de mensajes privados
+            store_private(sender, target, content);
+
+            // Mostrar el mensaje solo si estamos en el chat privado con ese usuario.
+            // Los del historial que reenvía el servidor no se anuncian.
+            int replay = json_is_true(json_object_get(root, "replay"));
+            if (in_private_chat && strcmp(current_private_chat, sender) == 0) {
+                print_above("[Privado] %s: %s\n", sender, content);
+            } else if (!replay) {
+                print_above("Nuevo mensaje privado de %s: %s\n", sender, content);
+            }
         }
-        pthread_mutex_unlock(&writing_mutex);
-        usleep(100000); // Pequeño delay para evitar consumir mucho CPU
     }
-    return NULL;
+    else if (strcmp(type, "list_users_response") == 0) {
+        pending_take(type, json_object_get(root, "id"), NULL);
+        prompt_clear();
+        printf("\nUsuarios conectados:\n");
+        json_t *user_list = json_object_get(root, "content");
+
+        if (json_is_array(user_list)) {
+            size_t index;
+            json_t *value;
+            json_array_foreach(user_list, index, value) {
+                const char *usuario = json_string_value(value);
+                if (usuario) {
+                    printf("- %s\n", usuario);
+                }
+            }
+        }
+        prompt_redraw();
+    }
+    else if (strcmp(type, "user_info_response") == 0) {
+        // Respuesta de la información de un usuario específico; si no trae
+        // el nombre se toma de la solicitud
+        char solicitado[MAX_NAME_LEN] = "?";
+        pending_take(type, json_object_get(root, "id"), solicitado);
+        const char *target = json_string_value(json_object_get(root, "target"));
+        if (!target) {
+            target = solicitado;
+        }
+        json_t *content = json_object_get(root, "content");
+
+        prompt_clear();
+        if (content && json_is_object(content)) {
+            const char *ip = json_string_value(json_object_get(content, "ip"));
+            const char *status = json_string_value(json_object_get(content, "status"));
+
+            printf("\nInformación del usuario %s:\n", target);
+            printf("IP: %s\n", ip ? ip : "No disponible");
+            printf("Estado: %s\n", status ? status : "No disponible");
+        }
+        else {
+            printf("Error: No se encontró información para el usuario %s\n", target);
+        }
+        prompt_redraw();
+    }
 }
 
 static int callback_client(struct lws *wsi, enum lws_callback_reasons reason,
                            void *user, void *in, size_t len) {
     switch (reason) {
-        case LWS_CALLBACK_CLIENT_ESTABLISHED:
-            printf("Conexión WebSocket establecida\n");
+        case LWS_CALLBACK_CLIENT_ESTABLISHED: {
+            binary_mode = strcmp(lws_get_protocol(wsi)->name, BIN_PROTOCOL) == 0;
+            if (!script_mode) {
+                printf("Conexión WebSocket establecida (%s)\n", lws_get_protocol(wsi)->name);
+            }
             global_wsi = wsi;
 
-            char mensaje[MAX_MESSAGE_LEN];
-            snprintf(mensaje, sizeof(mensaje),
-                        "{\"type\": \"register\", \"sender\": \"%s\"}", username);
-
-            size_t mensaje_len = strlen(mensaje);
-            unsigned char buffer[LWS_PRE + MAX_MESSAGE_LEN];
-            memcpy(&buffer[LWS_PRE], mensaje, mensaje_len);
-            lws_write(wsi, &buffer[LWS_PRE], mensaje_len, LWS_WRITE_TEXT);
+            if (deflate_enabled) {
+                // Si el servidor no aceptó la extensión esto no hace nada
+                char valor[8];
+                snprintf(valor, sizeof(valor), "%d", deflate_window_bits);
+                lws_set_extension_option(wsi, "permessage-deflate", "client_max_window_bits", valor);
+                snprintf(valor, sizeof(valor), "%d", deflate_level);
+                lws_set_extension_option(wsi, "permessage-deflate", "compression_level", valor);
+            }
 
-            // Activar el flujo de escritura
-            lws_callback_on_writable(wsi);
+            json_t *registro = json_object();
+            json_object_set_new(registro, "type", json_string("register"));
+            json_object_set_new(registro, "sender", json_string(username));
+            send_json(registro);
+
+            // A partir de aquí el teclado (o el script) se atiende en el mismo bucle
+            lws_sock_file_fd_type fd;
+            fd.filefd = entrada_fd;
+            entrada_wsi = lws_adopt_descriptor_vhost(lws_get_vhost(wsi), LWS_ADOPT_RAW_FILE_DESC, fd,
+                                                     "entrada", NULL);
+            if (!entrada_wsi) {
+                fprintf(stderr, "No se pudo atender la entrada estándar\n");
+                salir = 1;
+                break;
+            }
+            if (script_mode) {
+                break;
+            }
+            if (resize_pipe[0] >= 0) {
+                fd.filefd = resize_pipe[0];
+                if (!lws_adopt_descriptor_vhost(lws_get_vhost(wsi), LWS_ADOPT_RAW_FILE_DESC, fd,
+                                                "ventana", NULL)) {
+                    fprintf(stderr, "No se podrán atender los cambios de tamaño\n");
+                }
+            }
+            term_set_raw();
+            show_menu();
             break;
+        }
 
-        case LWS_CALLBACK_CLIENT_RECEIVE:
-            char mensaje_local[MAX_MESSAGE_LEN];
-            memcpy(mensaje_local, in, len);
-            mensaje_local[len] = '\0'; // Asegurar que sea una cadena válida
-
-            // Parsear JSON
-            json_t *root;
-            json_error_t error;
-            root = json_loads(mensaje_local, 0, &error);
+        case LWS_CALLBACK_CLIENT_WRITEABLE: {
+            // Un mensaje por turno; si quedan más se pide otro
+            salida_t *s = salida_head;
+            if (!s) {
+                break;
+            }
+            int n = lws_write(wsi, &s->buf[LWS_PRE], s->len,
+                              s->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+            salida_head = s->next;
+            if (!salida_head) {
+                salida_tail = NULL;
+            }
+            salida_count--;
+            free(s->buf);
+            free(s);
+            if (n < 0) {
+                return -1;
+            }
+            if (salida_head) {
+                lws_callback_on_writable(wsi);
+            }
+            // La cola bajó a la mitad: volver a leer el script
+            if (script_paused && entrada_wsi && salida_count < SCRIPT_MAX_PENDING / 2) {
+                lws_rx_flow_control(entrada_wsi, 1);
+                script_paused = 0;
+            }
+            break;
+        }
 
-            if (!root) {
-                printf("Error al parsear JSON: %s\n", error.text);
+        case LWS_CALLBACK_CLIENT_RECEIVE: {
+            // Acumular los trozos hasta el final del mensaje
+            if (rx_len + len > MAX_INCOMING_LEN) {
+                fprintf(stderr, "Mensaje del servidor demasiado grande, descartado\n");
+                rx_len = 0;
                 return 1;
             }
-    
-            const char *type = json_string_value(json_object_get(root, "type"));
-        
-            if (!awaiting_response) {
-
-                if (type && strcmp(type, "broadcast") == 0) {
-
-                    const char *sender = json_string_value(json_object_get(root, "sender"));
-                    const char *content = json_string_value(json_object_get(root, "content"));
-            
-                    if (sender && content) {
-                        // Guardar mensaje en un buffer global para mostrarlo luego
-                        char formatted_message[MAX_MESSAGE_LEN];
-                        snprintf(formatted_message, sizeof(formatted_message), "%s: %s", sender, content);
-            
-                        // Agregar el mensaje al historial de mensajes
-                        if (broadcast_count < MAX_BROADCAST_MESSAGES) {
-                            strcpy(broadcast_messages[broadcast_count], formatted_message);
-                            broadcast_count++;
-                        } else {
-                            // Desplazar mensajes antiguos para hacer espacio
-                            for (int i = 1; i < MAX_BROADCAST_MESSAGES; i++) {
-                                strcpy(broadcast_messages[i - 1], broadcast_messages[i]);
-                            }
-                            strcpy(broadcast_messages[MAX_BROADCAST_MESSAGES - 1], formatted_message);
-                        }
-            
-                        // Volver a dibujar la pantalla en modo broadcast
-                        if (in_broadcast_mode) {
-                            redraw_broadcast_screen();
-                        }
-                    }
+            if (rx_len + len > rx_cap) {
+                size_t cap = rx_cap ? rx_cap : MAX_MESSAGE_LEN;
+                while (cap < rx_len + len) {
+                    cap *= 2;
                 }
-                else if (type && strcmp(type, "private") == 0) {
-                    
-                    const char *sender = json_string_value(json_object_get(root, "sender"));
-                    const char *target = json_string_value(json_object_get(root, "target"));
-                    const char *content = json_string_value(json_object_get(root, "content"));
-            
-                    if (sender && target && content) {
-                        // Guardar mensaje en el historial de mensajes privados
-                        if (private_message_count < MAX_PRIVATE_MESSAGES) {
-                            snprintf(private_messages[private_message_count].sender, MAX_MESSAGE_LEN, "%s", sender);
-                            snprintf(private_messages[private_message_count].content, MAX_MESSAGE_LEN, "%s", content);
-                            snprintf(private_messages[private_message_count].target, MAX_MESSAGE_LEN, "%s", target);
-                            private_message_count++;
-                        }
-            
-                        // Mostrar el mensaje solo si estamos en el chat privado con ese usuario
-                        if (in_private_chat && strcmp(current_private_chat, sender) == 0) {
-                            redraw_private_chat_screen();
-                        } else {
-                            printf("\nNuevo mensaje privado de %s: %s\n", sender, content);
-                        }
-                    }
+                char *nuevo = realloc(rx_buf, cap);
+                if (!nuevo) {
+                    rx_len = 0;
+                    return 1;
                 }
+                rx_buf = nuevo;
+                rx_cap = cap;
+            }
+            memcpy(&rx_buf[rx_len], in, len);
+            rx_len += len;
+            if (!lws_is_final_fragment(wsi)) {
+                break;
+            }
+
+            if (script_mode) {
+                script_emit(rx_buf, rx_len);
+                rx_len = 0;
+                break;
+            }
+
+            // Parsear JSON, o traducir el mensaje binario a su equivalente
+            json_t *root;
+            json_error_t error;
+            unsigned int desconocido = 0;
+            if (binary_mode) {
+                root = bin_decode_message(rx_buf, rx_len, &desconocido);
+                snprintf(error.text, sizeof(error.text), "mensaje binario inválido");
             } else {
+                root = json_loadb(rx_buf, rx_len, 0, &error);
+            }
+            rx_len = 0;
 
-                if (type && strcmp(type, "list_users_response") == 0) {
-                    printf("\nUsuarios conectados:\n");
-                    json_t *user_list = json_object_get(root, "content");
-        
-                    if (json_is_array(user_list)) {
-                        size_t index;
-                        json_t *value;
-                        json_array_foreach(user_list, index, value) {
-                            const char *usuario = json_string_value(value);
-                            if (usuario){
-                                printf("- %s\n", json_string_value(value));
-                            }
-                        }
-                    }
-                    awaiting_response = 0;
-                }
-                else if (type && strcmp(type, "user_info_response") == 0) {
-                    // Respuesta de la información de un usuario específico
-                    const char *target = json_string_value(json_object_get(root, "target"));
-                    json_t *content = json_object_get(root, "content");
-                    
-                    if (content && json_is_object(content)) {
-                        const char *ip = json_string_value(json_object_get(content, "ip"));
-                        const char *status = json_string_value(json_object_get(content, "status"));
-                
-                        printf("\nInformación del usuario %s:\n", target);
-                        printf("IP: %s\n", ip ? ip : "No disponible");
-                        printf("Estado: %s\n", status ? status : "No disponible");
-                    }
-                    else {
-                        printf("Error: No se encontró información para el usuario %s\n", target);
-                    }
-                    awaiting_response = 0;
-                }
+            if (desconocido) {
+                print_above("Mensaje binario de tipo desconocido 0x%02x, ignorado\n", desconocido);
+                break;
             }
 
+            if (!root) {
+                printf("Error al parsear JSON: %s\n", error.text);
+                return 1;
+            }
+            handle_server_message(root);
             json_decref(root);
-            lws_callback_on_writable(wsi);
-            break;          
+            fflush(stdout);
+            break;
+        }
+
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+            fprintf(stderr, "Error al conectar con el servidor WebSocket: %s\n",
+                    in ? (const char *)in : "sin detalle");
+            salir = 1;
+            break;
 
-        case LWS_CALLBACK_CLOSED:
-            printf("Conexión cerrada\n");
+        case LWS_CALLBACK_CLIENT_CLOSED:
+            if (script_mode) {
+                fprintf(stderr, "Conexión cerrada\n");
+            } else {
+                prompt_clear();
+                printf("Conexión cerrada\n");
+            }
             global_wsi = NULL;
+            salir = 1;
             break;
 
         default:
@@ -232,19 +1601,57 @@ static int callback_client(struct lws *wsi, enum lws_callback_reasons reason,
 
 static struct lws_protocols protocols[] = {
     { "chat-protocol", callback_client, 0, MAX_MESSAGE_LEN },
+    { BIN_PROTOCOL, callback_client, 0, MAX_MESSAGE_LEN },
+    { "entrada", callback_stdin, 0, 0 },
+    { "ventana", callback_resize, 0, 0 },
     { NULL, NULL, 0, 0 }
 };
 
-
-size_t mensaje_len;
-unsigned char buffer[LWS_PRE + MAX_MESSAGE_LEN];
-
 int main(int argc, char *argv[]) {
 
-    if (argc != 4) {
-        fprintf(stderr, "Llamar al cliente de esta forma:\n %s <nombredeusuario> <IPdelservidor> <puertodelservidor>\n", argv[0]);
+    if (argc < 4) {
+        fprintf(stderr, "Llamar al cliente de esta forma:\n %s <nombredeusuario> <IPdelservidor> <puertodelservidor> "
+                "[--bin] [--deflate] [--deflate-window-bits 9-15] [--deflate-level 1-9] [--script [archivo]]\n", argv[0]);
         return 1;
     }
+
+    int pedir_binario = lws_cmdline_option(argc, (const char **)argv, "--bin") != NULL;
+
+    // --script sin archivo (o con "-") lee las órdenes de stdin
+    const char *script = lws_cmdline_option(argc, (const char **)argv, "--script");
+    if (script) {
+        script_mode = 1;
+        if (script[0] && script[0] != '-') {
+            entrada_fd = open(script, O_RDONLY);
+            if (entrada_fd < 0) {
+                fprintf(stderr, "No se pudo abrir %s\n", script);
+                return 1;
+            }
+        }
+        // stdout es NDJSON: con búfer completo, se vacía una vez por vuelta
+        setvbuf(stdout, NULL, _IOFBF, SCRIPT_READ_LEN);
+    }
+
+    // lws_cmdline_option compara por prefijo: cualquier --deflate-* activa la extensión
+    if (lws_cmdline_option(argc, (const char **)argv, "--deflate")) {
+        deflate_enabled = 1;
+    }
+    const char *opt = lws_cmdline_option(argc, (const char **)argv, "--deflate-window-bits");
+    if (opt) {
+        deflate_window_bits = atoi(opt);
+        if (deflate_window_bits < 9 || deflate_window_bits > 15) {
+            fprintf(stderr, "--deflate-window-bits debe estar entre 9 y 15\n");
+            return 1;
+        }
+    }
+    opt = lws_cmdline_option(argc, (const char **)argv, "--deflate-level");
+    if (opt) {
+        deflate_level = atoi(opt);
+        if (deflate_level < 1 || deflate_level > 9) {
+            fprintf(stderr, "--deflate-level debe estar entre 1 y 9\n");
+            return 1;
+        }
+    }
     
     strncpy(username, argv[1], MAX_NAME_LEN - 1);
     username[MAX_NAME_LEN - 1] = '\0';
@@ -259,6 +1666,9 @@ int main(int argc, char *argv[]) {
     struct lws_context_creation_info info = {0};
     info.port = CONTEXT_PORT_NO_LISTEN;
     info.protocols = protocols;
+    if (deflate_enabled) {
+        info.extensions = extensions;
+    }
 
     struct lws_context *context = lws_create_context(&info);
     if (!context) {
@@ -273,7 +1683,9 @@ int main(int argc, char *argv[]) {
     ccinfo.path = "/";
     ccinfo.host = ccinfo.address;
     ccinfo.origin = ccinfo.address;
-    ccinfo.protocol = "chat-protocol";
+    // Con --bin se pide primero el subprotocolo binario; si el servidor no lo
+    // ofrece se sigue en JSON
+    ccinfo.protocol = pedir_binario ? BIN_PROTOCOL ",chat-protocol" : "chat-protocol";
 
     struct lws *wsi = lws_client_connect_via_info(&ccinfo);
     if (!wsi) {
@@ -281,260 +1693,30 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    printf("Conectado al servidor %s en el puerto %d\n", server_ip, server_port);
-
-    // Esperar a que la conexión se establezca
-    while (!global_wsi) {
-        lws_service(context, 0);
-    }
-
-    pthread_t receive_thread;
-    pthread_create(&receive_thread, NULL, receive_messages, (void *)context);
-
-    // -------------- MENÚ DE OPCIONES ------------------------
-    int opcion;
-    do {
-        printf("\n--- MENÚ DE OPCIONES ---\n");
-        printf("1. Chatear con todos los usuarios (broadcasting)\n");
-        printf("2. Mensajes directos\n");
-        printf("3. Cambiar de estado\n");
-        printf("4. Usuarios conectados\n");
-        printf("5. Información de un usuario\n");
-        printf("6. Ayuda\n");
-        printf("7. Salir\n");
-        printf("Seleccione una opción: ");
-        scanf("%d", &opcion);
-        getchar();
-
-        switch (opcion) {
-            case 1:
-                in_broadcast_mode = 1;
-                redraw_broadcast_screen();
-
-                while (1) {
-                    char mensaje_usuario[MAX_MESSAGE_LEN] = {0};
-
-                    char c = getch();
-                    if (c == 27) { // 27 es el código ASCII de ESC
-                        printf("\nSaliendo del modo broadcast...\n");
-                        in_broadcast_mode = 0;
-                        break;
-                    }
-
-                    pthread_mutex_lock(&writing_mutex);
-                    is_writing = 1;
-                    pthread_mutex_unlock(&writing_mutex);
-
-                    // Leer el mensaje después de la primera tecla presionada
-                    ungetc(c, stdin);
-                    fgets(mensaje_usuario, sizeof(mensaje_usuario), stdin);
-                    mensaje_usuario[strcspn(mensaje_usuario, "\n")] = 0; // Eliminar salto de línea
-
-                    // No activar si no escribió nada
-                    if (strlen(mensaje_usuario) == 0) {
-                        pthread_mutex_lock(&writing_mutex);
-                        is_writing = 0;
-                        pthread_mutex_unlock(&writing_mutex);
-                        continue;
-                    }
-
-                    // Crear JSON {"type": "broadcast", "sender": "usuario", "mensaje": "texto"}
-                    char json_mensaje[MAX_MESSAGE_LEN];
-                    snprintf(json_mensaje, sizeof(json_mensaje), 
-                        "{\"type\": \"broadcast\", \"sender\": \"%s\", \"content\": \"%s\"}",
-                        username, mensaje_usuario);
-
-                    // Enviar mensaje al servidor
-                    mensaje_len = strlen(json_mensaje);
-                    memcpy(&buffer[LWS_PRE], json_mensaje, mensaje_len);
-                    lws_write(wsi, &buffer[LWS_PRE], mensaje_len, LWS_WRITE_TEXT);
-
-                    pthread_mutex_lock(&writing_mutex);
-                    is_writing = 0;
-                    pthread_mutex_unlock(&writing_mutex);
-
-                    lws_service(context, 0);
-                }
-                break;
-
-            case 2:
-                in_private_chat = 1;
-                printf("Ingrese el nombre del usuario con el que desea chatear: ");
-                fgets(current_private_chat, sizeof(current_private_chat), stdin);
-                current_private_chat[strcspn(current_private_chat, "\n")] = 0;
-            
-                // Limpiar mensajes anteriores
-                system("clear");
-                redraw_private_chat_screen();
-
-                while (1) {
-                    char mensaje_usuario[MAX_MESSAGE_LEN] = {0};
-            
-                    char c = getch();
-                    if (c == 27) { // ESC para salir
-                        printf("\nSaliendo del chat privado con %s...\n", current_private_chat);
-                        in_private_chat = 0;
-                        break;
-                    }
-            
-                    // Si la primera tecla no es ESC, activar is_writing
-                    pthread_mutex_lock(&writing_mutex);
-                    is_writing = 1;
-                    pthread_mutex_unlock(&writing_mutex);
-            
-                    // Leer el mensaje después de la primera tecla presionada
-                    ungetc(c, stdin);
-                    fgets(mensaje_usuario, sizeof(mensaje_usuario), stdin);
-                    mensaje_usuario[strcspn(mensaje_usuario, "\n")] = 0;
-            
-                    if (strlen(mensaje_usuario) == 0) { 
-                        pthread_mutex_lock(&writing_mutex);
-                        is_writing = 0; // No activar si no escribió nada
-                        pthread_mutex_unlock(&writing_mutex);
-                        continue;
-                    }
-            
-                    // Crear JSON {"type": "private", "sender": "usuario", "target": "destino", "content": "mensaje"}
-                    char json_mensaje[MAX_MESSAGE_LEN];
-                    snprintf(json_mensaje, sizeof(json_mensaje), 
-                        "{\"type\": \"private\", \"sender\": \"%s\", \"target\": \"%s\", \"content\": \"%s\"}",
-                        username, current_private_chat, mensaje_usuario);
-            
-                    // Enviar mensaje al servidor
-                    mensaje_len = strlen(json_mensaje);
-                    memcpy(&buffer[LWS_PRE], json_mensaje, mensaje_len);
-
-                    if (private_message_count < MAX_PRIVATE_MESSAGES) {
-                        snprintf(private_messages[private_message_count].sender, MAX_MESSAGE_LEN, "%s", username);
-                        snprintf(private_messages[private_message_count].content, MAX_MESSAGE_LEN, "%s", mensaje_usuario);
-                        snprintf(private_messages[private_message_count].target, MAX_MESSAGE_LEN, "%s", current_private_chat);
-                        private_message_count++;
-                    }
-                    
-                    // Refrescar la pantalla para que el remitente vea su propio mensaje
-                    redraw_private_chat_screen();
-
-                    lws_write(wsi, &buffer[LWS_PRE], mensaje_len, LWS_WRITE_TEXT);
-                    lws_service(context, 0);
-            
-                    // Desactivar is_writing después de enviar el mensaje
-                    pthread_mutex_lock(&writing_mutex);
-                    is_writing = 0;
-                    pthread_mutex_unlock(&writing_mutex);
-                }
-                break;
-
-            case 3:
-                printf("\nSeleccione un nuevo estado:\n");
-                printf("1. ACTIVO\n");
-                printf("2. OCUPADO\n");
-                printf("3. INACTIVO\n");
-                printf("Seleccione una opción: ");
-            
-                int estado_opcion;
-                scanf("%d", &estado_opcion);
-                getchar(); // Limpiar buffer de entrada
-            
-                const char *nuevo_estado;
-                switch (estado_opcion) {
-                    case 1:
-                        nuevo_estado = "ACTIVO";
-                        break;
-                    case 2:
-                        nuevo_estado = "OCUPADO";
-                        break;
-                    case 3:
-                        nuevo_estado = "INACTIVO";
-                        break;
-                    default:
-                        printf("Opción inválida. Estado no cambiado.\n");
-                        continue; // Regresa al menú
-                }
-            
-                // Crear mensaje JSON para cambiar estado
-                char json_status[MAX_MESSAGE_LEN];
-                snprintf(json_status, sizeof(json_status),
-                        "{\"type\": \"change_status\", \"sender\": \"%s\", \"content\": \"%s\"}",
-                        username, nuevo_estado);
-            
-                // Enviar el mensaje al servidor
-                mensaje_len = strlen(json_status);
-                memcpy(&buffer[LWS_PRE], json_status, mensaje_len);
-                
-                lws_write(wsi, &buffer[LWS_PRE], mensaje_len, LWS_WRITE_TEXT);
-                
-                printf("Estado cambiado a: %s\n", nuevo_estado);                
-                break;
-
-            case 4:
-                // Crear mensaje JSON para solicitar la lista de usuarios
-                char json_list_request[MAX_MESSAGE_LEN];
-                snprintf(json_list_request, sizeof(json_list_request),
-                        "{\"type\": \"list_users\", \"sender\": \"%s\"}", username);
-
-                // Enviar la solicitud al servidor
-                mensaje_len = strlen(json_list_request);
-                memcpy(&buffer[LWS_PRE], json_list_request, mensaje_len);
-
-                lws_write(wsi, &buffer[LWS_PRE], mensaje_len, LWS_WRITE_TEXT);
-                
-                printf("Solicitando lista de usuarios...\n");
-                awaiting_response = 1;
-                
-                while (awaiting_response) {
-                    lws_service(context, 0);
-                    usleep(100000);
-                }
-
-                break;
-
-            case 5:
-                printf("Ingrese el nombre del usuario: ");
-                char target_user_info[MAX_NAME_LEN];
-                fgets(target_user_info, sizeof(target_user_info), stdin);
-                target_user_info[strcspn(target_user_info, "\n")] = 0;  // Eliminar salto de línea
-            
-                printf("Solicitando información sobre el usuario %s...\n", target_user_info);
-            
-                // Crear mensaje JSON para solicitar la información del usuario
-                char json_user_info_request[MAX_MESSAGE_LEN];
-                snprintf(json_user_info_request, sizeof(json_user_info_request),
-                        "{\"type\": \"user_info\", \"sender\": \"%s\", \"target\": \"%s\"}",
-                        username, target_user_info);
-            
-                // Enviar la solicitud al servidor
-                mensaje_len = strlen(json_user_info_request);
-                memcpy(&buffer[LWS_PRE], json_user_info_request, mensaje_len);
-            
-                lws_write(wsi, &buffer[LWS_PRE], mensaje_len, LWS_WRITE_TEXT);
-            
-                awaiting_response = 1;  // Marcar como esperando respuesta
-            
-                // Esperar hasta que se reciba la respuesta del servidor
-                while (awaiting_response) {
-                    lws_service(context, 0);
-                    usleep(100000);
-                }
-                break;
+    if (!script_mode) {
+        printf("Conectado al servidor %s en el puerto %d\n", server_ip, server_port);
+        if (resize_pipe_open() == 0) {
+            signal(SIGWINCH, on_sigwinch);
+        }
+    }
 
-            case 6:
-                printf("Ayuda: Elija una opción y siga las instrucciones.\n");
+    // Un solo bucle atiende el websocket y el teclado; no hay que sondear
+    while (!salir && lws_service(context, 1000) >= 0) {
+        if (script_mode) {
+            fflush(stdout);
+            // Terminó la entrada, ya se envió todo y el servidor dejó de responder
+            if (script_eof && !salida_head && time(NULL) - script_last_rx >= SCRIPT_LINGER_SECS) {
                 break;
-
-            case 7:
-                printf("Saliendo del chat...\n");
-                lws_context_destroy(context);
-                return 0;
-
-            default:
-                printf("Opción inválida. Intente de nuevo.\n");
+            }
         }
-    } while (opcion != 7);
-
-    pthread_cancel(receive_thread);
-    pthread_join(receive_thread, NULL);
+    }
 
+    term_restore();
+    signal(SIGWINCH, SIG_DFL);
     lws_context_destroy(context);
-
-    return 0;
-}
\ No newline at end of file
+    salida_free_all();
+    free(rx_buf);
+    free(script_buf);
+    fflush(stdout);
+    return codigo_salida;
+}
@@ -0,0 +1,158 @@
+#include "directory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Almacén de usuarios: bloques de tamaño fijo que nunca se mueven, de modo
+// que los punteros a User siguen siendo válidos al crecer.
+static User **user_slabs = NULL;
+static int slab_count = 0;
+static User *free_users = NULL; // Espacios liberados listos para reutilizar
+static int user_count = 0;
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int max_users = DEFAULT_MAX_USERS;
+
+UserShard shards[USER_SHARDS];
+
+User *directory_find(UserShard *sh, const char *username, unsigned int h) {
+    if (!sh->hash) {
+        return NULL;
+    }
+    for (User *u = sh->hash[h & (sh->hash_size - 1)]; u; u = u->hash_next) {
+        if (u->hash == h && strcmp(u->username, username) == 0) {
+            return u;
+        }
+    }
+    return NULL;
+}
+
+// Duplica las cubetas del fragmento cuando hay más usuarios que cubetas
+static int directory_grow(UserShard *sh) {
+    unsigned int new_size = sh->hash_size ? sh->hash_size * 2 : USER_HASH_INITIAL;
+    User **new_hash = calloc(new_size, sizeof(User *));
+    if (!new_hash) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < sh->hash_size; i++) {
+        User *u = sh->hash[i];
+        while (u) {
+            User *next = u->hash_next;
+            unsigned int b = u->hash & (new_size - 1);
+            u->hash_next = new_hash[b];
+            new_hash[b] = u;
+            u = next;
+        }
+    }
+
+    free(sh->hash);
+    sh->hash = new_hash;
+    sh->hash_size = new_size;
+    return 0;
+}
+
+int directory_insert(UserShard *sh, User *u) {
+    if ((unsigned int)sh->count >= sh->hash_size && directory_grow(sh) != 0) {
+        if (!sh->hash) {
+            return -1;
+        }
+    }
+    unsigned int b = u->hash & (sh->hash_size - 1);
+    u->hash_next = sh->hash[b];
+    sh->hash[b] = u;
+
+    u->prev = NULL;
+    u->next = sh->members;
+    if (sh->members) {
+        sh->members->prev = u;
+    }
+    sh->members = u;
+    sh->count++;
+    return 0;
+}
+
+void directory_remove(UserShard *sh, User *u) {
+    User **pp = &sh->hash[u->hash & (sh->hash_size - 1)];
+    while (*pp) {
+        if (*pp == u) {
+            *pp = u->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+    u->hash_next = NULL;
+
+    if (u->prev) {
+        u->prev->next = u->next;
+    } else {
+        sh->members = u->next;
+    }
+    if (u->next) {
+        u->next->prev = u->prev;
+    }
+    u->next = u->prev = NULL;
+    sh->count--;
+}
+
+// Reserva un bloque nuevo y lo encadena a la lista libre; asume store_mutex
+static int user_slab_grow(void) {
+    User **slabs = realloc(user_slabs, (slab_count + 1) * sizeof(User *));
+    if (!slabs) {
+        return -1;
+    }
+    user_slabs = slabs;
+
+    User *slab = calloc(USER_SLAB_SIZE, sizeof(User));
+    if (!slab) {
+        return -1;
+    }
+    user_slabs[slab_count++] = slab;
+
+    for (int i = USER_SLAB_SIZE - 1; i >= 0; i--) {
+        slab[i].next = free_users;
+        free_users = &slab[i];
+    }
+    return 0;
+}
+
+User *user_alloc(void) {
+    User *u = NULL;
+
+    pthread_mutex_lock(&store_mutex);
+    if (user_count < max_users && (free_users || user_slab_grow() == 0)) {
+        u = free_users;
+        free_users = u->next;
+        user_count++;
+    }
+    pthread_mutex_unlock(&store_mutex);
+
+    if (u) {
+        memset(u, 0, sizeof(*u));
+    }
+    return u;
+}
+
+void user_free(User *u) {
+    u->active = 0;
+    u->wsi = NULL;
+    u->session = NULL;
+
+    pthread_mutex_lock(&store_mutex);
+    u->next = free_users;
+    free_users = u;
+    user_count--;
+    pthread_mutex_unlock(&store_mutex);
+}
+
+void user_release(UserShard *sh, User *u) {
+    directory_remove(sh, u);
+    user_free(u);
+}
+
+int user_total(void) {
+    pthread_mutex_lock(&store_mutex);
+    int total = user_count;
+    pthread_mutex_unlock(&store_mutex);
+    return total;
+}
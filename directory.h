@@ -0,0 +1,80 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+// Directorio de usuarios registrados: nombre -> User, repartido por hash en
+// fragmentos independientes, sobre un almacén de bloques que nunca se mueven.
+
+#define DEFAULT_MAX_USERS 65536 // Límite por defecto de usuarios registrados
+#define USER_SLAB_SIZE 256       // Usuarios reservados por cada bloque
+#define USER_HASH_INITIAL 64     // Cubetas iniciales de cada fragmento (potencia de 2)
+#define USER_SHARD_BITS 4        // 16 fragmentos del directorio
+#define USER_SHARDS (1 << USER_SHARD_BITS)
+
+struct lws;
+struct SessionData;
+
+typedef struct User {
+    char username[32];
+    uint32_t id;        // Identificador del subprotocolo binario, no se reutiliza
+    struct lws *wsi;
+    struct SessionData *session; // Conexión a la que se le encolan los envíos
+    char status[16];
+    char ip[64];
+    int active;
+    time_t last_activity;
+    unsigned int hash;      // Hash del nombre: elige fragmento y cubeta
+    struct User *hash_next; // Siguiente usuario en la misma cubeta
+    struct User *next;      // Lista del fragmento, o lista libre si no está en uso
+    struct User *prev;
+} User;
+
+// Fragmento del directorio. Su candado protege la tabla, la lista de
+// miembros y los campos (status, ip, session) de los usuarios que contiene.
+typedef struct {
+    pthread_mutex_t lock;
+    User **hash;
+    unsigned int hash_size;
+    int count;
+    User *members;
+} UserShard;
+
+extern UserShard shards[USER_SHARDS]; // Sus candados los inicializa quien arranca
+extern int max_users;
+
+// FNV-1a sobre el nombre de usuario
+static inline unsigned int hash_username(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Los bits altos eligen el fragmento y los bajos la cubeta dentro de él
+static inline UserShard *shard_for(unsigned int h) {
+    return &shards[h >> (32 - USER_SHARD_BITS)];
+}
+
+// Las funciones del directorio asumen tomado el candado del fragmento
+User *directory_find(UserShard *sh, const char *username, unsigned int h);
+int directory_insert(UserShard *sh, User *u);
+void directory_remove(UserShard *sh, User *u);
+
+// Saca un espacio de la lista libre; NULL si se alcanzó max_users
+User *user_alloc(void);
+
+// Devuelve el espacio a la lista libre; el usuario ya no debe estar en el directorio
+void user_free(User *u);
+
+// Quita al usuario del directorio y libera su espacio; asume el candado de sh
+void user_release(UserShard *sh, User *u);
+
+// Usuarios con espacio reservado en este momento
+int user_total(void);
+
+#endif
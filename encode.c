@@ -0,0 +1,92 @@
+#include "encode.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binproto.h"
+
+void gen_timestamp(char *buffer, size_t buffer_size) {
+  time_t now = time(NULL);
+  struct tm *t = gmtime(&now);
+  strftime(buffer, buffer_size, "%Y-%m-%dT%H:%M:%SZ", t);
+}
+
+const char *strview_plain(StrView v, size_t *len, char **owned) {
+    *owned = NULL;
+    if (!v.escaped) {
+        *len = v.len;
+        return v.ptr;
+    }
+    *owned = malloc(v.len + 1);
+    if (!*owned) {
+        *len = 0;
+        return "";
+    }
+    *len = strview_copy(v, *owned, v.len + 1);
+    return *owned;
+}
+
+OutMsg *bin_chat_msg(const User *from, const User *to, StrView content) {
+    char *owned;
+    size_t clen;
+    const char *text = strview_plain(content, &clen, &owned);
+
+    unsigned char *p;
+    OutMsg *msg = bin_msg_new(to ? BIN_S_PRIVATE : BIN_S_BROADCAST,
+                              (to ? 8 : 4) + bin_str_len(clen), &p);
+    if (msg) {
+        p = bin_put_u32(p, from->id);
+        if (to) {
+            p = bin_put_u32(p, to->id);
+        }
+        bin_put_str(p, text, clen);
+    }
+    free(owned);
+    return msg;
+}
+
+void status_encode(const User *u, const char *status, Outbound *o) {
+    if (format_in_use(FMT_JSON)) {
+        char timestamp[64];
+        gen_timestamp(timestamp, sizeof(timestamp));
+
+        json_t *status_obj = json_object();
+        json_object_set_new(status_obj, "user", json_string(u->username));
+        json_object_set_new(status_obj, "status", json_string(status));
+
+        json_t *response = json_object();
+        json_object_set_new(response, "type", json_string("status_update"));
+        json_object_set_new(response, "sender", json_string("server"));
+        json_object_set_new(response, "content", status_obj);
+        json_object_set_new(response, "timestamp", json_string(timestamp));
+
+        o->fmt[FMT_JSON] = outmsg_from_json(response);
+        json_decref(response);
+    }
+
+    if (format_in_use(FMT_BIN)) {
+        size_t slen = strlen(status);
+        unsigned char *p;
+        o->fmt[FMT_BIN] = bin_msg_new(BIN_S_STATUS_UPDATE, 4 + bin_str_len(slen), &p);
+        if (o->fmt[FMT_BIN]) {
+            p = bin_put_u32(p, u->id);
+            bin_put_str(p, status, slen);
+        }
+    }
+}
+
+void broadcast_encode(const User *self, StrView content, Outbound *o) {
+    if (format_in_use(FMT_JSON)) {
+        char timestamp[64];
+        gen_timestamp(timestamp, sizeof(timestamp));
+
+        o->fmt[FMT_JSON] = outmsg_printf(
+            "{\"type\":\"broadcast\",\"sender\":\"%s\","
+            "\"content\":\"%.*s\",\"timestamp\":\"%s\"}",
+            self->username, (int)content.len, content.ptr, timestamp);
+    }
+    if (format_in_use(FMT_BIN)) {
+        o->fmt[FMT_BIN] = bin_chat_msg(self, NULL, content);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <stddef.h>
+
+#include "directory.h"
+#include "frame.h"
+#include "outmsg.h"
+
+// Codificación de los mensajes que el servidor reparte a todos: cada uno en
+// los formatos de salida que tengan alguna conexión abierta.
+
+// Hora actual en UTC con el formato del campo "timestamp"
+void gen_timestamp(char *buffer, size_t buffer_size);
+
+// Contenido sin escapes para codificarlo en binario; si hubo que copiarlo,
+// *owned queda apuntando a la copia para liberarla
+const char *strview_plain(StrView v, size_t *len, char **owned);
+
+// Mensaje de chat (broadcast si to es NULL, o privado) en binario
+OutMsg *bin_chat_msg(const User *from, const User *to, StrView content);
+
+// status_update en los formatos que haya conectados
+void status_encode(const User *u, const char *status, Outbound *o);
+
+// broadcast de self en los formatos que haya conectados; content ya viene
+// escapado como JSON, tal como llegó en el frame
+void broadcast_encode(const User *self, StrView content, Outbound *o);
+
+#endif
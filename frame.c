@@ -0,0 +1,467 @@
+#include "frame.h"
+
+#include <string.h>
+
+#define FRAME_MAX_DEPTH 32 // Anidamiento máximo en valores que se saltan
+
+typedef struct {
+    const char *p;
+    const char *end;
+} Cursor;
+
+static void skip_ws(Cursor *c) {
+    while (c->p < c->end &&
+           (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) {
+        c->p++;
+    }
+}
+
+static int hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+// Largo de la secuencia UTF-8 que empieza en p, 0 si no es válida. Como
+// jansson, rechaza formas sobrelargas, sustitutos UTF-16 y puntos de código
+// mayores que U+10FFFF.
+static size_t utf8_len(const unsigned char *p, const unsigned char *end) {
+    size_t n;
+    if (p[0] < 0x80) return 1;
+    else if ((p[0] & 0xe0) == 0xc0 && p[0] >= 0xc2) n = 2;
+    else if ((p[0] & 0xf0) == 0xe0) n = 3;
+    else if ((p[0] & 0xf8) == 0xf0 && p[0] <= 0xf4) n = 4;
+    else return 0;
+
+    if ((size_t)(end - p) < n) {
+        return 0;
+    }
+    for (size_t i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+    }
+    if ((p[0] == 0xe0 && p[1] < 0xa0) || (p[0] == 0xed && p[1] > 0x9f) ||
+        (p[0] == 0xf0 && p[1] < 0x90) || (p[0] == 0xf4 && p[1] > 0x8f)) {
+        return 0;
+    }
+    return n;
+}
+
+// Valor de los 4 dígitos hexadecimales de p, -1 si alguno no lo es
+static int hex4_value(const char *p) {
+    int v = 0;
+    for (int i = 0; i < 4; i++) {
+        int d = hex_value(p[i]);
+        if (d < 0) {
+            return -1;
+        }
+        v = v << 4 | d;
+    }
+    return v;
+}
+
+// Lee una cadena con c->p en la comilla inicial; valida escapes y UTF-8
+static int read_string(Cursor *c, StrView *v) {
+    if (c->p >= c->end || *c->p != '"') {
+        return -1;
+    }
+    const char *start = ++c->p;
+    int escaped = 0;
+
+    while (c->p < c->end) {
+        // Camino rápido: ASCII imprimible sin comillas ni escapes
+        while (c->p < c->end) {
+            unsigned char a = (unsigned char)*c->p;
+            if (a < 0x20 || a >= 0x80 || a == '"' || a == '\\') break;
+            c->p++;
+        }
+        if (c->p >= c->end) {
+            break;
+        }
+
+        unsigned char ch = (unsigned char)*c->p;
+        if (ch == '"') {
+            v->ptr = start;
+            v->len = (size_t)(c->p - start);
+            v->escaped = escaped;
+            c->p++;
+            return 0;
+        }
+        if (ch < 0x20) {
+            return -1;
+        }
+        if (ch == '\\') {
+            escaped = 1;
+            if (c->end - c->p < 2) {
+                return -1;
+            }
+            char e = c->p[1];
+            if (e == 'u') {
+                // \u0000 y los sustitutos sin pareja los rechaza jansson
+                if (c->end - c->p < 6) {
+                    return -1;
+                }
+                int cp = hex4_value(&c->p[2]);
+                if (cp <= 0 || (cp >= 0xdc00 && cp <= 0xdfff)) {
+                    return -1;
+                }
+                c->p += 6;
+                if (cp >= 0xd800 && cp <= 0xdbff) {
+                    if (c->end - c->p < 6 || c->p[0] != '\\' || c->p[1] != 'u') {
+                        return -1;
+                    }
+                    int lo = hex4_value(&c->p[2]);
+                    if (lo < 0xdc00 || lo > 0xdfff) {
+                        return -1;
+                    }
+                    c->p += 6;
+                }
+            } else if (e == '"' || e == '\\' || e == '/' || e == 'b' ||
+                       e == 'f' || e == 'n' || e == 'r' || e == 't') {
+                c->p += 2;
+            } else {
+                return -1;
+            }
+            continue;
+        }
+        size_t n = utf8_len((const unsigned char *)c->p, (const unsigned char *)c->end);
+        if (n == 0) {
+            return -1;
+        }
+        c->p += n;
+    }
+    return -1;
+}
+
+// Avanza sobre uno o más dígitos; -1 si no hay ninguno
+static int skip_digits(Cursor *c) {
+    const char *start = c->p;
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9') {
+        c->p++;
+    }
+    return c->p > start ? 0 : -1;
+}
+
+// Número con la gramática de JSON: -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+// Lo que no encaje (01, 1., .5, +1, 1e) es -1 y el frame va a jansson
+static int skip_number(Cursor *c) {
+    if (c->p < c->end && *c->p == '-') c->p++;
+    if (c->p < c->end && *c->p == '0') {
+        c->p++;
+    } else if (c->p >= c->end || *c->p < '1' || *c->p > '9' || skip_digits(c) != 0) {
+        return -1;
+    }
+    if (c->p < c->end && *c->p == '.') {
+        c->p++;
+        if (skip_digits(c) != 0) return -1;
+    }
+    if (c->p < c->end && (*c->p == 'e' || *c->p == 'E')) {
+        c->p++;
+        if (c->p < c->end && (*c->p == '+' || *c->p == '-')) c->p++;
+        if (skip_digits(c) != 0) return -1;
+    }
+    return 0;
+}
+
+// Salta un valor JSON cualquiera sin interpretarlo
+static int skip_value(Cursor *c, int depth) {
+    if (c->p >= c->end || depth > FRAME_MAX_DEPTH) {
+        return -1;
+    }
+
+    char ch = *c->p;
+    if (ch == '"') {
+        StrView ignored;
+        return read_string(c, &ignored);
+    }
+
+    if (ch == '{' || ch == '[') {
+        char close = ch == '{' ? '}' : ']';
+        c->p++;
+        skip_ws(c);
+        if (c->p < c->end && *c->p == close) {
+            c->p++;
+            return 0;
+        }
+        while (1) {
+            if (ch == '{') {
+                StrView key;
+                if (read_string(c, &key) != 0) return -1;
+                skip_ws(c);
+                if (c->p >= c->end || *c->p != ':') return -1;
+                c->p++;
+                skip_ws(c);
+            }
+            if (skip_value(c, depth + 1) != 0) return -1;
+            skip_ws(c);
+            if (c->p >= c->end) return -1;
+            if (*c->p == close) {
+                c->p++;
+                return 0;
+            }
+            if (*c->p != ',') return -1;
+            c->p++;
+            skip_ws(c);
+        }
+    }
+
+    static const char *literals[] = { "true", "false", "null" };
+    for (int i = 0; i < 3; i++) {
+        size_t n = strlen(literals[i]);
+        if ((size_t)(c->end - c->p) >= n && memcmp(c->p, literals[i], n) == 0) {
+            c->p += n;
+            return 0;
+        }
+    }
+
+    return skip_number(c);
+}
+
+// El "id" de la solicitud se guarda sin interpretar: una cadena (con sus
+// comillas) o un entero. Otro tipo de valor se deja a jansson.
+static int read_id(Cursor *c, StrView *v) {
+    const char *start = c->p;
+    if (c->p < c->end && *c->p == '"') {
+        StrView ignored;
+        if (read_string(c, &ignored) != 0) return -1;
+    } else {
+        // Solo enteros: sin parte decimal ni exponente
+        if (skip_number(c) != 0) return -1;
+        for (const char *q = start; q < c->p; q++) {
+            if (*q == '.' || *q == 'e' || *q == 'E') return -1;
+        }
+    }
+    if ((size_t)(c->p - start) > REQUEST_ID_MAX_LEN) return -1;
+    v->ptr = start;
+    v->len = (size_t)(c->p - start);
+    v->escaped = 0;
+    return 0;
+}
+
+static StrView *field_for(ChatFrame *out, StrView key) {
+    switch (key.len) {
+    case 2:
+        return memcmp(key.ptr, "id", 2) == 0 ? &out->id : NULL;
+    case 4:
+        return memcmp(key.ptr, "type", 4) == 0 ? &out->type : NULL;
+    case 6:
+        if (memcmp(key.ptr, "sender", 6) == 0) return &out->sender;
+        if (memcmp(key.ptr, "target", 6) == 0) return &out->target;
+        return NULL;
+    case 7:
+        return memcmp(key.ptr, "content", 7) == 0 ? &out->content : NULL;
+    default:
+        return NULL;
+    }
+}
+
+int frame_parse(const char *buf, size_t len, ChatFrame *out) {
+    Cursor c = { buf, buf + len };
+    memset(out, 0, sizeof(*out));
+
+    skip_ws(&c);
+    if (c.p >= c.end || *c.p != '{') {
+        return -1;
+    }
+    c.p++;
+    skip_ws(&c);
+
+    if (c.p < c.end && *c.p == '}') {
+        c.p++;
+    } else {
+        while (1) {
+            StrView key;
+            if (read_string(&c, &key) != 0) return -1;
+            skip_ws(&c);
+            if (c.p >= c.end || *c.p != ':') return -1;
+            c.p++;
+            skip_ws(&c);
+
+            // Igual que jansson, una clave repetida se queda con el último valor
+            // Una clave con escapes podría ser uno de los campos conocidos
+            if (key.escaped) return -1;
+            StrView *field = field_for(out, key);
+            if (field == &out->id) {
+                if (read_id(&c, field) != 0) return -1;
+            } else if (field) {
+                if (read_string(&c, field) != 0) return -1;
+            } else if (skip_value(&c, 1) != 0) {
+                return -1;
+            }
+
+            skip_ws(&c);
+            if (c.p >= c.end) return -1;
+            if (*c.p == '}') {
+                c.p++;
+                break;
+            }
+            if (*c.p != ',') return -1;
+            c.p++;
+            skip_ws(&c);
+        }
+    }
+
+    skip_ws(&c);
+    return c.p == c.end ? 0 : -1;
+}
+
+// Codifica un punto de código en UTF-8; devuelve los bytes escritos
+static size_t utf8_encode(unsigned int cp, char *dst) {
+    if (cp < 0x80) {
+        dst[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        dst[0] = (char)(0xc0 | (cp >> 6));
+        dst[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    } else if (cp < 0x10000) {
+        dst[0] = (char)(0xe0 | (cp >> 12));
+        dst[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        dst[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    dst[0] = (char)(0xf0 | (cp >> 18));
+    dst[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    dst[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    dst[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+static unsigned int read_hex4(const char *p) {
+    return (unsigned int)(hex_value(p[0]) << 12 | hex_value(p[1]) << 8 |
+                          hex_value(p[2]) << 4 | hex_value(p[3]));
+}
+
+size_t strview_copy(StrView v, char *dst, size_t cap) {
+    size_t o = 0;
+    if (cap == 0) {
+        return 0;
+    }
+    if (!v.ptr) {
+        dst[0] = '\0';
+        return 0;
+    }
+
+    const char *p = v.ptr;
+    const char *end = v.ptr + v.len;
+    while (p < end) {
+        char tmp[4];
+        size_t n;
+
+        if (*p != '\\') {
+            // Copiar el carácter completo para no partirlo al truncar
+            n = utf8_len((const unsigned char *)p, (const unsigned char *)end);
+            if (n == 0) n = 1;
+            if (o + n > cap - 1) break;
+            memcpy(&dst[o], p, n);
+            o += n;
+            p += n;
+            continue;
+        }
+
+        char e = p[1];
+        p += 2;
+        switch (e) {
+        case 'b': tmp[0] = '\b'; n = 1; break;
+        case 'f': tmp[0] = '\f'; n = 1; break;
+        case 'n': tmp[0] = '\n'; n = 1; break;
+        case 'r': tmp[0] = '\r'; n = 1; break;
+        case 't': tmp[0] = '\t'; n = 1; break;
+        case 'u': {
+            unsigned int cp = read_hex4(p);
+            p += 4;
+            // Par sustituto UTF-16 para puntos fuera del plano básico
+            if (cp >= 0xd800 && cp <= 0xdbff && end - p >= 6 &&
+                p[0] == '\\' && p[1] == 'u') {
+                unsigned int lo = read_hex4(p + 2);
+                if (lo >= 0xdc00 && lo <= 0xdfff) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    p += 6;
+                }
+            }
+            n = utf8_encode(cp, tmp);
+            break;
+        }
+        default: tmp[0] = e; n = 1; break;
+        }
+
+        if (o + n > cap - 1) break;
+        memcpy(&dst[o], tmp, n);
+        o += n;
+    }
+
+    dst[o] = '\0';
+    return o;
+}
+
+int strview_eq(StrView v, const char *s) {
+    size_t n = strlen(s);
+    if (!v.ptr) {
+        return 0;
+    }
+    if (!v.escaped) {
+        return v.len == n && memcmp(v.ptr, s, n) == 0;
+    }
+
+    // Sin escapes la cadena nunca es más larga que en el frame
+    char tmp[256];
+    if (n >= sizeof(tmp) - 4 || v.len < n) {
+        return 0;
+    }
+    return strview_copy(v, tmp, sizeof(tmp)) == n && memcmp(tmp, s, n) == 0;
+}
+
+int utf8_valid(const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s;
+    const unsigned char *end = p + len;
+    while (p < end) {
+        size_t n = utf8_len(p, end);
+        if (n == 0) {
+            return 0;
+        }
+        p += n;
+    }
+    return 1;
+}
+
+size_t json_escaped_len(const char *s, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)s[i];
+        if (ch == '"' || ch == '\\' || ch == '\n' || ch == '\r' || ch == '\t') {
+            n += 2;
+        } else if (ch < 0x20) {
+            n += 6;
+        } else {
+            n++;
+        }
+    }
+    return n;
+}
+
+size_t json_escape(const char *s, size_t len, char *dst) {
+    static const char hex[] = "0123456789abcdef";
+    size_t o = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)s[i];
+        switch (ch) {
+        case '"':  dst[o++] = '\\'; dst[o++] = '"'; break;
+        case '\\': dst[o++] = '\\'; dst[o++] = '\\'; break;
+        case '\n': dst[o++] = '\\'; dst[o++] = 'n'; break;
+        case '\r': dst[o++] = '\\'; dst[o++] = 'r'; break;
+        case '\t': dst[o++] = '\\'; dst[o++] = 't'; break;
+        default:
+            if (ch < 0x20) {
+                memcpy(&dst[o], "\\u00", 4);
+                dst[o + 4] = hex[ch >> 4];
+                dst[o + 5] = hex[ch & 0xf];
+                o += 6;
+            } else {
+                dst[o++] = (char)ch;
+            }
+        }
+    }
+    return o;
+}
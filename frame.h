@@ -0,0 +1,52 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+
+// Largo máximo del "id" de una solicitud tal como llega (con comillas si es
+// cadena). Uno más largo no se devuelve: el servidor contesta request_error
+#define REQUEST_ID_MAX_LEN 64
+
+// Vista sobre una cadena JSON dentro del frame recibido, sin comillas.
+// Si escaped es 1 contiene secuencias '\' tal como llegaron por la red.
+typedef struct {
+    const char *ptr;
+    size_t len;
+    int escaped;
+} StrView;
+
+// Campos del protocolo de chat que usa el servidor. Un campo ausente queda
+// con ptr == NULL.
+typedef struct {
+    StrView type;
+    StrView sender;
+    StrView target;
+    StrView content;
+    StrView id; // Valor crudo de "id" (cadena con comillas o entero, hasta
+                // REQUEST_ID_MAX_LEN bytes) para devolverlo tal cual
+} ChatFrame;
+
+// Recorre un objeto JSON en el mismo búfer, sin reservar memoria. Los
+// campos conocidos deben ser cadenas; las demás claves pueden tener
+// cualquier valor y se saltan. Devuelve 0 si lo reconoció y -1 si el
+// frame no es JSON válido o tiene otra forma, incluido un "id" de más de
+// REQUEST_ID_MAX_LEN bytes (usar jansson en ese caso).
+int frame_parse(const char *buf, size_t len, ChatFrame *out);
+
+// Copia la cadena sin escapes a dst (siempre terminada en '\0'); trunca a
+// cap - 1 bytes sin partir un carácter UTF-8. Devuelve los bytes copiados.
+size_t strview_copy(StrView v, char *dst, size_t cap);
+
+// Compara la cadena, ya sin escapes, con s
+int strview_eq(StrView v, const char *s);
+
+// 1 si s es UTF-8 válido
+int utf8_valid(const char *s, size_t len);
+
+// Largo de s una vez escapada para ir dentro de una cadena JSON
+size_t json_escaped_len(const char *s, size_t len);
+
+// Escapa s en dst, que debe tener json_escaped_len bytes; devuelve los escritos
+size_t json_escape(const char *s, size_t len, char *dst);
+
+#endif
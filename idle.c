@@ -0,0 +1,64 @@
+#include "idle.h"
+
+#include <stdlib.h>
+
+int idle_wheel_init(IdleWheel *w, int max_secs, time_t ahora) {
+    w->size = 1;
+    while (w->size <= (unsigned int)max_secs + 1) {
+        w->size <<= 1;
+    }
+    w->slots = calloc(w->size, sizeof(IdleEntry *));
+    w->now = ahora;
+    return w->slots ? 0 : -1;
+}
+
+void idle_wheel_insert(IdleWheel *w, IdleEntry *e) {
+    unsigned int slot = (unsigned int)e->deadline & (w->size - 1);
+    e->slot = (int)slot;
+    e->prev = NULL;
+    e->next = w->slots[slot];
+    if (w->slots[slot]) {
+        w->slots[slot]->prev = e;
+    }
+    w->slots[slot] = e;
+}
+
+void idle_wheel_remove(IdleWheel *w, IdleEntry *e) {
+    if (e->slot < 0) {
+        return;
+    }
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        w->slots[e->slot] = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    }
+    e->slot = -1;
+    e->next = e->prev = NULL;
+}
+
+void idle_scan(IdleWheel *w, time_t ahora, void (*vencida)(IdleEntry *e)) {
+    // Recorrer las cubetas de los segundos transcurridos desde el último tick
+    time_t desde = w->now + 1;
+    if (ahora - desde >= (time_t)w->size) {
+        desde = ahora - w->size + 1;
+    }
+
+    for (time_t t = desde; t <= ahora; t++) {
+        IdleEntry *e = w->slots[(unsigned int)t & (w->size - 1)];
+        while (e) {
+            IdleEntry *next = e->next;
+            idle_wheel_remove(w, e);
+            if (e->deadline > ahora) {
+                idle_wheel_insert(w, e);
+            } else {
+                vencida(e);
+            }
+            e = next;
+        }
+    }
+
+    w->now = ahora;
+}
@@ -0,0 +1,37 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <time.h>
+
+// Rueda de temporizadores de inactividad: una cubeta por segundo. La
+// actividad solo adelanta el plazo de la entrada; al vencer su cubeta, la
+// entrada se reubica si el plazo se movió o se entrega a quien escanea si no.
+// No tiene candado: cada hilo de servicio tiene la suya con sus sesiones.
+
+// Nodo que se incrusta en la estructura vigilada (lws_container_of la recupera)
+typedef struct IdleEntry {
+    time_t deadline; // Momento en que vence sin más actividad
+    int slot;        // Cubeta de la rueda, -1 si no está en ella
+    struct IdleEntry *next;
+    struct IdleEntry *prev;
+} IdleEntry;
+
+typedef struct {
+    IdleEntry **slots;
+    unsigned int size; // Potencia de 2 mayor que el plazo más largo
+    time_t now;        // Último segundo procesado
+} IdleWheel;
+
+// Reserva una rueda para plazos de hasta max_secs segundos a partir de ahora
+int idle_wheel_init(IdleWheel *w, int max_secs, time_t ahora);
+
+void idle_wheel_insert(IdleWheel *w, IdleEntry *e);
+
+// No hace nada si la entrada no está en la rueda
+void idle_wheel_remove(IdleWheel *w, IdleEntry *e);
+
+// Procesa las cubetas de los segundos transcurridos hasta ahora. Cada entrada
+// cuyo plazo venció sale de la rueda y se pasa a vencida.
+void idle_scan(IdleWheel *w, time_t ahora, void (*vencida)(IdleEntry *e));
+
+#endif
@@ -0,0 +1,407 @@
+#include "logger.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOGGER_MAX_THREADS 64
+#define LOGGER_RING_SLOTS 1024 // Líneas pendientes por hilo (potencia de 2)
+#define LOGGER_MAX_ARGS 8
+#define LOGGER_SLOT_DATA 192   // Bytes para las cadenas de una línea
+#define LOGGER_LINE_MAX 1024   // Línea ya formateada
+#define LOGGER_OUT_BUF (64 * 1024)
+#define LOGGER_IDLE_US 2000    // Espera del escritor cuando no hay nada
+
+typedef union {
+    long long i;
+    double f;
+    const void *p;
+    struct {
+        uint32_t off;
+        uint32_t len;
+    } s;
+} LogArg;
+
+// Una línea sin formatear: el formato, los argumentos y las cadenas copiadas
+typedef struct {
+    const char *fmt;
+    int64_t ns; // CLOCK_REALTIME
+    int level;
+    int nargs;
+    LogArg args[LOGGER_MAX_ARGS];
+    char data[LOGGER_SLOT_DATA];
+} LogSlot;
+
+// Un productor (el hilo dueño) y un consumidor (el escritor). head y tail van
+// en líneas de caché distintas para que no se peleen.
+typedef struct {
+    _Atomic uint64_t head;
+    char pad1[56];
+    _Atomic uint64_t tail;
+    char pad2[56];
+    atomic_ulong dropped;
+    LogSlot slots[LOGGER_RING_SLOTS];
+} LogRing;
+
+// Una conversión del formato
+typedef struct {
+    const char *start; // El '%'
+    size_t len;
+    char kind; // i l L z f p s, o '%' para "%%"
+    int star;  // Precisión '*'
+} Conv;
+
+int logger_level = LOGGER_INFO;
+int logger_sample = 1;
+__thread unsigned int logger_sample_count;
+
+static LogRing *_Atomic rings[LOGGER_MAX_THREADS];
+static atomic_int ring_count;
+static atomic_ulong lost; // Líneas de hilos que no alcanzaron anillo
+static __thread LogRing *my_ring;
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+int logger_parse_level(const char *name) {
+    static const char *nombres[] = { "error", "warn", "info", "debug" };
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, nombres[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Busca la próxima conversión desde p; NULL si no quedan
+static const char *next_conv(const char *p, Conv *c) {
+    p = strchr(p, '%');
+    if (!p) {
+        return NULL;
+    }
+    const char *q = p + 1;
+    c->start = p;
+    c->star = 0;
+    if (*q == '%') {
+        c->kind = '%';
+        c->len = 2;
+        return p;
+    }
+    while (*q && strchr("-+ #0", *q)) {
+        q++;
+    }
+    while (*q >= '0' && *q <= '9') {
+        q++;
+    }
+    if (*q == '.') {
+        q++;
+        if (*q == '*') {
+            c->star = 1;
+            q++;
+        }
+        while (*q >= '0' && *q <= '9') {
+            q++;
+        }
+    }
+    char length = 0;
+    if (*q == 'h') {
+        q += q[1] == 'h' ? 2 : 1;
+    } else if (*q == 'l') {
+        length = q[1] == 'l' ? 'L' : 'l';
+        q += q[1] == 'l' ? 2 : 1;
+    } else if (*q == 'z' || *q == 'j') {
+        length = *q == 'z' ? 'z' : 'L';
+        q++;
+    }
+
+    switch (*q) {
+    case 's':
+        c->kind = 's';
+        break;
+    case 'p':
+        c->kind = 'p';
+        break;
+    case 'f': case 'g': case 'e':
+        c->kind = 'f';
+        break;
+    case '\0':
+        return NULL;
+    default:
+        c->kind = length ? length : 'i';
+    }
+    c->len = (size_t)(q + 1 - p);
+    return p;
+}
+
+static LogRing *ring_register(void) {
+    int i = atomic_fetch_add(&ring_count, 1);
+    if (i >= LOGGER_MAX_THREADS) {
+        return NULL;
+    }
+    LogRing *r = calloc(1, sizeof(LogRing));
+    if (r) {
+        atomic_store_explicit(&rings[i], r, memory_order_release);
+    }
+    my_ring = r;
+    return r;
+}
+
+void logger_write(int level, const char *fmt, ...) {
+    LogRing *r = my_ring ? my_ring : ring_register();
+    if (!r) {
+        atomic_fetch_add_explicit(&lost, 1, memory_order_relaxed);
+        return;
+    }
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOGGER_RING_SLOTS) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogSlot *s = &r->slots[head & (LOGGER_RING_SLOTS - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    s->ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    s->fmt = fmt;
+    s->level = level;
+
+    // Se copian solo los argumentos; el formato se aplica en el escritor
+    va_list ap;
+    va_start(ap, fmt);
+    int n = 0;
+    size_t used = 0;
+    Conv c;
+    for (const char *p = fmt; (p = next_conv(p, &c)); p = c.start + c.len) {
+        if (c.kind == '%') {
+            continue;
+        }
+        if (n + 1 + c.star > LOGGER_MAX_ARGS) {
+            break;
+        }
+        int prec = -1;
+        if (c.star) {
+            prec = va_arg(ap, int);
+            s->args[n++].i = prec;
+        }
+        switch (c.kind) {
+        case 'i':
+            s->args[n++].i = va_arg(ap, int);
+            break;
+        case 'l':
+            s->args[n++].i = va_arg(ap, long);
+            break;
+        case 'L':
+            s->args[n++].i = va_arg(ap, long long);
+            break;
+        case 'z':
+            s->args[n++].i = (long long)va_arg(ap, size_t);
+            break;
+        case 'f':
+            s->args[n++].f = va_arg(ap, double);
+            break;
+        case 'p':
+            s->args[n++].p = va_arg(ap, void *);
+            break;
+        case 's': {
+            const char *str = va_arg(ap, const char *);
+            if (!str) {
+                str = "(null)";
+            }
+            size_t len = prec >= 0 ? strnlen(str, (size_t)prec) : strlen(str);
+            size_t off = used;
+            if (used >= sizeof(s->data)) {
+                // El último byte ya es el '\0' de la cadena anterior
+                off = sizeof(s->data) - 1;
+                len = 0;
+            } else {
+                if (len > sizeof(s->data) - used - 1) {
+                    len = sizeof(s->data) - used - 1;
+                }
+                memcpy(&s->data[off], str, len);
+                s->data[off + len] = '\0';
+                used += len + 1;
+            }
+            s->args[n].s.off = (uint32_t)off;
+            s->args[n++].s.len = (uint32_t)len;
+            if (c.star) {
+                s->args[n - 2].i = (long long)len;
+            }
+            break;
+        }
+        }
+    }
+    va_end(ap);
+    s->nargs = n;
+
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+// Da formato a una línea en out; devuelve los bytes escritos
+static size_t format_slot(const LogSlot *s, char *out, size_t cap) {
+    time_t sec = (time_t)(s->ns / 1000000000);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    int len = snprintf(out, cap, "%02d:%02d:%02d.%03d %-5s ", tm.tm_hour, tm.tm_min,
+                       tm.tm_sec, (int)(s->ns / 1000000 % 1000), level_names[s->level]);
+
+    int a = 0;
+    Conv c;
+    const char *p = s->fmt;
+    while ((size_t)len < cap) {
+        const char *conv = next_conv(p, &c);
+        size_t lit = conv ? (size_t)(conv - p) : strlen(p);
+        if (lit > cap - len) {
+            lit = cap - len;
+        }
+        memcpy(out + len, p, lit);
+        len += (int)lit;
+        if (!conv) {
+            break;
+        }
+        p = c.start + c.len;
+
+        char spec[24];
+        if (c.kind == '%' || c.len >= sizeof(spec) || a + 1 + c.star > s->nargs) {
+            // "%%", o argumentos que no se copiaron: el texto tal cual
+            size_t l = c.kind == '%' ? 1 : c.len;
+            if ((size_t)len + l <= cap) {
+                memcpy(out + len, c.kind == '%' ? "%" : c.start, l);
+                len += (int)l;
+            }
+            continue;
+        }
+        memcpy(spec, c.start, c.len);
+        spec[c.len] = '\0';
+
+        int prec = c.star ? (int)s->args[a++].i : 0;
+        const LogArg *arg = &s->args[a++];
+        char *dst = out + len;
+        size_t room = cap - len;
+        int w = 0;
+        switch (c.kind) {
+        case 'i':
+            w = c.star ? snprintf(dst, room, spec, prec, (int)arg->i)
+                       : snprintf(dst, room, spec, (int)arg->i);
+            break;
+        case 'l':
+            w = c.star ? snprintf(dst, room, spec, prec, (long)arg->i)
+                       : snprintf(dst, room, spec, (long)arg->i);
+            break;
+        case 'L':
+            w = c.star ? snprintf(dst, room, spec, prec, arg->i)
+                       : snprintf(dst, room, spec, arg->i);
+            break;
+        case 'z':
+            w = c.star ? snprintf(dst, room, spec, prec, (size_t)arg->i)
+                       : snprintf(dst, room, spec, (size_t)arg->i);
+            break;
+        case 'f':
+            w = c.star ? snprintf(dst, room, spec, prec, arg->f)
+                       : snprintf(dst, room, spec, arg->f);
+            break;
+        case 'p':
+            w = snprintf(dst, room, spec, arg->p);
+            break;
+        case 's':
+            w = c.star ? snprintf(dst, room, spec, prec, &s->data[arg->s.off])
+                       : snprintf(dst, room, spec, &s->data[arg->s.off]);
+            break;
+        }
+        len += w < 0 ? 0 : (size_t)w < room ? w : (int)room - 1;
+    }
+
+    if ((size_t)len >= cap) {
+        len = (int)cap - 1;
+    }
+    out[len++] = '\n';
+    return (size_t)len;
+}
+
+// Saca las líneas de todos los anillos en orden de hora y las imprime en
+// bloques. Las de un mismo hilo siempre salen en el orden en que se escribieron.
+static void *writer_loop(void *arg) {
+    (void)arg;
+    char *out = malloc(LOGGER_OUT_BUF);
+    if (!out) {
+        return NULL;
+    }
+    LogRing *r[LOGGER_MAX_THREADS];
+    uint64_t heads[LOGGER_MAX_THREADS];
+    uint64_t tails[LOGGER_MAX_THREADS];
+
+    while (1) {
+        int n = atomic_load(&ring_count);
+        if (n > LOGGER_MAX_THREADS) {
+            n = LOGGER_MAX_THREADS;
+        }
+        for (int i = 0; i < n; i++) {
+            r[i] = atomic_load_explicit(&rings[i], memory_order_acquire);
+            heads[i] = r[i] ? atomic_load_explicit(&r[i]->head, memory_order_acquire) : 0;
+            tails[i] = r[i] ? atomic_load_explicit(&r[i]->tail, memory_order_relaxed) : 0;
+        }
+
+        size_t olen = 0;
+        int escritas = 0;
+        while (1) {
+            int mejor = -1;
+            const LogSlot *slot = NULL;
+            for (int i = 0; i < n; i++) {
+                if (tails[i] == heads[i]) {
+                    continue;
+                }
+                const LogSlot *s = &r[i]->slots[tails[i] & (LOGGER_RING_SLOTS - 1)];
+                if (!slot || s->ns < slot->ns) {
+                    slot = s;
+                    mejor = i;
+                }
+            }
+            if (mejor < 0) {
+                break;
+            }
+            if (LOGGER_OUT_BUF - olen < LOGGER_LINE_MAX) {
+                fwrite(out, 1, olen, stdout);
+                olen = 0;
+            }
+            olen += format_slot(slot, out + olen, LOGGER_LINE_MAX);
+            // El productor puede reutilizar el espacio desde aquí
+            atomic_store_explicit(&r[mejor]->tail, ++tails[mejor], memory_order_release);
+            escritas++;
+        }
+
+        unsigned long perdidas = atomic_exchange(&lost, 0);
+        for (int i = 0; i < n; i++) {
+            if (r[i]) {
+                perdidas += atomic_exchange(&r[i]->dropped, 0);
+            }
+        }
+        if (perdidas > 0) {
+            olen += (size_t)snprintf(out + olen, LOGGER_OUT_BUF - olen,
+                                     "Bitácora llena: se descartaron %lu líneas\n", perdidas);
+        }
+
+        if (olen > 0) {
+            fwrite(out, 1, olen, stdout);
+            fflush(stdout);
+        }
+        if (!escritas) {
+            usleep(LOGGER_IDLE_US);
+        }
+    }
+    return NULL;
+}
+
+int logger_start(int level, int sample) {
+    logger_level = level;
+    logger_sample = sample > 0 ? sample : 1;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer_loop, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+// Bitácora asíncrona del servidor. Cada hilo escribe en su propio anillo sin
+// candados y un hilo aparte da formato e imprime en stdout, así que el costo
+// en el camino caliente es copiar el formato y los argumentos. Si el anillo
+// está lleno la línea se descarta y se cuenta; nunca se bloquea al emisor.
+//
+// El formato debe ser una cadena literal (se guarda el puntero). Acepta las
+// conversiones d i u x c s p f g con los modificadores l ll z y precisión
+// '*'; las cadenas se copian al anillo y se truncan si no caben.
+
+typedef enum {
+    LOGGER_ERROR,
+    LOGGER_WARN,
+    LOGGER_INFO,
+    LOGGER_DEBUG
+} LogLevel;
+
+extern int logger_level;  // Las líneas de nivel mayor se descartan
+extern int logger_sample; // Las líneas muestreadas salen 1 de cada N
+extern __thread unsigned int logger_sample_count;
+
+// Arranca el hilo escritor; antes de esto las líneas solo se encolan
+int logger_start(int level, int sample);
+
+// Convierte "error", "warn", "info" o "debug" al nivel; -1 si no lo es
+int logger_parse_level(const char *name);
+
+void logger_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define log_at(level, ...) do {                          \
+        if ((level) <= logger_level) {                   \
+            logger_write((level), __VA_ARGS__);          \
+        }                                                \
+    } while (0)
+
+// Para eventos que ocurren una vez por mensaje de chat
+#define log_sampled(level, ...) do {                     \
+        if ((level) <= logger_level &&                   \
+            ++logger_sample_count % logger_sample == 0) { \
+            logger_write((level), __VA_ARGS__);          \
+        }                                                \
+    } while (0)
+
+#define log_error(...) log_at(LOGGER_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOGGER_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOGGER_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOGGER_DEBUG, __VA_ARGS__)
+
+#endif
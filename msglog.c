@@ -0,0 +1,534 @@
+#include "msglog.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG_MAGIC "CHATLOG1"
+#define LOG_HEADER_SIZE 64 // Los registros empiezan después de la cabecera
+
+// Cabecera del segmento. committed y count solo los escribe el hilo de
+// commit, después de sincronizar los registros que cubren.
+typedef struct {
+    char magic[8];
+    uint64_t first_seq;
+    uint64_t committed; // Fin de los registros que ya están en disco
+    uint64_t count;     // Registros hasta committed
+} SegmentHeader;
+
+// Cada registro: esta cabecera, from, to y content, con relleno a 8 bytes
+typedef struct {
+    uint32_t len;   // Bytes del registro con relleno; 0 marca el final
+    uint32_t check; // FNV-1a desde seq hasta el final del contenido
+    uint64_t seq;
+    int64_t ts;
+    uint16_t from_len;
+    uint16_t to_len;
+    uint32_t content_len;
+} RecordHeader;
+
+typedef struct {
+    uint64_t seq;
+    int64_t ts;
+    uint64_t off;
+} IndexEntry;
+
+typedef struct {
+    uint64_t first_seq;
+    size_t size;
+    unsigned char *base; // Mapeo del .log
+    IndexEntry *index;   // Mapeo del .idx
+    size_t index_cap;
+    uint64_t tail;       // Fin de lo agregado
+    uint64_t count;      // Registros agregados
+    uint64_t synced;     // Fin de lo sincronizado
+} Segment;
+
+// El candado protege la lista de segmentos y sus tail, count y synced. Los
+// registros ya agregados no cambian, así que se leen fuera de él.
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static char log_dir[512];
+static size_t log_segment_size;
+static int log_commit_ms;
+static Segment **segments = NULL; // Ordenados por first_seq, sin huecos
+static int segment_count = 0;
+static int segment_cap = 0;
+static int first_unsynced = 0;    // Primer segmento con algo por sincronizar
+static uint64_t next_seq = 1;
+static int dirty = 0;
+
+// Última búsqueda: un recorrido en orden no vuelve a pasar por el índice
+static Segment *last_seg = NULL;
+static uint64_t last_seq = 0;
+static uint64_t last_off = 0;
+
+static uint32_t fnv1a(const unsigned char *p, size_t len, uint32_t h) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t record_size(size_t from_len, size_t to_len, size_t content_len) {
+    return (sizeof(RecordHeader) + from_len + to_len + content_len + 7) & ~(size_t)7;
+}
+
+static uint32_t record_check(const RecordHeader *h) {
+    const unsigned char *p = (const unsigned char *)h;
+    size_t skip = offsetof(RecordHeader, seq);
+    return fnv1a(p + skip, sizeof(RecordHeader) - skip +
+                 h->from_len + h->to_len + h->content_len, 2166136261u);
+}
+
+// Registro válido de número seq en off, o NULL
+static RecordHeader *record_at(Segment *s, uint64_t off, uint64_t seq) {
+    if (off + sizeof(RecordHeader) > s->size) {
+        return NULL;
+    }
+    RecordHeader *h = (RecordHeader *)(s->base + off);
+    if (h->len < sizeof(RecordHeader) || h->len > s->size - off || h->seq != seq ||
+        record_size(h->from_len, h->to_len, h->content_len) != h->len ||
+        record_check(h) != h->check) {
+        return NULL;
+    }
+    return h;
+}
+
+static void index_note(Segment *s, uint64_t seq, int64_t ts, uint64_t off) {
+    uint64_t n = seq - s->first_seq;
+    if (n % MSGLOG_INDEX_EVERY == 0 && n / MSGLOG_INDEX_EVERY < s->index_cap) {
+        IndexEntry *e = &s->index[n / MSGLOG_INDEX_EVERY];
+        e->seq = seq;
+        e->ts = ts;
+        e->off = off;
+    }
+}
+
+// Mapea el segmento first_seq; create lo crea con log_segment_size bytes
+static Segment *segment_map(uint64_t first_seq, int create) {
+    char path[600];
+    int flags = O_RDWR | (create ? O_CREAT | O_EXCL : 0);
+    Segment *s = calloc(1, sizeof(Segment));
+    if (!s) {
+        return NULL;
+    }
+    s->first_seq = first_seq;
+
+    snprintf(path, sizeof(path), "%s/%020" PRIu64 ".log", log_dir, first_seq);
+    int fd = open(path, flags, 0644);
+    struct stat st;
+    if (fd < 0 || (create && ftruncate(fd, (off_t)log_segment_size) != 0) ||
+        fstat(fd, &st) != 0 || (size_t)st.st_size <= LOG_HEADER_SIZE) {
+        fprintf(stderr, "Registro: no se pudo abrir %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        free(s);
+        return NULL;
+    }
+    s->size = (size_t)st.st_size;
+    s->base = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    // Cabe una entrada por cada MSGLOG_INDEX_EVERY registros del menor tamaño
+    s->index_cap = (s->size - LOG_HEADER_SIZE) /
+                   (MSGLOG_INDEX_EVERY * sizeof(RecordHeader)) + 1;
+    size_t index_size = s->index_cap * sizeof(IndexEntry);
+    snprintf(path, sizeof(path), "%s/%020" PRIu64 ".idx", log_dir, first_seq);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd >= 0 && ftruncate(fd, (off_t)index_size) == 0) {
+        s->index = mmap(NULL, index_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (s->base == MAP_FAILED || !s->index || s->index == MAP_FAILED) {
+        fprintf(stderr, "Registro: no se pudo mapear el segmento %" PRIu64 "\n", first_seq);
+        if (s->base != MAP_FAILED) munmap(s->base, s->size);
+        if (s->index && s->index != MAP_FAILED) munmap(s->index, index_size);
+        free(s);
+        return NULL;
+    }
+
+    SegmentHeader *h = (SegmentHeader *)s->base;
+    if (create) {
+        memcpy(h->magic, LOG_MAGIC, 8);
+        h->first_seq = first_seq;
+        h->committed = LOG_HEADER_SIZE;
+        h->count = 0;
+    } else if (memcmp(h->magic, LOG_MAGIC, 8) != 0 || h->first_seq != first_seq ||
+               h->committed < LOG_HEADER_SIZE || h->committed > s->size) {
+        fprintf(stderr, "Registro: cabecera inválida en el segmento %" PRIu64 "\n", first_seq);
+        munmap(s->base, s->size);
+        munmap(s->index, index_size);
+        free(s);
+        return NULL;
+    }
+    s->tail = s->synced = h->committed;
+    s->count = h->count;
+    return s;
+}
+
+static int segment_push(Segment *s) {
+    if (segment_count == segment_cap) {
+        int cap = segment_cap ? segment_cap * 2 : 16;
+        Segment **nuevo = realloc(segments, cap * sizeof(Segment *));
+        if (!nuevo) {
+            return -1;
+        }
+        segments = nuevo;
+        segment_cap = cap;
+    }
+    segments[segment_count++] = s;
+    return 0;
+}
+
+// Revisa lo escrito después del último commit del segmento (todo el segmento
+// si se llenó antes de sincronizarse). Los registros completos se conservan;
+// lo que sigue a ellos se borra para que una caída posterior no lo confunda
+// con registros nuevos.
+static void segment_recover(Segment *s) {
+    RecordHeader *h;
+    while ((h = record_at(s, s->tail, s->first_seq + s->count))) {
+        index_note(s, h->seq, h->ts, s->tail);
+        s->tail += h->len;
+        s->count++;
+    }
+
+    uint64_t off = s->tail;
+    while (off + sizeof(RecordHeader) <= s->size) {
+        h = (RecordHeader *)(s->base + off);
+        uint32_t len = h->len;
+        if (len == 0) {
+            break;
+        }
+        if (len < sizeof(RecordHeader) || len > s->size - off) {
+            memset(h, 0, sizeof(RecordHeader));
+            break;
+        }
+        memset(h, 0, len);
+        off += len;
+    }
+    if (s->tail != s->synced) {
+        dirty = 1;
+    }
+}
+
+// Último segmento con first_seq <= seq; asume log_mutex
+static Segment *segment_for(uint64_t seq) {
+    int lo = 0, hi = segment_count - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (segments[mid]->first_seq <= seq) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found < 0 ? NULL : segments[found];
+}
+
+// Lleva a disco [desde, hasta) del segmento y después su cabecera
+static void segment_sync(Segment *s, uint64_t desde, uint64_t hasta, uint64_t count) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = desde & ~(uint64_t)(page - 1);
+    msync(s->base + start, hasta - start, MS_SYNC);
+
+    size_t entries = (count + MSGLOG_INDEX_EVERY - 1) / MSGLOG_INDEX_EVERY;
+    if (entries > s->index_cap) {
+        entries = s->index_cap;
+    }
+    if (entries) {
+        msync(s->index, entries * sizeof(IndexEntry), MS_SYNC);
+    }
+
+    SegmentHeader *h = (SegmentHeader *)s->base;
+    h->count = count;
+    h->committed = hasta;
+    msync(s->base, page, MS_SYNC);
+}
+
+// Group commit: tras el primer registro pendiente espera log_commit_ms y
+// sincroniza de una vez todo lo agregado en ese tiempo
+static void *commit_loop(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&log_mutex);
+    while (1) {
+        while (!dirty) {
+            pthread_cond_wait(&log_cond, &log_mutex);
+        }
+        pthread_mutex_unlock(&log_mutex);
+        if (log_commit_ms > 0) {
+            usleep((useconds_t)log_commit_ms * 1000);
+        }
+        pthread_mutex_lock(&log_mutex);
+
+        dirty = 0;
+        for (int i = first_unsynced; i < segment_count; i++) {
+            Segment *s = segments[i];
+            if (s->synced == s->tail) {
+                continue;
+            }
+            uint64_t desde = s->synced;
+            uint64_t hasta = s->tail;
+            uint64_t count = s->count;
+            pthread_mutex_unlock(&log_mutex);
+            segment_sync(s, desde, hasta, count);
+            pthread_mutex_lock(&log_mutex);
+            s->synced = hasta;
+        }
+        // Los segmentos llenos ya no reciben registros
+        while (first_unsynced < segment_count - 1 &&
+               segments[first_unsynced]->synced == segments[first_unsynced]->tail) {
+            first_unsynced++;
+        }
+    }
+    return NULL;
+}
+
+static int seg_name_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int msglog_open(const char *dir, size_t segment_size, int commit_ms) {
+    snprintf(log_dir, sizeof(log_dir), "%s", dir);
+    log_segment_size = segment_size;
+    log_commit_ms = commit_ms;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Registro: no se pudo crear %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Registro: no se pudo abrir %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    uint64_t *firsts = NULL;
+    int n = 0, cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+        uint64_t first;
+        char ext[8];
+        if (sscanf(ent->d_name, "%20" SCNu64 ".%7s", &first, ext) != 2 ||
+            strcmp(ext, "log") != 0) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *nuevo = realloc(firsts, cap * sizeof(uint64_t));
+            if (!nuevo) {
+                closedir(d);
+                free(firsts);
+                return -1;
+            }
+            firsts = nuevo;
+        }
+        firsts[n++] = first;
+    }
+    closedir(d);
+    qsort(firsts, n, sizeof(uint64_t), seg_name_cmp);
+
+    // Se leen las cabeceras y lo escrito tras el último commit de cada
+    // segmento; el resto de los registros se alcanza por el índice
+    for (int i = 0; i < n; i++) {
+        Segment *s = segment_map(firsts[i], 0);
+        if (!s || segment_push(s) != 0) {
+            free(firsts);
+            return -1;
+        }
+        segment_recover(s);
+        if (i > 0) {
+            Segment *prev = segments[i - 1];
+            if (prev->first_seq + prev->count != s->first_seq) {
+                fprintf(stderr, "Registro: falta un segmento antes de %" PRIu64 "\n",
+                        s->first_seq);
+                free(firsts);
+                return -1;
+            }
+        }
+    }
+    free(firsts);
+
+    if (segment_count == 0) {
+        Segment *s = segment_map(1, 1);
+        if (!s || segment_push(s) != 0) {
+            return -1;
+        }
+    }
+    Segment *last = segments[segment_count - 1];
+    next_seq = last->first_seq + last->count;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, commit_loop, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+uint64_t msglog_next_seq(void) {
+    pthread_mutex_lock(&log_mutex);
+    uint64_t seq = next_seq;
+    pthread_mutex_unlock(&log_mutex);
+    return seq;
+}
+
+uint64_t msglog_first_seq(void) {
+    pthread_mutex_lock(&log_mutex);
+    uint64_t seq = segment_count ? segments[0]->first_seq : next_seq;
+    pthread_mutex_unlock(&log_mutex);
+    return seq;
+}
+
+int msglog_append(time_t ts, const char *from, const char *to,
+                  const char *content, size_t content_len) {
+    size_t from_len = strlen(from);
+    size_t to_len = strlen(to);
+    size_t need = record_size(from_len, to_len, content_len);
+    if (from_len > UINT16_MAX || to_len > UINT16_MAX ||
+        need > log_segment_size - LOG_HEADER_SIZE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    Segment *s = segments[segment_count - 1];
+    if (s->tail + need > s->size) {
+        // Segmento nuevo: crear y mapear el archivo, sin esperar al disco
+        Segment *nuevo = segment_map(next_seq, 1);
+        if (!nuevo || segment_push(nuevo) != 0) {
+            pthread_mutex_unlock(&log_mutex);
+            return -1;
+        }
+        s = nuevo;
+    }
+
+    RecordHeader *h = (RecordHeader *)(s->base + s->tail);
+    h->seq = next_seq;
+    h->ts = (int64_t)ts;
+    h->from_len = (uint16_t)from_len;
+    h->to_len = (uint16_t)to_len;
+    h->content_len = (uint32_t)content_len;
+    char *p = (char *)(h + 1);
+    memcpy(p, from, from_len);
+    memcpy(p + from_len, to, to_len);
+    memcpy(p + from_len + to_len, content, content_len);
+    size_t used = sizeof(RecordHeader) + from_len + to_len + content_len;
+    memset((char *)h + used, 0, need - used);
+    h->check = record_check(h);
+    h->len = (uint32_t)need;
+
+    index_note(s, next_seq, h->ts, s->tail);
+    s->tail += need;
+    s->count++;
+    next_seq++;
+    if (!dirty) {
+        dirty = 1;
+        pthread_cond_signal(&log_cond);
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return 0;
+}
+
+// Posición del registro seq dentro de s; asume log_mutex
+static uint64_t record_offset(Segment *s, uint64_t seq) {
+    uint64_t cur, off;
+    if (last_seg == s && last_seq < seq && seq - last_seq <= MSGLOG_INDEX_EVERY) {
+        cur = last_seq;
+        off = last_off;
+    } else {
+        IndexEntry *e = &s->index[(seq - s->first_seq) / MSGLOG_INDEX_EVERY];
+        cur = e->seq;
+        off = e->off;
+    }
+    while (cur < seq) {
+        off += ((RecordHeader *)(s->base + off))->len;
+        cur++;
+    }
+    last_seg = s;
+    last_seq = seq;
+    last_off = off;
+    return off;
+}
+
+int msglog_get(uint64_t seq, LogRecord *rec) {
+    pthread_mutex_lock(&log_mutex);
+    Segment *s = segment_for(seq);
+    if (!s || seq >= s->first_seq + s->count) {
+        pthread_mutex_unlock(&log_mutex);
+        return -1;
+    }
+    RecordHeader *h = (RecordHeader *)(s->base + record_offset(s, seq));
+    pthread_mutex_unlock(&log_mutex);
+
+    const char *p = (const char *)(h + 1);
+    rec->seq = h->seq;
+    rec->ts = (time_t)h->ts;
+    rec->from = p;
+    rec->from_len = h->from_len;
+    rec->to = p + h->from_len;
+    rec->to_len = h->to_len;
+    rec->content = p + h->from_len + h->to_len;
+    rec->content_len = h->content_len;
+    return 0;
+}
+
+uint64_t msglog_seq_at(time_t ts) {
+    pthread_mutex_lock(&log_mutex);
+
+    // Último segmento cuyo primer registro es anterior a ts
+    int lo = 0, hi = segment_count - 1, si = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (segments[mid]->count > 0 && segments[mid]->index[0].ts < (int64_t)ts) {
+            si = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (si < 0) {
+        uint64_t first = segments[0]->first_seq;
+        pthread_mutex_unlock(&log_mutex);
+        return first;
+    }
+
+    // Última entrada del índice anterior a ts, y de ahí registro a registro
+    Segment *s = segments[si];
+    size_t entries = (s->count + MSGLOG_INDEX_EVERY - 1) / MSGLOG_INDEX_EVERY;
+    size_t a = 0, b = entries - 1;
+    while (a < b) {
+        size_t mid = (a + b + 1) / 2;
+        if (s->index[mid].ts < (int64_t)ts) {
+            a = mid;
+        } else {
+            b = mid - 1;
+        }
+    }
+    uint64_t seq = s->index[a].seq;
+    uint64_t off = s->index[a].off;
+    uint64_t end = s->first_seq + s->count;
+    while (seq < end) {
+        RecordHeader *h = (RecordHeader *)(s->base + off);
+        if (h->ts >= (int64_t)ts) {
+            break;
+        }
+        off += h->len;
+        seq++;
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return seq;
+}
@@ -0,0 +1,49 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Registro de mensajes de chat en disco: solo se agrega al final, en
+// segmentos de tamaño fijo mapeados en memoria. Cada segmento "<seq>.log"
+// empieza con una cabecera que dice hasta dónde está sincronizado; su índice
+// "<seq>.idx" guarda (seq, hora, posición) de uno de cada MSGLOG_INDEX_EVERY
+// registros. Al arrancar se leen las cabeceras y solo se revisa lo escrito
+// después del último commit.
+
+#define MSGLOG_INDEX_EVERY 64
+
+// Un registro tal como está en el segmento; los punteros apuntan al mapeo y
+// valen mientras el proceso siga vivo (los segmentos no se desmapean)
+typedef struct {
+    uint64_t seq;
+    time_t ts;
+    const char *from;
+    size_t from_len;
+    const char *to;      // to_len == 0 en los broadcasts
+    size_t to_len;
+    const char *content; // Escapado como JSON
+    size_t content_len;
+} LogRecord;
+
+// Abre o crea el registro en dir y recupera el estado. Un hilo sincroniza
+// lo agregado cada commit_ms (group commit). Devuelve 0 si todo fue bien.
+int msglog_open(const char *dir, size_t segment_size, int commit_ms);
+
+// Número que tendrá el próximo registro y el del más antiguo en disco
+uint64_t msglog_next_seq(void);
+uint64_t msglog_first_seq(void);
+
+// Agrega un registro con el número msglog_next_seq(). Solo copia al mapeo;
+// no espera al disco. Devuelve -1 si no cabe en un segmento o falla el disco.
+int msglog_append(time_t ts, const char *from, const char *to,
+                  const char *content, size_t content_len);
+
+// Busca el registro seq a partir del índice disperso; 0 si lo encontró
+int msglog_get(uint64_t seq, LogRecord *rec);
+
+// Primer registro con hora >= ts (msglog_next_seq() si no hay ninguno)
+uint64_t msglog_seq_at(time_t ts);
+
+#endif
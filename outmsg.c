@@ -0,0 +1,87 @@
+#include "outmsg.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binproto.h"
+
+__thread int current_tsi = 0;
+__thread int64_t rx_started_ns = 0;
+atomic_int format_sessions[2];
+
+OutMsg *outmsg_alloc(size_t len) {
+    OutMsg *msg = malloc(sizeof(OutMsg) + LWS_PRE + len + 1);
+    if (!msg) {
+        return NULL;
+    }
+    atomic_init(&msg->refs, 1);
+    msg->tsi = current_tsi;
+    msg->binary = 0;
+    msg->rx_ns = rx_started_ns;
+    msg->len = len;
+    return msg;
+}
+
+OutMsg *outmsg_new(const char *text, size_t len) {
+    OutMsg *msg = outmsg_alloc(len);
+    if (msg) {
+        memcpy(&msg->data[LWS_PRE], text, len);
+    }
+    return msg;
+}
+
+OutMsg *outmsg_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        return NULL;
+    }
+
+    OutMsg *msg = outmsg_alloc((size_t)len);
+    if (!msg) {
+        return NULL;
+    }
+    va_start(ap, fmt);
+    vsnprintf((char *)&msg->data[LWS_PRE], (size_t)len + 1, fmt, ap);
+    va_end(ap);
+    return msg;
+}
+
+OutMsg *outmsg_from_json(json_t *json) {
+    char *text = json_dumps(json, JSON_COMPACT);
+    if (!text) {
+        return NULL;
+    }
+    OutMsg *msg = outmsg_new(text, strlen(text));
+    free(text);
+    return msg;
+}
+
+OutMsg *outmsg_for_thread(OutMsg *msg, int tsi) {
+    if (msg->tsi == tsi) {
+        return outmsg_ref(msg);
+    }
+    OutMsg *copy = outmsg_new((const char *)&msg->data[LWS_PRE], msg->len);
+    if (copy) {
+        copy->tsi = tsi;
+        copy->binary = msg->binary;
+        copy->rx_ns = msg->rx_ns;
+    }
+    return copy;
+}
+
+OutMsg *bin_msg_new(unsigned int type, size_t payload, unsigned char **p) {
+    OutMsg *msg = outmsg_alloc(BIN_HEADER_LEN + payload);
+    if (!msg) {
+        return NULL;
+    }
+    msg->binary = 1;
+    unsigned char *q = bin_put_u8(&msg->data[LWS_PRE], type);
+    *p = bin_put_u32(q, (uint32_t)time(NULL));
+    return msg;
+}
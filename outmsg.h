@@ -0,0 +1,80 @@
+#ifndef OUTMSG_H
+#define OUTMSG_H
+
+#include <libwebsockets.h>
+#include <jansson.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Mensajes de salida del servidor ya serializados y compartidos entre todos
+// sus destinatarios.
+
+// Formatos de salida: índice en Outbound.fmt y valor de SessionData.binary
+#define FMT_JSON 0
+#define FMT_BIN 1
+
+// Mensaje de salida ya serializado, con el espacio LWS_PRE que exige lws_write.
+// Es inmutable y se comparte entre todos los destinatarios por conteo de
+// referencias: un envío masivo es una serialización y N encolados.
+typedef struct {
+    atomic_int refs;
+    int tsi;            // Hilo de servicio que lo escribe (lws toca su LWS_PRE)
+    int binary;         // Frame binario (chat-protocol-bin) o de texto
+    int64_t rx_ns;      // Recepción del mensaje que lo originó, 0 si no hubo
+    size_t len;
+    unsigned char data[];
+} OutMsg;
+
+// Un mismo mensaje en cada formato de salida. Cada formato se codifica una
+// sola vez y lo comparten todas las sesiones que lo hablan; NULL si no hace
+// falta (nadie conectado con ese formato).
+typedef struct {
+    OutMsg *fmt[2];
+} Outbound;
+
+extern __thread int current_tsi;       // Hilo de servicio que ejecuta el código
+extern __thread int64_t rx_started_ns; // Recepción que se está atendiendo
+extern atomic_int format_sessions[2];  // Conexiones abiertas de cada formato
+
+// Reserva un mensaje de len bytes del hilo actual, con una referencia
+OutMsg *outmsg_alloc(size_t len);
+
+OutMsg *outmsg_new(const char *text, size_t len);
+
+// Formatea directamente dentro del búfer compartido, sin límite de tamaño
+OutMsg *outmsg_printf(const char *fmt, ...);
+
+OutMsg *outmsg_from_json(json_t *json);
+
+// Referencia al mensaje válida para el hilo tsi. lws escribe la cabecera del
+// frame en el LWS_PRE del búfer, así que cada hilo escribe su propia copia.
+OutMsg *outmsg_for_thread(OutMsg *msg, int tsi);
+
+// Reserva un mensaje binario y escribe su cabecera; *p apunta a los campos
+OutMsg *bin_msg_new(unsigned int type, size_t payload, unsigned char **p);
+
+static inline OutMsg *outmsg_ref(OutMsg *msg) {
+    atomic_fetch_add_explicit(&msg->refs, 1, memory_order_relaxed);
+    return msg;
+}
+
+static inline void outmsg_unref(OutMsg *msg) {
+    if (msg && atomic_fetch_sub_explicit(&msg->refs, 1, memory_order_acq_rel) == 1) {
+        free(msg);
+    }
+}
+
+static inline void outbound_release(Outbound *o) {
+    outmsg_unref(o->fmt[FMT_JSON]);
+    outmsg_unref(o->fmt[FMT_BIN]);
+    o->fmt[FMT_JSON] = o->fmt[FMT_BIN] = NULL;
+}
+
+// Solo se codifica un formato si hay alguna conexión que lo use
+static inline int format_in_use(int fmt) {
+    return atomic_load_explicit(&format_sessions[fmt], memory_order_relaxed) > 0;
+}
+
+#endif
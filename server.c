@@ -1,7 +1,8 @@
-//gcc server.c -o server -lwebsockets -ljansson -lpthread
+//gcc server.c frame.c msglog.c logger.c outmsg.c directory.c encode.c userlist.c idle.c -o server -lwebsockets -ljansson -lpthread
 //wscat -c ws://localhost:8000
 //ssh -i /home/czar/ProyectoSistos1/KEY_PAIR_CHAT_SERVER.pem ubuntu@3.144.12.94
 
+#define _GNU_SOURCE // strptime y timegm
 #include <libwebsockets.h>
 #include <string.h>
 #include <stdlib.h>
@@ -9,512 +10,2424 @@
 #include <jansson.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdatomic.h>
+
+#include "frame.h"
+#include "binproto.h"
+#include "msglog.h"
+#include "logger.h"
+#include "outmsg.h"
+#include "directory.h"
+#include "encode.h"
+#include "userlist.h"
+#include "idle.h"
+
+#define MAX_SERVICE_THREADS 32
+#define DEFAULT_QUEUE_MAX_MSGS 256            // Mensajes pendientes por conexión
+#define DEFAULT_QUEUE_MAX_BYTES (1024 * 1024) // Bytes pendientes por conexión
+#define DEFAULT_AWAY_SECS 10                  // Inactividad antes de AUSENTE
+#define PRESENCE_INDEX_INITIAL 64             // Cubetas iniciales del lote de presencia
+#define DEFAULT_MAX_MSG (64 * 1024)           // Tamaño máximo de un mensaje entrante
+#define RX_KEEP_BYTES (16 * 1024)             // Búfer de reensamblado que se conserva entre mensajes
+#define OUT_CHUNK_SIZE 4096                   // Fragmento de salida para mensajes grandes
+#define DEFAULT_HISTORY_MSGS 256              // Mensajes que guarda el historial
+#define DEFAULT_HISTORY_BYTES (256 * 1024)    // Contenido total del historial
+#define DEFAULT_HISTORY_REPLAY 50             // Mensajes del historial al registrarse
+#define HISTORY_REPLAY_BATCH 8                // Mensajes guardados que se encolan por turno
+#define HISTORY_REPLAY_SCAN 256               // Entradas revisadas por turno de escritura
+#define HISTORY_IN_LOG ((size_t)-1)           // HistoryEntry.off: contenido solo en disco
+#define DEFAULT_LOG_SEGMENT_MB 64             // Tamaño de cada segmento del registro
+#define DEFAULT_LOG_COMMIT_MS 5               // Ventana del group commit
+#define DEFAULT_OFFLINE_MAX_MSGS 100          // Mensajes guardados por destinatario desconectado
+#define DEFAULT_OFFLINE_MAX_BYTES (64 * 1024) // Bytes guardados por destinatario desconectado
+#define OFFLINE_BUCKETS_INITIAL 64            // Cubetas iniciales de los buzones (potencia de 2)
+#define METRICS_BUCKETS 16                    // Cubetas finitas de cada histograma
+#define ROOM_SHARDS 16                        // Fragmentos de la tabla de salas
+#define ROOM_HASH_INITIAL 16                  // Cubetas iniciales de cada fragmento (potencia de 2)
+#define MAX_ROOMS_PER_SESSION 64              // Salas a las que puede unirse una conexión
+
+struct SessionData;
+struct Room;
+
+// Mensaje privado guardado para un usuario desconectado, escapado como JSON
+typedef struct OfflineMsg {
+    struct OfflineMsg *next;
+    time_t ts;
+    char from[32];
+    size_t len;
+    char content[];
+} OfflineMsg;
+
+// Datos por conexión: enlace directo wsi -> usuario registrado y cola de salida.
+// Solo los toca el hilo de servicio que atiende la conexión.
+typedef struct SessionData {
+    User *user;
+    struct lws *wsi;
+    int tsi;            // Hilo de servicio dueño de la conexión
+    int binary;         // Negoció chat-protocol-bin: FMT_BIN, si no FMT_JSON
+    OutMsg **queue;     // Cola circular de queue_max_msgs entradas
+    int q_head;
+    int q_count;
+    size_t q_bytes;
+    int overflow;       // Superó el límite con la política "disconnect"
+    unsigned long dropped;
+    struct SessionData *local_next; // Sesiones registradas del mismo hilo
+    struct SessionData *local_prev;
+    IdleEntry idle;       // Vence cuando debe pasar a AUSENTE sin más actividad
+    char *rx_buf;       // Reensamblado de mensajes que llegan en varios trozos
+    size_t rx_len;
+    size_t rx_cap;
+    OutMsg *tx_msg;     // Mensaje grande a medio enviar por fragmentos
+    size_t tx_off;
+    uint64_t replay_seq; // Próxima entrada del historial por reenviar
+    uint64_t replay_end; // Primera entrada posterior al registro
+    OfflineMsg *offline; // Mensajes del buzón que faltan por encolar
+    struct Room **rooms; // Salas a las que se unió, MAX_ROOMS_PER_SESSION entradas
+    int room_count;
+} SessionData;
+
+// Entrega pendiente para otro hilo de servicio
+typedef struct Mail {
+    Outbound out;        // Copias propias del hilo destino
+    SessionData *target; // NULL: todas las sesiones registradas del hilo
+    struct Mail *next;
+} Mail;
+
+// Tipos de mensaje que se cuentan por separado en /metrics
+static const char *metric_types[] = {
+    "register", "broadcast", "private", "list_users", "user_info", "change_status",
+    "disconnect", "history", "join_room", "leave_room", "room_message", "other"
+};
+#define METRIC_TYPES (sizeof(metric_types) / sizeof(metric_types[0]))
 
-#define MAX_USERS 100
+// Límites superiores de las cubetas, en nanosegundos; la última es +Inf
+static const int64_t metric_bounds_ns[METRICS_BUCKETS] = {
+    10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+    5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000, 1000000000
+};
 
 typedef struct {
-    char username[32];
-    struct lws *wsi;
+    _Atomic uint64_t buckets[METRICS_BUCKETS + 1];
+    _Atomic uint64_t sum_ns;
+} Histogram;
+
+// Métricas de un hilo de servicio. Solo las escribe ese hilo, así que se
+// actualizan con carga y guardado relajados, sin lectura-modificación-escritura
+// atómica; son _Atomic porque /metrics las lee y las suma desde otro hilo.
+typedef struct {
+    _Atomic uint64_t received[METRIC_TYPES];
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t frames_out;
+    _Atomic uint64_t queue_msgs;     // Mensajes en las colas de salida
+    _Atomic uint64_t queue_bytes;
+    _Atomic uint64_t dropped;        // Descartados por cola llena
+    _Atomic uint64_t overflow_closes; // Desconectados por cola llena
+    Histogram latency;               // De la recepción al envío de cada mensaje
+    Histogram fanout;                // Encolar un mensaje a todos sus destinatarios
+} ThreadMetrics;
+
+// Estado propio de cada hilo de servicio de lws
+typedef struct {
+    int tsi;
+    pthread_t thread;
+    pthread_mutex_t mail_lock;  // Buzón: lo llenan otros hilos
+    Mail *mail_head;
+    Mail *mail_tail;
+    SessionData *local;         // Sesiones registradas atendidas por este hilo
+    IdleWheel idle_wheel;       // Sesiones del hilo por plazo de inactividad
+    lws_sorted_usec_list_t idle_sul;
+    UserlistCache list_cache;   // Respuestas con la lista de usuarios de este hilo
+    // Copia de cada fragmento de salida con su LWS_PRE, para no escribir la
+    // cabecera dentro del búfer compartido
+    unsigned char tx_scratch[LWS_PRE + OUT_CHUNK_SIZE];
+    ThreadMetrics metrics;
+} ServiceThread;
+
+static atomic_uint next_user_id = 1;
+
+// Límites de la cola de salida de cada conexión
+static int queue_max_msgs = DEFAULT_QUEUE_MAX_MSGS;
+static size_t queue_max_bytes = DEFAULT_QUEUE_MAX_BYTES;
+static int queue_disconnect = 0; // 0: descartar mensajes nuevos, 1: desconectar
+
+static size_t max_msg = DEFAULT_MAX_MSG; // Límite de un mensaje entrante reensamblado
+
+// permessage-deflate (RFC 7692), solo si se pide con --deflate. La ventana y
+// el nivel se aplican a lo que comprime el servidor; zlib se inicializa con
+// el primer mensaje, así que basta fijarlos al establecer la conexión.
+static int deflate_enabled = 0;
+static int deflate_window_bits = 15;
+static int deflate_level = 6;
+
+static const struct lws_extension extensions[] = {
+    {
+        "permessage-deflate",
+        lws_extension_callback_pm_deflate,
+        "permessage-deflate; client_max_window_bits"
+    },
+    { NULL, NULL, NULL }
+};
+
+static struct lws_context *ws_context;
+static ServiceThread service[MAX_SERVICE_THREADS];
+static int service_count = 1;
+
+// Inactividad: segundos sin mensajes antes de pasar a AUSENTE
+static int away_secs = DEFAULT_AWAY_SECS;
+
+// Cambio de presencia pendiente de enviar en el próximo status_batch
+typedef struct {
+    char user[32];
     char status[16];
-    char ip[64];
-    int active;
-    time_t last_activity;
-} User;
-
-static User users[MAX_USERS];
-pthread_mutex_t user_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-void gen_timestamp(char *buffer, size_t buffer_size) {
-  time_t now = time(NULL);
-  struct tm *t = gmtime(&now);
-  strftime(buffer, buffer_size, "%Y-%m-%dT%H:%M:%SZ", t);
-}
-
-void *monitor_inactividad(void *arg) {
-    while (1) {
-        sleep(1);
-        time_t ahora = time(NULL);
-
-        pthread_mutex_lock(&user_mutex);
-        for (int i = 0; i < MAX_USERS; i++) {
-            if (users[i].active && strcmp(users[i].status, "AUSENTE") != 0) {
-                double inactivo = difftime(ahora, users[i].last_activity);
-                if (inactivo >= 10) {
-                    strcpy(users[i].status, "AUSENTE");
-
-                    char timestamp[64];
-                    gen_timestamp(timestamp, sizeof(timestamp));
-
-                    json_t *status_obj = json_object();
-                    json_object_set_new(status_obj, "user", json_string(users[i].username));
-                    json_object_set_new(status_obj, "status", json_string("AUSENTE"));
-
-                    json_t *response = json_object();
-                    json_object_set_new(response, "type", json_string("status_update"));
-                    json_object_set_new(response, "sender", json_string("server"));
-                    json_object_set_new(response, "content", status_obj);
-                    json_object_set_new(response, "timestamp", json_string(timestamp));
-
-                    char *response_str = json_dumps(response, JSON_COMPACT);
-
-                    for (int j = 0; j < MAX_USERS; j++) {
-                        if (users[j].active && users[j].wsi) {
-                            unsigned char buf[LWS_PRE + 1024];
-                            unsigned char *p = &buf[LWS_PRE];
-                            size_t n = strlen(response_str);
-                            memcpy(p, response_str, n);
-                            lws_write(users[j].wsi, p, n, LWS_WRITE_TEXT);
-                        }
-                    }
-
-                    printf("Usuario %s marcado como AUSENTE\n", users[i].username);
-
-                    free(response_str);
-                    json_decref(response);
+    uint32_t id;
+    unsigned int hash;
+    int next; // Siguiente cambio en la misma cubeta, -1 al final
+} PresenceChange;
+
+// Lote de presencia: 0 envía cada cambio al momento; si no, los cambios se
+// acumulan durante la ventana y el último de cada usuario sale en un solo frame
+static int presence_batch_ms = 0;
+static pthread_mutex_t presence_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PresenceChange *presence = NULL; // En orden de llegada
+static int presence_count = 0;
+static int presence_cap = 0;
+static int *presence_index = NULL;      // Cubetas por hash del nombre
+static unsigned int presence_index_size = 0;
+static lws_sorted_usec_list_t presence_sul;
+
+// Mensaje de chat guardado en el historial. El contenido queda escapado como
+// JSON, igual que llega en el frame.
+typedef struct {
+    time_t ts;
+    char from[32];
+    char to[32];   // Vacío en los broadcasts
+    size_t off;    // Posición del contenido en history_text
+    size_t len;
+} HistoryEntry;
+
+// Historial de memoria fija: un anillo de entradas y otro de bytes para el
+// contenido. La entrada con número de secuencia n está en history[n % history_max];
+// las que se pisan al escribir se descartan empezando por la más antigua.
+static int history_max = DEFAULT_HISTORY_MSGS; // 0 lo desactiva (--history-msgs 0)
+static size_t history_bytes = DEFAULT_HISTORY_BYTES;
+static int history_replay = DEFAULT_HISTORY_REPLAY;
+static pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+static HistoryEntry *history = NULL;
+static char *history_text = NULL;
+static size_t history_head = 0;  // Donde va el próximo contenido
+static uint64_t history_first = 1; // Entrada más antigua que se conserva
+static uint64_t history_next = 1;  // Número de la próxima entrada
+
+// Buzón de un usuario desconectado. Los buzones se buscan por el hash del
+// nombre y los protege offline_mutex, que se toma con el candado del
+// fragmento del destinatario ya tomado: así un privado no puede quedar en el
+// buzón después de que el destinatario se registró.
+typedef struct Mailbox {
+    char username[32];
+    unsigned int hash;
+    int count;
+    size_t bytes;
+    OfflineMsg *head;
+    OfflineMsg *tail;
+    struct Mailbox *next; // Siguiente buzón en la misma cubeta
+} Mailbox;
+
+static int offline_max_msgs = DEFAULT_OFFLINE_MAX_MSGS; // 0 desactiva los buzones
+static size_t offline_max_bytes = DEFAULT_OFFLINE_MAX_BYTES;
+static pthread_mutex_t offline_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Mailbox **mailboxes = NULL;
+static unsigned int mailbox_size = 0;
+static int mailbox_count = 0;
+
+// Sala: los miembros están en un arreglo compacto, así que un mensaje recorre
+// solo a quienes se unieron. La protege el candado de su fragmento.
+typedef struct Room {
+    char name[32];
+    unsigned int hash;
+    SessionData **members;
+    int count;
+    int cap;
+    int formats[2];         // Miembros de cada formato de salida
+    struct Room *hash_next; // Siguiente sala en la misma cubeta
+} Room;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Room **hash;
+    unsigned int hash_size;
+    int count;
+} RoomShard;
+
+static RoomShard room_shards[ROOM_SHARDS];
+
+// Registro en disco (--log-dir): guarda todo lo que pasa por el historial con
+// el mismo número de secuencia y lo recupera al arrancar
+static const char *log_dir = NULL;
+static int log_segment_mb = DEFAULT_LOG_SEGMENT_MB;
+static int log_commit_ms = DEFAULT_LOG_COMMIT_MS;
+
+// Nombre aceptable para registrarse: no vacío y sin nada que escapar, porque
+// viaja tal cual dentro de los frames JSON
+static int username_ok(const char *name) {
+    return name[0] && json_escaped_len(name, strlen(name)) == strlen(name);
+}
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static ThreadMetrics *thread_metrics(void) {
+    return &service[current_tsi].metrics;
+}
+
+// Solo el hilo dueño escribe: basta leer y guardar, sin instrucción atómica
+static void metric_add(_Atomic uint64_t *c, uint64_t d) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + d,
+                          memory_order_relaxed);
+}
+
+static void histogram_observe(Histogram *h, int64_t ns) {
+    int b = 0;
+    while (b < METRICS_BUCKETS && ns > metric_bounds_ns[b]) {
+        b++;
+    }
+    metric_add(&h->buckets[b], 1);
+    metric_add(&h->sum_ns, (uint64_t)ns);
+}
+
+// Agrega a una respuesta el id de la solicitud que la originó: en JSON como
+// primer campo, en binario como varint al final. msg puede estar compartido
+// (la lista de usuarios), así que se copia; sin id se devuelve tal cual.
+static OutMsg *outmsg_with_id(OutMsg *msg, StrView id) {
+    if (!msg || !id.ptr) {
+        return msg;
+    }
+    if (id.len > REQUEST_ID_MAX_LEN) {
+        // handle_message ya rechaza estos; no debería llegar ninguno
+        log_warn("'id' de %zu bytes, no se devuelve", id.len);
+        return msg;
+    }
+
+    const unsigned char *src = &msg->data[LWS_PRE];
+    OutMsg *copy;
+    if (msg->binary) {
+        // En binario el id llega como varint y se guardó en decimal
+        char num[REQUEST_ID_MAX_LEN + 1];
+        memcpy(num, id.ptr, id.len);
+        num[id.len] = '\0';
+        size_t v = strtoull(num, NULL, 10);
+        copy = outmsg_alloc(msg->len + bin_varint_len(v));
+        if (copy) {
+            copy->binary = 1;
+            memcpy(&copy->data[LWS_PRE], src, msg->len);
+            bin_put_varint(&copy->data[LWS_PRE + msg->len], v);
+        }
+    } else {
+        // {"id":<id>, y el objeto original sin su '{'
+        copy = outmsg_alloc(msg->len + id.len + 6);
+        if (copy) {
+            unsigned char *p = &copy->data[LWS_PRE];
+            memcpy(p, "{\"id\":", 6);
+            memcpy(p + 6, id.ptr, id.len);
+            p[6 + id.len] = ',';
+            memcpy(p + 7 + id.len, src + 1, msg->len - 1);
+        }
+    }
+    outmsg_unref(msg);
+    return copy;
+}
+
+// Encola una referencia a msg respetando los límites; el llamador conserva
+// la suya. Solo desde el hilo dueño de la sesión
+static void queue_push(SessionData *s, OutMsg *msg) {
+    if (!s || !msg || s->overflow) {
+        return;
+    }
+
+    if (s->q_count >= queue_max_msgs ||
+        (s->q_count > 0 && s->q_bytes + msg->len > queue_max_bytes)) {
+        if (queue_disconnect) {
+            s->overflow = 1;
+            lws_callback_on_writable(s->wsi);
+        } else {
+            s->dropped++;
+            metric_add(&thread_metrics()->dropped, 1);
+        }
+        return;
+    }
+
+    s->queue[(s->q_head + s->q_count) % queue_max_msgs] = outmsg_ref(msg);
+    s->q_count++;
+    s->q_bytes += msg->len;
+    metric_add(&thread_metrics()->queue_msgs, 1);
+    metric_add(&thread_metrics()->queue_bytes, msg->len);
+    lws_callback_on_writable(s->wsi);
+}
+
+// Saca el siguiente mensaje pendiente con su referencia
+static OutMsg *queue_pop(SessionData *s) {
+    if (s->q_count == 0) {
+        return NULL;
+    }
+    OutMsg *msg = s->queue[s->q_head];
+    s->q_head = (s->q_head + 1) % queue_max_msgs;
+    s->q_count--;
+    s->q_bytes -= msg->len;
+    metric_add(&thread_metrics()->queue_msgs, (uint64_t)-1);
+    metric_add(&thread_metrics()->queue_bytes, -(uint64_t)msg->len);
+    return msg;
+}
+
+// Encola una respuesta dirigida solo a esta conexión y suelta la referencia
+static void session_send(SessionData *s, OutMsg *msg) {
+    queue_push(s, msg);
+    outmsg_unref(msg);
+}
+
+// Deja o en el buzón del hilo st; toma sus propias referencias
+static void mail_post(ServiceThread *st, const Outbound *o, SessionData *target) {
+    Mail *m = malloc(sizeof(Mail));
+    if (!m) {
+        return;
+    }
+    for (int f = 0; f < 2; f++) {
+        m->out.fmt[f] = o->fmt[f] ? outmsg_for_thread(o->fmt[f], st->tsi) : NULL;
+    }
+    m->target = target;
+    m->next = NULL;
+    if (!m->out.fmt[FMT_JSON] && !m->out.fmt[FMT_BIN]) {
+        free(m);
+        return;
+    }
+
+    pthread_mutex_lock(&st->mail_lock);
+    if (st->mail_tail) {
+        st->mail_tail->next = m;
+    } else {
+        st->mail_head = m;
+    }
+    st->mail_tail = m;
+    pthread_mutex_unlock(&st->mail_lock);
+}
+
+// Envía msg a una sesión registrada. Si la atiende otro hilo, pasa por su
+// buzón; el llamador debe tener tomado el candado del fragmento del destino
+// para que la sesión no se cierre mientras tanto.
+static void deliver_to(SessionData *target, const Outbound *o) {
+    if (!target || !o->fmt[target->binary]) {
+        return;
+    }
+    if (target->tsi == current_tsi) {
+        queue_push(target, o->fmt[target->binary]);
+    } else {
+        mail_post(&service[target->tsi], o, target);
+        lws_cancel_service_pt(target->wsi);
+    }
+}
+
+// Envía o a todas las sesiones registradas, cada una en su formato: las del
+// hilo actual directamente y las de los demás hilos a través de sus buzones.
+static void deliver_all(const Outbound *o) {
+    if (!o->fmt[FMT_JSON] && !o->fmt[FMT_BIN]) {
+        return;
+    }
+    int64_t inicio = now_ns();
+    for (SessionData *s = service[current_tsi].local; s; s = s->local_next) {
+        queue_push(s, o->fmt[s->binary]);
+    }
+    if (service_count > 1) {
+        for (int t = 0; t < service_count; t++) {
+            if (t != current_tsi) {
+                mail_post(&service[t], o, NULL);
+            }
+        }
+        lws_cancel_service(ws_context);
+    }
+    histogram_observe(&thread_metrics()->fanout, now_ns() - inicio);
+}
+
+static void local_insert(SessionData *s) {
+    ServiceThread *st = &service[s->tsi];
+    s->local_prev = NULL;
+    s->local_next = st->local;
+    if (st->local) {
+        st->local->local_prev = s;
+    }
+    st->local = s;
+}
+
+static void local_remove(SessionData *s) {
+    ServiceThread *st = &service[s->tsi];
+    if (s->local_prev) {
+        s->local_prev->local_next = s->local_next;
+    } else if (st->local == s) {
+        st->local = s->local_next;
+    }
+    if (s->local_next) {
+        s->local_next->local_prev = s->local_prev;
+    }
+    s->local_next = s->local_prev = NULL;
+}
+
+// Reconstruye las cubetas del lote con el doble de tamaño; asume presence_mutex
+static int presence_index_grow(void) {
+    unsigned int size = presence_index_size ? presence_index_size * 2 : PRESENCE_INDEX_INITIAL;
+    int *index = malloc(size * sizeof(int));
+    if (!index) {
+        return -1;
+    }
+    memset(index, 0xff, size * sizeof(int));
+    for (int i = 0; i < presence_count; i++) {
+        unsigned int b = presence[i].hash & (size - 1);
+        presence[i].next = index[b];
+        index[b] = i;
+    }
+    free(presence_index);
+    presence_index = index;
+    presence_index_size = size;
+    return 0;
+}
+
+// Anota el estado del usuario para el próximo lote; reemplaza el anterior
+static void presence_record(uint32_t id, const char *username, const char *status) {
+    unsigned int h = id * 2654435761u;
+
+    pthread_mutex_lock(&presence_mutex);
+    if (presence_index) {
+        for (int i = presence_index[h & (presence_index_size - 1)]; i >= 0; i = presence[i].next) {
+            if (presence[i].id == id) {
+                snprintf(presence[i].status, sizeof(presence[i].status), "%s", status);
+                pthread_mutex_unlock(&presence_mutex);
+                return;
+            }
+        }
+    }
+
+    if (presence_count >= presence_cap) {
+        int cap = presence_cap ? presence_cap * 2 : PRESENCE_INDEX_INITIAL;
+        PresenceChange *changes = realloc(presence, cap * sizeof(PresenceChange));
+        if (!changes) {
+            pthread_mutex_unlock(&presence_mutex);
+            return;
+        }
+        presence = changes;
+        presence_cap = cap;
+    }
+    if ((unsigned int)presence_count >= presence_index_size && presence_index_grow() != 0) {
+        pthread_mutex_unlock(&presence_mutex);
+        return;
+    }
+
+    PresenceChange *c = &presence[presence_count];
+    snprintf(c->user, sizeof(c->user), "%s", username);
+    snprintf(c->status, sizeof(c->status), "%s", status);
+    c->id = id;
+    c->hash = h;
+    unsigned int b = h & (presence_index_size - 1);
+    c->next = presence_index[b];
+    presence_index[b] = presence_count++;
+    pthread_mutex_unlock(&presence_mutex);
+}
+
+// Envía los cambios acumulados en la ventana como un único status_batch
+static void presence_flush(lws_sorted_usec_list_t *sul) {
+    rx_started_ns = 0;
+    // Llevarse los cambios y dejar un lote vacío para la próxima ventana
+    pthread_mutex_lock(&presence_mutex);
+    PresenceChange *changes = presence;
+    int count = presence_count;
+    if (count) {
+        presence = NULL;
+        presence_count = presence_cap = 0;
+        memset(presence_index, 0xff, presence_index_size * sizeof(int));
+    }
+    pthread_mutex_unlock(&presence_mutex);
+
+    if (count) {
+        Outbound o = {{ NULL, NULL }};
+
+        if (format_in_use(FMT_JSON)) {
+            char timestamp[64];
+            gen_timestamp(timestamp, sizeof(timestamp));
+
+            json_t *list = json_array();
+            for (int i = 0; i < count; i++) {
+                json_t *change = json_object();
+                json_object_set_new(change, "user", json_string(changes[i].user));
+                json_object_set_new(change, "status", json_string(changes[i].status));
+                json_array_append_new(list, change);
+            }
+
+            json_t *response = json_object();
+            json_object_set_new(response, "type", json_string("status_batch"));
+            json_object_set_new(response, "sender", json_string("server"));
+            json_object_set_new(response, "content", list);
+            json_object_set_new(response, "timestamp", json_string(timestamp));
+
+            o.fmt[FMT_JSON] = outmsg_from_json(response);
+            json_decref(response);
+        }
+
+        if (format_in_use(FMT_BIN)) {
+            size_t payload = 4;
+            for (int i = 0; i < count; i++) {
+                payload += 4 + bin_str_len(strlen(changes[i].status));
+            }
+            unsigned char *p;
+            o.fmt[FMT_BIN] = bin_msg_new(BIN_S_STATUS_BATCH, payload, &p);
+            if (o.fmt[FMT_BIN]) {
+                p = bin_put_u32(p, (uint32_t)count);
+                for (int i = 0; i < count; i++) {
+                    p = bin_put_u32(p, changes[i].id);
+                    p = bin_put_str(p, changes[i].status, strlen(changes[i].status));
                 }
             }
         }
-        pthread_mutex_unlock(&user_mutex);
+
+        deliver_all(&o);
+        outbound_release(&o);
+        free(changes);
+    }
+
+    lws_sul_schedule(ws_context, 0, sul, presence_flush,
+                     (lws_usec_t)presence_batch_ms * LWS_US_PER_MS);
+}
+
+// Notifica a todos el nuevo estado de un usuario
+static void announce_status(const User *u, const char *status) {
+    if (presence_batch_ms > 0) {
+        presence_record(u->id, u->username, status);
+        return;
+    }
+
+    // Una sola codificación por formato, compartida por todos los destinatarios
+    Outbound o = {{ NULL, NULL }};
+    status_encode(u, status, &o);
+    deliver_all(&o);
+    outbound_release(&o);
+}
+
+// Notifica la salida voluntaria de un usuario
+static void announce_disconnect(uint32_t id, const char *username) {
+    if (presence_batch_ms > 0) {
+        // La salida viaja en el próximo status_batch
+        presence_record(id, username, "DESCONECTADO");
+        return;
+    }
+
+    Outbound o = {{ NULL, NULL }};
+
+    if (format_in_use(FMT_JSON)) {
+        char timestamp[64];
+        gen_timestamp(timestamp, sizeof(timestamp));
+
+        char message[256];
+        snprintf(message, sizeof(message), "%s ha salido", username);
+
+        // Armar respuesta
+        json_t *response = json_object();
+        json_object_set_new(response, "type", json_string("user_disconnected"));
+        json_object_set_new(response, "sender", json_string("server"));
+        json_object_set_new(response, "content", json_string(message));
+        json_object_set_new(response, "timestamp", json_string(timestamp));
+
+        o.fmt[FMT_JSON] = outmsg_from_json(response);
+        json_decref(response);
+    }
+
+    if (format_in_use(FMT_BIN)) {
+        unsigned char *p;
+        o.fmt[FMT_BIN] = bin_msg_new(BIN_S_USER_DISCONNECTED, 4, &p);
+        if (o.fmt[FMT_BIN]) {
+            bin_put_u32(p, id);
+        }
+    }
+
+    deliver_all(&o);
+    outbound_release(&o);
+}
+
+// Da a conocer el id de un usuario nuevo a los clientes binarios; los de
+// JSON usan el nombre y no reciben este aviso
+static void announce_join(const User *u) {
+    if (!format_in_use(FMT_BIN)) {
+        return;
+    }
+    size_t nlen = strlen(u->username);
+    unsigned char *p;
+    Outbound o = {{ NULL, NULL }};
+    o.fmt[FMT_BIN] = bin_msg_new(BIN_S_USER_JOINED, 4 + bin_str_len(nlen), &p);
+    if (o.fmt[FMT_BIN]) {
+        p = bin_put_u32(p, u->id);
+        bin_put_str(p, u->username, nlen);
+    }
+    deliver_all(&o);
+    outbound_release(&o);
+}
+
+// Cambia el estado del usuario de la sesión; devuelve 1 si cambió
+static int set_status(User *u, const char *status, const char *only_if) {
+    UserShard *sh = shard_for(u->hash);
+    int cambiado = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    if (!only_if || strcmp(u->status, only_if) == 0) {
+        snprintf(u->status, sizeof(u->status), "%s", status);
+        cambiado = 1;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return cambiado;
+}
+
+// Registra actividad: O(1), solo reinserta si la sesión no estaba en la rueda
+static void idle_touch(SessionData *s) {
+    s->idle.deadline = time(NULL) + away_secs;
+    if (s->idle.slot < 0) {
+        idle_wheel_insert(&service[s->tsi].idle_wheel, &s->idle);
+    }
+}
+
+// Plazo de inactividad vencido: cualquier estado distinto de AUSENTE pasa a AUSENTE
+static void idle_expired(IdleEntry *e) {
+    SessionData *s = lws_container_of(e, SessionData, idle);
+    if (!s->user) {
+        return;
+    }
+    UserShard *sh = shard_for(s->user->hash);
+    int cambiado = 0;
+    pthread_mutex_lock(&sh->lock);
+    if (strcmp(s->user->status, "AUSENTE") != 0) {
+        strcpy(s->user->status, "AUSENTE");
+        cambiado = 1;
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    if (cambiado) {
+        announce_status(s->user, "AUSENTE");
+        log_info("Usuario %s marcado como AUSENTE", s->user->username);
     }
+}
+
+static void idle_tick(lws_sorted_usec_list_t *sul) {
+    ServiceThread *st = lws_container_of(sul, ServiceThread, idle_sul);
+    rx_started_ns = 0;
+    idle_scan(&st->idle_wheel, time(NULL), idle_expired);
+    lws_sul_schedule(ws_context, st->tsi, sul, idle_tick, LWS_US_PER_SEC);
+}
+
+// Responde register_error solo a la conexión que intentó registrarse
+static void send_register_error(SessionData *pss, const char *motivo) {
+    if (pss->binary) {
+        size_t mlen = strlen(motivo);
+        unsigned char *p;
+        OutMsg *msg = bin_msg_new(BIN_S_REGISTER_ERROR, bin_str_len(mlen), &p);
+        if (msg) {
+            bin_put_str(p, motivo, mlen);
+        }
+        session_send(pss, msg);
+        return;
+    }
+
+    char timestamp[64];
+    gen_timestamp(timestamp, sizeof(timestamp));
+
+    json_t *response = json_object();
+    json_object_set_new(response, "type", json_string("register_error"));
+    json_object_set_new(response, "sender", json_string("server"));
+    json_object_set_new(response, "content", json_string(motivo));
+    json_object_set_new(response, "timestamp", json_string(timestamp));
+
+    session_send(pss, outmsg_from_json(response));
+
+    json_decref(response);
+}
+
+// Enlace al buzón de username en su cubeta; asume offline_mutex
+static Mailbox **mailbox_link(const char *username, unsigned int h) {
+    if (!mailboxes) {
+        return NULL;
+    }
+    Mailbox **link = &mailboxes[h & (mailbox_size - 1)];
+    while (*link && ((*link)->hash != h || strcmp((*link)->username, username) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Duplica las cubetas de los buzones; asume offline_mutex
+static int mailbox_grow(void) {
+    unsigned int size = mailbox_size ? mailbox_size * 2 : OFFLINE_BUCKETS_INITIAL;
+    Mailbox **nuevo = calloc(size, sizeof(Mailbox *));
+    if (!nuevo) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < mailbox_size; i++) {
+        Mailbox *m = mailboxes[i];
+        while (m) {
+            Mailbox *next = m->next;
+            m->next = nuevo[m->hash & (size - 1)];
+            nuevo[m->hash & (size - 1)] = m;
+            m = next;
+        }
+    }
+    free(mailboxes);
+    mailboxes = nuevo;
+    mailbox_size = size;
+    return 0;
+}
+
+// Buzón de username, que se crea si no existe; asume offline_mutex
+static Mailbox *mailbox_get(const char *username, unsigned int h) {
+    Mailbox **link = mailbox_link(username, h);
+    if (link && *link) {
+        return *link;
+    }
+
+    // Hay a lo sumo un buzón por usuario posible
+    Mailbox *m;
+    if (mailbox_count >= max_users ||
+        (mailbox_count >= (int)mailbox_size && mailbox_grow() != 0) ||
+        !(m = calloc(1, sizeof(Mailbox)))) {
+        return NULL;
+    }
+    snprintf(m->username, sizeof(m->username), "%s", username);
+    m->hash = h;
+    m->next = mailboxes[h & (mailbox_size - 1)];
+    mailboxes[h & (mailbox_size - 1)] = m;
+    mailbox_count++;
+    return m;
+}
+
+// Guarda un privado para username, que no está conectado. Devuelve -1 si su
+// buzón está lleno. Se llama con el candado del fragmento de username.
+static int offline_store(const char *username, unsigned int h, const char *from,
+                         StrView content) {
+    if (offline_max_msgs <= 0 || content.len > offline_max_bytes) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&offline_mutex);
+    Mailbox *m = mailbox_get(username, h);
+    OfflineMsg *msg = NULL;
+    if (m && m->count < offline_max_msgs && m->bytes + content.len <= offline_max_bytes) {
+        msg = malloc(sizeof(OfflineMsg) + content.len);
+    }
+    if (msg) {
+        msg->next = NULL;
+        msg->ts = time(NULL);
+        snprintf(msg->from, sizeof(msg->from), "%s", from);
+        msg->len = content.len;
+        memcpy(msg->content, content.ptr, content.len);
+        if (m->tail) {
+            m->tail->next = msg;
+        } else {
+            m->head = msg;
+        }
+        m->tail = msg;
+        m->count++;
+        m->bytes += content.len;
+    }
+    pthread_mutex_unlock(&offline_mutex);
+    return msg ? 0 : -1;
+}
+
+// Saca el buzón de username con todos sus mensajes, en orden de llegada. Se
+// llama con el candado del fragmento de username.
+static OfflineMsg *offline_take(const char *username, unsigned int h) {
+    pthread_mutex_lock(&offline_mutex);
+    Mailbox **link = mailbox_link(username, h);
+    Mailbox *m = link ? *link : NULL;
+    OfflineMsg *list = NULL;
+    if (m) {
+        *link = m->next;
+        list = m->head;
+        mailbox_count--;
+        free(m);
+    }
+    pthread_mutex_unlock(&offline_mutex);
+    return list;
+}
+
+// Devuelve al buzón los mensajes que no se llegaron a encolar antes de que
+// la sesión se cerrara. Se llama con el candado del fragmento de username.
+static void offline_putback(const char *username, unsigned int h, OfflineMsg *list) {
+    pthread_mutex_lock(&offline_mutex);
+    Mailbox *m = mailbox_get(username, h);
+    if (m) {
+        // Son anteriores a lo que haya llegado mientras tanto: van adelante
+        OfflineMsg *last = list;
+        int count = 1;
+        size_t bytes = list->len;
+        while (last->next) {
+            last = last->next;
+            count++;
+            bytes += last->len;
+        }
+        last->next = m->head;
+        if (!m->tail) {
+            m->tail = last;
+        }
+        m->head = list;
+        m->count += count;
+        m->bytes += bytes;
+        list = NULL;
+    }
+    pthread_mutex_unlock(&offline_mutex);
+
+    while (list) {
+        OfflineMsg *next = list->next;
+        free(list);
+        list = next;
+    }
+}
+
+// Saca al usuario de la sesión del directorio; solo desde el hilo dueño
+static void session_unregister(SessionData *pss) {
+    User *u = pss->user;
+    if (!u) {
+        return;
+    }
+    UserShard *sh = shard_for(u->hash);
+
+    userlist_remove(u);
+
+    pthread_mutex_lock(&sh->lock);
+    if (pss->offline) {
+        offline_putback(u->username, u->hash, pss->offline);
+        pss->offline = NULL;
+    }
+    user_release(sh, u);
+    pthread_mutex_unlock(&sh->lock);
+
+    local_remove(pss);
+    idle_wheel_remove(&service[pss->tsi].idle_wheel, &pss->idle);
+    pss->user = NULL;
+}
+
+// Agrega una entrada con el número history_next; asume history_mutex. Si el
+// contenido ocuparía más de un cuarto del anillo queda solo en el registro.
+static void history_insert(time_t ts, const char *from, const char *to,
+                           const char *content, size_t len) {
+    int en_anillo = len <= history_bytes / 4;
+    size_t start = history_head;
+    int vuelta = en_anillo && start + len > history_bytes;
+    if (vuelta) {
+        start = 0;
+    }
+
+    // Descartar las entradas cuyo contenido se pisa; al dar la vuelta, también
+    // las que quedaban al final del anillo, que son las más antiguas
+    uint64_t corte = history_first;
+    for (uint64_t seq = history_first; en_anillo && seq < history_next; seq++) {
+        HistoryEntry *old = &history[seq % history_max];
+        if (old->off == HISTORY_IN_LOG || old->len == 0) {
+            continue; // No ocupa el anillo
+        }
+        int pisada = old->off < start + len && old->off + old->len > start;
+        int saltada = vuelta && old->off >= history_head;
+        if (!pisada && !saltada) {
+            break;
+        }
+        corte = seq + 1;
+    }
+    if (history_next - corte >= (uint64_t)history_max) {
+        corte = history_next - history_max + 1;
+    }
+    history_first = corte;
+
+    HistoryEntry *e = &history[history_next % history_max];
+    e->ts = ts;
+    snprintf(e->from, sizeof(e->from), "%s", from);
+    snprintf(e->to, sizeof(e->to), "%s", to);
+    e->len = len;
+    if (en_anillo) {
+        e->off = start;
+        memcpy(&history_text[start], content, len);
+        history_head = start + len;
+    } else {
+        e->off = HISTORY_IN_LOG;
+    }
+    history_next++;
+}
+
+// Guarda un broadcast (to vacío) o un privado en el historial y, si está
+// activo, en el registro en disco con el mismo número
+static void history_record(const char *from, const char *to, StrView content) {
+    if (!history || (!log_dir && content.len > history_bytes / 4)) {
+        return;
+    }
+
+    pthread_mutex_lock(&history_mutex);
+    time_t ts = time(NULL);
+    if (!log_dir || msglog_append(ts, from, to, content.ptr, content.len) == 0) {
+        history_insert(ts, from, to, content.ptr, content.len);
+    }
+    pthread_mutex_unlock(&history_mutex);
+}
+
+// Entrada seq del anillo o, si ya salió de él, del registro en disco; tmp
+// guarda la copia en ese caso. NULL si no está. Asume history_mutex
+static const HistoryEntry *history_entry(uint64_t seq, HistoryEntry *tmp,
+                                         const char **content) {
+    LogRecord rec;
+    if (seq >= history_first) {
+        const HistoryEntry *e = &history[seq % history_max];
+        if (e->off != HISTORY_IN_LOG) {
+            *content = &history_text[e->off];
+            return e;
+        }
+        if (msglog_get(seq, &rec) != 0) {
+            return NULL;
+        }
+        *content = rec.content;
+        return e;
+    }
+
+    if (!log_dir || msglog_get(seq, &rec) != 0) {
+        return NULL;
+    }
+    tmp->ts = rec.ts;
+    snprintf(tmp->from, sizeof(tmp->from), "%.*s", (int)rec.from_len, rec.from);
+    snprintf(tmp->to, sizeof(tmp->to), "%.*s", (int)rec.to_len, rec.to);
+    tmp->off = HISTORY_IN_LOG;
+    tmp->len = rec.content_len;
+    *content = rec.content;
+    return tmp;
+}
+
+// Los broadcasts los ve cualquiera; los privados, el emisor y el destino
+static int history_visible(const HistoryEntry *e, const char *username) {
+    return !e->to[0] || strcmp(e->from, username) == 0 || strcmp(e->to, username) == 0;
+}
+
+// Frame de un mensaje guardado, del historial o de un buzón (offline), con su
+// hora original
+static OutMsg *stored_msg(const HistoryEntry *e, const char *content, int fmt, int offline) {
+    if (fmt == FMT_BIN) {
+        StrView v = { content, e->len, 1 };
+        char *plain = malloc(e->len + 1);
+        if (!plain) {
+            return NULL;
+        }
+        size_t clen = strview_copy(v, plain, e->len + 1);
+        size_t flen = strlen(e->from);
+        size_t tlen = strlen(e->to);
+
+        unsigned char *p;
+        OutMsg *msg = bin_msg_new(offline ? BIN_S_OFFLINE : BIN_S_HISTORY,
+                                  bin_str_len(flen) + bin_str_len(tlen) + bin_str_len(clen), &p);
+        if (msg) {
+            bin_put_u32(&msg->data[LWS_PRE + 1], (uint32_t)e->ts);
+            p = bin_put_str(p, e->from, flen);
+            p = bin_put_str(p, e->to, tlen);
+            bin_put_str(p, plain, clen);
+        }
+        free(plain);
+        return msg;
+    }
+
+    char timestamp[64];
+    struct tm t;
+    gmtime_r(&e->ts, &t);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &t);
+
+    const char *marca = offline ? "offline" : "replay";
+    if (!e->to[0]) {
+        return outmsg_printf(
+            "{\"type\":\"broadcast\",\"sender\":\"%s\",\"content\":\"%.*s\","
+            "\"timestamp\":\"%s\",\"%s\":true}",
+            e->from, (int)e->len, content, timestamp, marca);
+    }
+    return outmsg_printf(
+        "{\"type\":\"private\",\"sender\":\"%s\",\"target\":\"%s\","
+        "\"content\":\"%.*s\",\"timestamp\":\"%s\",\"%s\":true}",
+        e->from, e->to, (int)e->len, content, timestamp, marca);
+}
+
+// Encola el siguiente lote del historial pendiente de la sesión. Se llama al
+// registrarse y cada vez que la cola se vacía, así el reenvío avanza al ritmo
+// del cliente sin ocupar el hilo ni el directorio.
+static void history_replay_step(SessionData *pss) {
+    if (!history || !pss->user || pss->replay_seq >= pss->replay_end) {
+        return;
+    }
+
+    OutMsg *lote[HISTORY_REPLAY_BATCH];
+    int n = 0;
+    int revisadas = 0;
+
+    pthread_mutex_lock(&history_mutex);
+    // Sin registro en disco, lo que el anillo ya descartó no se puede reenviar
+    if (!log_dir && pss->replay_seq < history_first) {
+        pss->replay_seq = history_first;
+    }
+    while (n < HISTORY_REPLAY_BATCH && revisadas < HISTORY_REPLAY_SCAN &&
+           pss->replay_seq < pss->replay_end) {
+        HistoryEntry tmp;
+        const char *content;
+        const HistoryEntry *e = history_entry(pss->replay_seq++, &tmp, &content);
+        revisadas++;
+        if (e && history_visible(e, pss->user->username)) {
+            lote[n++] = stored_msg(e, content, pss->binary, 0);
+        }
+    }
+    pthread_mutex_unlock(&history_mutex);
+
+    for (int i = 0; i < n; i++) {
+        session_send(pss, lote[i]);
+    }
+    // Nada visible en este tramo: pedir otro turno para seguir buscando
+    if (n == 0 && pss->replay_seq < pss->replay_end) {
+        lws_callback_on_writable(pss->wsi);
+    }
+}
+
+// Marca para reenviar los últimos history_replay mensajes que puede ver el
+// usuario recién registrado. Los posteriores le llegan por el camino normal.
+static void history_replay_start(SessionData *pss) {
+    if (!history || history_replay <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&history_mutex);
+    uint64_t seq = history_next;
+    int vistos = 0;
+    while (seq > history_first && vistos < history_replay) {
+        seq--;
+        if (history_visible(&history[seq % history_max], pss->user->username)) {
+            vistos++;
+        }
+    }
+    pss->replay_seq = seq;
+    pss->replay_end = history_next;
+    pthread_mutex_unlock(&history_mutex);
+
+    history_replay_step(pss);
+}
+
+// Reenvía los mensajes visibles desde la hora ts hasta ahora. Con registro en
+// disco se busca en su índice; si no, solo alcanza lo que sigue en el anillo.
+static void history_replay_since(SessionData *pss, time_t ts) {
+    pthread_mutex_lock(&history_mutex);
+    uint64_t seq;
+    if (log_dir) {
+        seq = msglog_seq_at(ts);
+    } else {
+        seq = history_first;
+        while (seq < history_next && history[seq % history_max].ts < ts) {
+            seq++;
+        }
+    }
+    pss->replay_seq = seq;
+    pss->replay_end = history_next;
+    pthread_mutex_unlock(&history_mutex);
+
+    history_replay_step(pss);
+}
+
+// Encola el siguiente lote del buzón que recibió la sesión al registrarse.
+// Como el historial, avanza cada vez que la cola de salida se vacía.
+static void offline_step(SessionData *pss) {
+    for (int n = 0; pss->offline && n < HISTORY_REPLAY_BATCH; n++) {
+        OfflineMsg *m = pss->offline;
+        HistoryEntry e;
+        e.ts = m->ts;
+        memcpy(e.from, m->from, sizeof(e.from));
+        memcpy(e.to, pss->user->username, sizeof(e.to));
+        e.off = HISTORY_IN_LOG;
+        e.len = m->len;
+        session_send(pss, stored_msg(&e, m->content, pss->binary, 1));
+        pss->offline = m->next;
+        free(m);
+    }
+}
+
+// Avisa al emisor de un privado que quedó en el buzón de target (ok) o que
+// no cupo. target ya se validó como nombre de usuario.
+static void send_queued_ack(SessionData *pss, const char *target, int ok) {
+    if (pss->binary) {
+        size_t tlen = strlen(target);
+        unsigned char *p;
+        OutMsg *msg = bin_msg_new(BIN_S_QUEUED, bin_str_len(tlen) + 1, &p);
+        if (msg) {
+            p = bin_put_str(p, target, tlen);
+            bin_put_u8(p, ok);
+        }
+        session_send(pss, msg);
+        return;
+    }
+
+    char timestamp[64];
+    gen_timestamp(timestamp, sizeof(timestamp));
+    session_send(pss, outmsg_printf(
+        "{\"type\":\"%s\",\"sender\":\"server\",\"target\":\"%s\",\"content\":\"%s\","
+        "\"timestamp\":\"%s\"}",
+        ok ? "queued" : "queue_full", target,
+        ok ? "Se entregará cuando se conecte" : "Buzón lleno", timestamp));
+}
+
+// Llena el anillo con los últimos mensajes del registro en disco. Se leen
+// los segmentos mapeados a partir del índice, sin recorrer todo el archivo.
+static void history_restore(void) {
+    uint64_t next = msglog_next_seq();
+    uint64_t first = msglog_first_seq();
+    if (next - first > (uint64_t)history_max) {
+        first = next - history_max;
+    }
+
+    history_first = history_next = first;
+    for (uint64_t seq = first; seq < next; seq++) {
+        LogRecord rec;
+        char from[32], to[32];
+        if (msglog_get(seq, &rec) != 0) {
+            history_first = history_next = next;
+            break;
+        }
+        snprintf(from, sizeof(from), "%.*s", (int)rec.from_len, rec.from);
+        snprintf(to, sizeof(to), "%.*s", (int)rec.to_len, rec.to);
+        history_insert(rec.ts, from, to, rec.content, rec.content_len);
+    }
+}
+
+static RoomShard *room_shard_for(unsigned int h) {
+    return &room_shards[h & (ROOM_SHARDS - 1)];
+}
+
+// Enlace a la sala name en su cubeta; asume el candado del fragmento
+static Room **room_link(RoomShard *sh, const char *name, unsigned int h) {
+    if (!sh->hash) {
+        return NULL;
+    }
+    Room **link = &sh->hash[(h >> 4) & (sh->hash_size - 1)];
+    while (*link && ((*link)->hash != h || strcmp((*link)->name, name) != 0)) {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+static int room_hash_grow(RoomShard *sh) {
+    unsigned int size = sh->hash_size ? sh->hash_size * 2 : ROOM_HASH_INITIAL;
+    Room **nuevo = calloc(size, sizeof(Room *));
+    if (!nuevo) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < sh->hash_size; i++) {
+        Room *r = sh->hash[i];
+        while (r) {
+            Room *next = r->hash_next;
+            unsigned int b = (r->hash >> 4) & (size - 1);
+            r->hash_next = nuevo[b];
+            nuevo[b] = r;
+            r = next;
+        }
+    }
+    free(sh->hash);
+    sh->hash = nuevo;
+    sh->hash_size = size;
+    return 0;
+}
+
+// Quita a s de la sala y la libera si queda vacía; asume el candado
+static void room_remove_member(RoomShard *sh, Room *r, SessionData *s) {
+    for (int i = 0; i < r->count; i++) {
+        if (r->members[i] == s) {
+            r->members[i] = r->members[--r->count];
+            r->formats[s->binary]--;
+            break;
+        }
+    }
+    if (r->count == 0) {
+        Room **link = room_link(sh, r->name, r->hash);
+        *link = r->hash_next;
+        sh->count--;
+        free(r->members);
+        free(r);
+    }
+}
+
+// Une la sesión a la sala name, creándola si hace falta. Devuelve NULL si
+// lo logró o el motivo del rechazo.
+static const char *room_join(SessionData *pss, const char *name) {
+    if (!username_ok(name) || strlen(name) >= sizeof(((Room *)0)->name)) {
+        return "Nombre de sala inválido";
+    }
+    if (pss->room_count >= MAX_ROOMS_PER_SESSION) {
+        return "Demasiadas salas";
+    }
+    if (!pss->rooms && !(pss->rooms = calloc(MAX_ROOMS_PER_SESSION, sizeof(Room *)))) {
+        return "Sin memoria";
+    }
+
+    unsigned int h = hash_username(name);
+    RoomShard *sh = room_shard_for(h);
+    const char *motivo = NULL;
+
+    pthread_mutex_lock(&sh->lock);
+    Room **link = room_link(sh, name, h);
+    Room *r = link ? *link : NULL;
+    if (!r) {
+        if ((sh->count >= (int)sh->hash_size && room_hash_grow(sh) != 0) ||
+            !(r = calloc(1, sizeof(Room)))) {
+            pthread_mutex_unlock(&sh->lock);
+            return "Sin memoria";
+        }
+        snprintf(r->name, sizeof(r->name), "%s", name);
+        r->hash = h;
+        unsigned int b = (h >> 4) & (sh->hash_size - 1);
+        r->hash_next = sh->hash[b];
+        sh->hash[b] = r;
+        sh->count++;
+    }
+
+    for (int i = 0; i < pss->room_count; i++) {
+        if (pss->rooms[i] == r) {
+            motivo = "Ya está en la sala";
+        }
+    }
+    if (!motivo && r->count == r->cap) {
+        int cap = r->cap ? r->cap * 2 : 4;
+        SessionData **nuevo = realloc(r->members, cap * sizeof(SessionData *));
+        if (nuevo) {
+            r->members = nuevo;
+            r->cap = cap;
+        } else {
+            motivo = "Sin memoria";
+        }
+    }
+    if (!motivo) {
+        r->members[r->count++] = pss;
+        r->formats[pss->binary]++;
+        pss->rooms[pss->room_count++] = r;
+    } else if (r->count == 0) {
+        room_remove_member(sh, r, pss);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return motivo;
+}
+
+// Saca la sesión de la sala name; devuelve NULL si estaba en ella
+static const char *room_leave(SessionData *pss, const char *name) {
+    unsigned int h = hash_username(name);
+    RoomShard *sh = room_shard_for(h);
+
+    pthread_mutex_lock(&sh->lock);
+    Room **link = room_link(sh, name, h);
+    Room *r = link ? *link : NULL;
+    int i = 0;
+    while (r && i < pss->room_count && pss->rooms[i] != r) {
+        i++;
+    }
+    if (!r || i == pss->room_count) {
+        pthread_mutex_unlock(&sh->lock);
+        return "No está en la sala";
+    }
+    pss->rooms[i] = pss->rooms[--pss->room_count];
+    room_remove_member(sh, r, pss);
+    pthread_mutex_unlock(&sh->lock);
     return NULL;
 }
 
+// Al cerrarse la conexión: después de esto ningún mensaje de sala la alcanza
+static void rooms_leave_all(SessionData *pss) {
+    while (pss->room_count > 0) {
+        Room *r = pss->rooms[--pss->room_count];
+        RoomShard *sh = room_shard_for(r->hash);
+        pthread_mutex_lock(&sh->lock);
+        room_remove_member(sh, r, pss);
+        pthread_mutex_unlock(&sh->lock);
+    }
+    free(pss->rooms);
+    pss->rooms = NULL;
+}
+
+// Respuesta a join_room o leave_room: "ok" o el motivo del rechazo
+static void send_room_response(SessionData *pss, const char *room, int join,
+                               const char *motivo, StrView id) {
+    const char *texto = motivo ? motivo : "ok";
+    if (pss->binary) {
+        size_t rlen = strlen(room);
+        size_t tlen = strlen(texto);
+        unsigned char *p;
+        OutMsg *msg = bin_msg_new(BIN_S_ROOM_RESPONSE,
+                                  bin_str_len(rlen) + 1 + bin_str_len(tlen), &p);
+        if (msg) {
+            p = bin_put_str(p, room, rlen);
+            p = bin_put_u8(p, join);
+            bin_put_str(p, texto, tlen);
+        }
+        session_send(pss, outmsg_with_id(msg, id));
+        return;
+    }
+
+    char timestamp[64];
+    gen_timestamp(timestamp, sizeof(timestamp));
+    json_t *response = json_object();
+    json_object_set_new(response, "type", json_string(join ? "join_room_response" : "leave_room_response"));
+    json_object_set_new(response, "sender", json_string("server"));
+    json_object_set_new(response, "target", json_string(room));
+    json_object_set_new(response, "content", json_string(texto));
+    json_object_set_new(response, "timestamp", json_string(timestamp));
+    session_send(pss, outmsg_with_id(outmsg_from_json(response), id));
+    json_decref(response);
+}
+
+// Envía un mensaje a los miembros de la sala name. Cada formato se codifica
+// una vez; para los miembros de otros hilos se hace una copia por hilo y no
+// por miembro. Devuelve -1 si el emisor no está en la sala.
+static int room_send(SessionData *pss, const char *name, StrView content) {
+    unsigned int h = hash_username(name);
+    RoomShard *sh = room_shard_for(h);
+    User *self = pss->user;
+
+    pthread_mutex_lock(&sh->lock);
+    Room **link = room_link(sh, name, h);
+    Room *r = link ? *link : NULL;
+    int miembro = 0;
+    for (int i = 0; r && i < pss->room_count; i++) {
+        miembro |= pss->rooms[i] == r;
+    }
+    if (!miembro) {
+        pthread_mutex_unlock(&sh->lock);
+        return -1;
+    }
+
+    Outbound o = {{ NULL, NULL }};
+    if (r->formats[FMT_JSON] > 0) {
+        char timestamp[64];
+        gen_timestamp(timestamp, sizeof(timestamp));
+        o.fmt[FMT_JSON] = outmsg_printf(
+            "{\"type\":\"room_message\",\"sender\":\"%s\",\"target\":\"%s\","
+            "\"content\":\"%.*s\",\"timestamp\":\"%s\"}",
+            self->username, r->name, (int)content.len, content.ptr, timestamp);
+    }
+    if (r->formats[FMT_BIN] > 0) {
+        char *owned;
+        size_t clen;
+        const char *text = strview_plain(content, &clen, &owned);
+        size_t rlen = strlen(r->name);
+        unsigned char *p;
+        o.fmt[FMT_BIN] = bin_msg_new(BIN_S_ROOM_MESSAGE,
+                                     4 + bin_str_len(rlen) + bin_str_len(clen), &p);
+        if (o.fmt[FMT_BIN]) {
+            p = bin_put_u32(p, self->id);
+            p = bin_put_str(p, r->name, rlen);
+            bin_put_str(p, text, clen);
+        }
+        free(owned);
+    }
+
+    int64_t inicio = now_ns();
+    Outbound por_hilo[MAX_SERVICE_THREADS];
+    struct lws *despertar[MAX_SERVICE_THREADS];
+    memset(despertar, 0, sizeof(despertar));
+    for (int i = 0; i < r->count; i++) {
+        SessionData *s = r->members[i];
+        if (s->tsi == current_tsi) {
+            queue_push(s, o.fmt[s->binary]);
+            continue;
+        }
+        if (!despertar[s->tsi]) {
+            for (int f = 0; f < 2; f++) {
+                por_hilo[s->tsi].fmt[f] = o.fmt[f] ? outmsg_for_thread(o.fmt[f], s->tsi) : NULL;
+            }
+            despertar[s->tsi] = s->wsi;
+        }
+        // La sesión no puede cerrarse mientras el candado de la sala esté tomado
+        mail_post(&service[s->tsi], &por_hilo[s->tsi], s);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    for (int t = 0; t < service_count; t++) {
+        if (despertar[t]) {
+            lws_cancel_service_pt(despertar[t]);
+            outbound_release(&por_hilo[t]);
+        }
+    }
+    histogram_observe(&thread_metrics()->fanout, now_ns() - inicio);
+    outbound_release(&o);
+    return 0;
+}
+
+// Atiende un mensaje ya reconocido; devuelve -1 si hay que cerrar la conexión.
+// Los campos llegan escapados como en JSON: se copian sin escapes para buscar
+// nombres y se reenvían tal cual dentro de los frames de salida.
+static int dispatch_frame(struct lws *wsi, SessionData *pss, const ChatFrame *f) {
+    User *self = pss->user;
+
+    size_t tipo = 0;
+    while (tipo < METRIC_TYPES - 1 && !strview_eq(f->type, metric_types[tipo])) {
+        tipo++;
+    }
+    metric_add(&thread_metrics()->received[tipo], 1);
+
+    if (self) {
+        self->last_activity = time(NULL);
+        idle_touch(pss);
+
+        // Si estaba ausente, cambiar a ACTIVO y notificar
+        if (set_status(self, "ACTIVO", "AUSENTE")) {
+            announce_status(self, "ACTIVO");
+            log_info("Usuario %s volvió a ACTIVO", self->username);
+        }
+    }
+
+    // Extraer tipo y usuario emisor
+    if (!f->type.ptr || !f->sender.ptr) {
+        log_warn("Mensaje sin 'type' o 'sender'");
+        return 0;
+    }
+
+    char sender[256];
+    strview_copy(f->sender, sender, sizeof(sender));
+
+    if (strview_eq(f->type, "register")) {
+        unsigned int h = hash_username(sender);
+        UserShard *sh = shard_for(h);
+        User *nuevo = NULL;
+        OfflineMsg *pendientes = NULL;
+        const char *motivo = NULL;
+
+        // Un nombre que no cabe se rechaza: truncado podría chocar con otro
+        if (strlen(sender) >= sizeof(((User *)0)->username)) {
+            send_register_error(pss, "Nombre de usuario demasiado largo");
+            log_info("Registro rechazado: nombre de %zu bytes", strlen(sender));
+            return 0;
+        }
+
+        pthread_mutex_lock(&sh->lock);
+        // El directorio exige nombres únicos: rechazar duplicados
+        if (pss->user || directory_find(sh, sender, h)) {
+            motivo = "Nombre de usuario en uso";
+        } else if (!username_ok(sender)) {
+            motivo = "Nombre de usuario inválido";
+        } else if (!(nuevo = user_alloc())) {
+            motivo = "Servidor lleno";
+        } else {
+            snprintf(nuevo->username, sizeof(nuevo->username), "%s", sender);
+            nuevo->hash = h;
+            nuevo->id = atomic_fetch_add(&next_user_id, 1);
+            nuevo->wsi = wsi;
+            nuevo->session = pss;
+            strcpy(nuevo->status, "ACTIVO");
+
+            char client_ip[128];  // Buffer para almacenar la IP
+            if (lws_get_peer_simple(wsi, client_ip, sizeof(client_ip))) {
+                snprintf(nuevo->ip, sizeof(nuevo->ip), "%s", client_ip);
+            } else {
+                strcpy(nuevo->ip, "Desconocido");
+            }
+
+            nuevo->active = 1;
+            nuevo->last_activity = time(NULL);
+
+            if (directory_insert(sh, nuevo) != 0) {
+                user_free(nuevo);
+                nuevo = NULL;
+                motivo = "Servidor lleno";
+            } else {
+                // Con el candado tomado ningún privado nuevo va a su buzón
+                pendientes = offline_take(nuevo->username, nuevo->hash);
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+
+        if (!nuevo) {
+            send_register_error(pss, motivo);
+            log_info("Registro rechazado para %s: %s", sender, motivo);
+            return 0;
+        }
+
+        pss->user = nuevo;
+        pss->offline = pendientes;
+        local_insert(pss);
+        idle_touch(pss);
+        userlist_add(nuevo);
+
+        // Respuesta con la lista de usuarios conectados, ya serializada. En
+        // binario el id propio va aparte porque la lista es compartida.
+        if (pss->binary) {
+            unsigned char *p;
+            OutMsg *ok = bin_msg_new(BIN_S_REGISTER_SUCCESS, 4, &p);
+            if (ok) {
+                bin_put_u32(p, nuevo->id);
+            }
+            session_send(pss, ok);
+        }
+        session_send(pss, userlist_response(&service[pss->tsi].list_cache, 1, pss->binary));
+        announce_join(nuevo);
+        if (pendientes) {
+            log_info("Entregando mensajes guardados para %s", nuevo->username);
+        }
+        offline_step(pss);
+        history_replay_start(pss);
+
+    } else if (strview_eq(f->type, "broadcast")) {
+        if (!f->content.ptr) {
+            log_warn("Mensaje 'broadcast' inválido: falta 'content'");
+            return 0;
+        }
+        // El emisor es el usuario registrado en la conexión
+        if (!self) {
+            log_warn("Broadcast de %s sin registrarse, ignorado", sender);
+            return 0;
+        }
+
+        // Reenviar a todos los usuarios activos
+        // Se codifica una vez por formato y se comparte
+        Outbound o = {{ NULL, NULL }};
+        broadcast_encode(self, f->content, &o);
+        deliver_all(&o);
+        outbound_release(&o);
+        history_record(self->username, "", f->content);
+        log_sampled(LOGGER_INFO, "Broadcast enviado por %s: %.*s", sender,
+               (int)f->content.len, f->content.ptr);
+
+    } else if (strview_eq(f->type, "private")) {
+        if (!f->target.ptr || !f->content.ptr) {
+            log_warn("Mensaje 'private' inválido");
+            return 0;
+        }
+
+        if (!self) {
+            log_warn("Mensaje privado de %s sin registrarse, ignorado", sender);
+            return 0;
+        }
+
+        char target[256];
+        strview_copy(f->target, target, sizeof(target));
+
+        // Buscar al usuario destino en su fragmento y entregar en su formato
+        unsigned int h = hash_username(target);
+        UserShard *sh = shard_for(h);
+        Outbound o = {{ NULL, NULL }};
+
+        int buzon = 0;
+        int guardado = -1;
+        pthread_mutex_lock(&sh->lock);
+        User *dest = directory_find(sh, target, h);
+        if (!dest && offline_max_msgs > 0 && username_ok(target) &&
+            strlen(target) < sizeof(self->username)) {
+            // No está conectado: queda en su buzón hasta que se registre
+            buzon = 1;
+            guardado = offline_store(target, h, self->username, f->content);
+        } else if (dest) {
+            if (dest->session->binary) {
+                o.fmt[FMT_BIN] = bin_chat_msg(self, dest, f->content);
+            } else {
+                char timestamp[64];
+                gen_timestamp(timestamp, sizeof(timestamp));
+
+                o.fmt[FMT_JSON] = outmsg_printf(
+                    "{\"type\":\"private\",\"sender\":\"%s\",\"target\":\"%s\","
+                    "\"content\":\"%.*s\",\"timestamp\":\"%s\"}",
+                    self->username, dest->username,
+                    (int)f->content.len, f->content.ptr, timestamp);
+            }
+            deliver_to(dest->session, &o);
+        }
+        pthread_mutex_unlock(&sh->lock);
+        outbound_release(&o);
+
+        if (dest) {
+            history_record(self->username, target, f->content);
+            log_sampled(LOGGER_INFO, "Mensaje privado de %s a %s: %.*s", sender, target,
+                   (int)f->content.len, f->content.ptr);
+        } else if (buzon) {
+            send_queued_ack(pss, target, guardado == 0);
+            log_info("Mensaje privado de %s para %s %s", sender, target,
+                   guardado == 0 ? "guardado en su buzón" : "descartado: buzón lleno");
+        } else {
+            log_info("Usuario destino '%s' no encontrado o no conectado", target);
+        }
+
+    } else if (strview_eq(f->type, "history")) {
+        // Mensajes desde una hora dada, en el formato de los timestamps
+        char desde[64];
+        struct tm t;
+        memset(&t, 0, sizeof(t));
+        strview_copy(f->content, desde, sizeof(desde));
+        const char *fin = f->content.ptr ? strptime(desde, "%Y-%m-%dT%H:%M:%SZ", &t) : NULL;
+        if (!self || !history || !fin || *fin) {
+            log_warn("Solicitud de historial inválida de %s", sender);
+            return 0;
+        }
+        history_replay_since(pss, timegm(&t));
+        log_info("Historial desde %s enviado a %s", desde, sender);
+
+    } else if (strview_eq(f->type, "join_room") || strview_eq(f->type, "leave_room")) {
+        // La sala va en 'target'
+        int join = strview_eq(f->type, "join_room");
+        if (!self || !f->target.ptr) {
+            log_warn("Solicitud de sala inválida de %s", sender);
+            return 0;
+        }
+        char room[256];
+        strview_copy(f->target, room, sizeof(room));
+
+        const char *motivo = join ? room_join(pss, room) : room_leave(pss, room);
+        if (!username_ok(room) || strlen(room) >= sizeof(self->username)) {
+            // No se devuelve un nombre que habría que escapar
+            snprintf(room, sizeof(room), "?");
+        }
+        send_room_response(pss, room, join, motivo, f->id);
+        log_info("%s %s la sala %s%s%s", sender, join ? "se une a" : "deja", room,
+               motivo ? ": " : "", motivo ? motivo : "");
+
+    } else if (strview_eq(f->type, "room_message")) {
+        if (!self || !f->target.ptr || !f->content.ptr) {
+            log_warn("Mensaje 'room_message' inválido");
+            return 0;
+        }
+        char room[256];
+        strview_copy(f->target, room, sizeof(room));
+
+        if (room_send(pss, room, f->content) != 0) {
+            log_info("%s no está en la sala %s, mensaje descartado", sender, room);
+        } else {
+            log_sampled(LOGGER_INFO, "Mensaje de %s en la sala %s: %.*s", sender, room,
+                   (int)f->content.len, f->content.ptr);
+        }
+
+    } else if (strview_eq(f->type, "list_users")) {
+        // Mismos bytes para todos los que piden la lista sin cambios; con
+        // "id" se copian para agregarlo
+        OutMsg *lista = userlist_response(&service[pss->tsi].list_cache, 0, pss->binary);
+        session_send(pss, outmsg_with_id(lista, f->id));
+
+        log_sampled(LOGGER_INFO, "Lista de usuarios enviada a %s", sender);
+
+    } else if (strview_eq(f->type, "user_info")) {
+        if (!f->target.ptr) {
+            log_warn("Mensaje 'user_info' inválido: falta 'target'");
+            return 0;
+        }
+
+        char target[256];
+        strview_copy(f->target, target, sizeof(target));
+
+        // Copiar los datos del usuario y soltar el candado antes de serializar
+        char ip[64];
+        char status[16];
+        uint32_t info_id = 0;
+        unsigned int h = hash_username(target);
+        UserShard *sh = shard_for(h);
+
+        pthread_mutex_lock(&sh->lock);
+        User *info_user = directory_find(sh, target, h);
+        if (info_user) {
+            memcpy(ip, info_user->ip, sizeof(ip));
+            memcpy(status, info_user->status, sizeof(status));
+            info_id = info_user->id;
+        }
+        pthread_mutex_unlock(&sh->lock);
+
+        // Si no existe se responde igual (id 0 en binario, content null en
+        // JSON) para que el cliente no quede esperando
+        if (!info_user) {
+            ip[0] = status[0] = '\0';
+        }
+        if (pss->binary) {
+            size_t ilen = strlen(ip);
+            size_t slen = strlen(status);
+            unsigned char *p;
+            OutMsg *msg = bin_msg_new(BIN_S_USER_INFO,
+                                      4 + bin_str_len(ilen) + bin_str_len(slen), &p);
+            if (msg) {
+                p = bin_put_u32(p, info_id);
+                p = bin_put_str(p, ip, ilen);
+                bin_put_str(p, status, slen);
+            }
+            session_send(pss, outmsg_with_id(msg, f->id));
+        } else {
+            char timestamp[64];
+            gen_timestamp(timestamp, sizeof(timestamp));
+
+            // Construir contenido del mensaje
+            json_t *info = json_null();
+            if (info_user) {
+                info = json_object();
+                json_object_set_new(info, "ip", json_string(ip));
+                json_object_set_new(info, "status", json_string(status));
+            }
+
+            json_t *response = json_object();
+            json_object_set_new(response, "type", json_string("user_info_response"));
+            json_object_set_new(response, "sender", json_string("server"));
+            json_object_set_new(response, "target", json_string(target));
+            json_object_set_new(response, "content", info);
+            json_object_set_new(response, "timestamp", json_string(timestamp));
+
+            // Serializar a string
+            session_send(pss, outmsg_with_id(outmsg_from_json(response), f->id));
+
+            json_decref(response);
+        }
+
+        if (info_user) {
+            log_sampled(LOGGER_INFO, "Info enviada sobre %s", target);
+        } else {
+            log_info("Usuario '%s' no encontrado", target);
+        }
 
+    } else if (strview_eq(f->type, "change_status")) {
+        if (!f->content.ptr) {
+            log_warn("Mensaje 'change_status' inválido: falta 'content'");
+            return 0;
+        }
 
-static int callback_chat(struct lws *wsi, enum lws_callback_reasons reason,
-                         void *user, void *in, size_t len) {
+        char new_status[16];
+        strview_copy(f->content, new_status, sizeof(new_status));
 
-    switch (reason) {
+        // El cambio aplica al usuario registrado en esta conexión
+        if (self) {
+            set_status(self, new_status, NULL);
+            announce_status(self, new_status);
+            log_info("Estado de %s cambiado a %s", self->username, new_status);
+        } else {
+            log_warn("Usuario %s no encontrado para actualizar estado", sender);
+        }
+    } else if (strview_eq(f->type, "disconnect")) {
+        if (self) {
+            char name[32];
+            snprintf(name, sizeof(name), "%s", self->username);
+            uint32_t id = self->id;
+
+            session_unregister(pss);
+            announce_disconnect(id, name);
+
+            log_info("Usuario %s se desconectó voluntariamente", sender);
+        } else {
+            log_warn("Usuario %s no encontrado para desconexión", sender);
+        }
 
-    case LWS_CALLBACK_ESTABLISHED: {
-        printf("Cliente conectado\n");
-        break;
+        lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, (unsigned char *)"Bye", 3);
+        return -1;
     }
+    return 0;
+}
 
-    case LWS_CALLBACK_RECEIVE: {
-        // Copiamos el mensaje recibido a un buffer null-terminated
-        char msg[2048];
-        memset(msg, 0, sizeof(msg));
-        if (len >= sizeof(msg)) len = sizeof(msg) - 1; // prevenir overflow
-        memcpy(msg, in, len);
-        msg[len] = '\0';
-
-        printf("Mensaje recibido (%zu bytes): %s\n", len, msg);
+// Vista sobre el valor de key si es una cadena, reescapada por jansson
+static char *json_field_view(json_t *root, const char *key, StrView *v) {
+    json_t *value = json_object_get(root, key);
+    if (!json_is_string(value)) {
+        return NULL;
+    }
+    char *text = json_dumps(value, JSON_ENCODE_ANY);
+    if (text) {
+        v->ptr = text + 1; // Sin las comillas
+        v->len = strlen(text) - 2;
+        v->escaped = 1;
+    }
+    return text;
+}
 
-        // Intentar parsear el mensaje como JSON
-        json_error_t error;
-        json_t *root = json_loads(msg, 0, &error);
+// Vista sobre "id" si es una cadena o un entero, serializado por jansson en
+// *owned. -1 si pasa de REQUEST_ID_MAX_LEN: no se podría devolver
+static int json_id_view(json_t *root, StrView *v, char **owned) {
+    *owned = NULL;
+    json_t *value = json_object_get(root, "id");
+    if (!json_is_string(value) && !json_is_integer(value)) {
+        return 0;
+    }
+    char *text = json_dumps(value, JSON_ENCODE_ANY);
+    if (!text) {
+        return 0;
+    }
+    size_t len = strlen(text);
+    if (len > REQUEST_ID_MAX_LEN) {
+        free(text);
+        return -1;
+    }
+    v->ptr = text;
+    v->len = len;
+    v->escaped = 0;
+    *owned = text;
+    return 0;
+}
 
-        if (!root) {
-            printf("Error al parsear JSON: %s\n", error.text);
-            break;
-        }
+// Solicitud que no se atiende porque su respuesta no podría llevar el id;
+// se contesta sin id para que el cliente no la espere indefinidamente
+static void send_request_error(SessionData *pss, const char *motivo) {
+    char timestamp[64];
+    gen_timestamp(timestamp, sizeof(timestamp));
 
-        pthread_mutex_lock(&user_mutex);
-        for (int i = 0; i < MAX_USERS; i++) {
-            if (users[i].active && users[i].wsi == wsi) {
-                users[i].last_activity = time(NULL);
+    json_t *response = json_object();
+    json_object_set_new(response, "type", json_string("request_error"));
+    json_object_set_new(response, "sender", json_string("server"));
+    json_object_set_new(response, "content", json_string(motivo));
+    json_object_set_new(response, "timestamp", json_string(timestamp));
 
-                // Si estaba ausente, cambiar a ACTIVO y notificar
-                if (strcmp(users[i].status, "AUSENTE") == 0) {
-                    strcpy(users[i].status, "ACTIVO");
+    session_send(pss, outmsg_from_json(response));
 
-                    char timestamp[64];
-                    gen_timestamp(timestamp, sizeof(timestamp));
+    json_decref(response);
+}
 
-                    json_t *status_obj = json_object();
-                    json_object_set_new(status_obj, "user", json_string(users[i].username));
-                    json_object_set_new(status_obj, "status", json_string("ACTIVO"));
+// Cadena de un mensaje binario escapada como JSON, para que dispatch_frame
+// trate igual a los dos protocolos
+static char *bin_field_view(BinReader *r, StrView *v) {
+    size_t len;
+    const char *s = bin_get_str(r, &len);
+    if (r->err || !utf8_valid(s, len)) {
+        r->err = 1;
+        return NULL;
+    }
+    char *escaped = malloc(json_escaped_len(s, len) + 1);
+    if (!escaped) {
+        r->err = 1;
+        return NULL;
+    }
+    v->ptr = escaped;
+    v->len = json_escape(s, len, escaped);
+    v->escaped = 1;
+    return escaped;
+}
 
-                    json_t *response = json_object();
-                    json_object_set_new(response, "type", json_string("status_update"));
-                    json_object_set_new(response, "sender", json_string("server"));
-                    json_object_set_new(response, "content", status_obj);
-                    json_object_set_new(response, "timestamp", json_string(timestamp));
+// Decodifica un mensaje de chat-protocol-bin al mismo ChatFrame que el JSON
+static int handle_binary(struct lws *wsi, SessionData *pss, const char *in, size_t len) {
+    static const char *tipos[] = {
+        NULL, "register", "broadcast", "private", "list_users",
+        "user_info", "change_status", "disconnect", "history",
+        "join_room", "leave_room", "room_message"
+    };
+    BinReader r = { (const unsigned char *)in, (const unsigned char *)in + len, 0 };
+    ChatFrame f;
+    char *owned[3] = { NULL, NULL, NULL };
+    memset(&f, 0, sizeof(f));
+
+    unsigned int type = bin_get_u8(&r);
+    if (r.err || type == 0 || type >= sizeof(tipos) / sizeof(tipos[0])) {
+        log_warn("Mensaje binario de tipo desconocido");
+        return 0;
+    }
+    f.type.ptr = tipos[type];
+    f.type.len = strlen(tipos[type]);
+
+    // El emisor es la conexión; solo el registro trae un nombre
+    if (type == BIN_REGISTER) {
+        owned[0] = bin_field_view(&r, &f.sender);
+    } else {
+        f.sender.ptr = pss->user ? pss->user->username : "";
+        f.sender.len = strlen(f.sender.ptr);
+    }
+    if (type == BIN_PRIVATE || type == BIN_USER_INFO || type == BIN_JOIN_ROOM ||
+        type == BIN_LEAVE_ROOM || type == BIN_ROOM_MESSAGE) {
+        owned[1] = bin_field_view(&r, &f.target);
+    }
+    if (type == BIN_BROADCAST || type == BIN_PRIVATE || type == BIN_CHANGE_STATUS ||
+        type == BIN_HISTORY || type == BIN_ROOM_MESSAGE) {
+        owned[2] = bin_field_view(&r, &f.content);
+    }
 
-                    char *response_str = json_dumps(response, JSON_COMPACT);
+    // Id opcional al final de la solicitud; se guarda en decimal como en JSON
+    char id_text[24];
+    if (!r.err && r.p != r.end) {
+        size_t id = bin_get_varint(&r);
+        f.id.ptr = id_text;
+        f.id.len = (size_t)snprintf(id_text, sizeof(id_text), "%zu", id);
+    }
 
-                    for (int j = 0; j < MAX_USERS; j++) {
-                        if (users[j].active && users[j].wsi) {
-                            unsigned char buf[LWS_PRE + 1024];
-                            unsigned char *p = &buf[LWS_PRE];
-                            size_t n = strlen(response_str);
-                            memcpy(p, response_str, n);
-                            lws_write(users[j].wsi, p, n, LWS_WRITE_TEXT);
-                        }
-                    }
+    int rc = 0;
+    if (r.err || r.p != r.end) {
+        log_warn("Mensaje binario inválido");
+    } else {
+        rc = dispatch_frame(wsi, pss, &f);
+    }
+    for (int i = 0; i < 3; i++) {
+        free(owned[i]);
+    }
+    return rc;
+}
 
-                    printf("Usuario %s volvió a ACTIVO\n", users[i].username);
+// Reconoce el mensaje sin copiarlo con frame_parse; solo los frames con otra
+// forma pasan por jansson, que además da el detalle del error.
+static int handle_message(struct lws *wsi, SessionData *pss, const char *in, size_t len) {
+    if (pss->binary) {
+        return handle_binary(wsi, pss, in, len);
+    }
 
-                    free(response_str);
-                    json_decref(response);
-                }
+    ChatFrame f;
+    if (frame_parse(in, len, &f) == 0) {
+        return dispatch_frame(wsi, pss, &f);
+    }
 
-                break;
-            }
-        }
-        pthread_mutex_unlock(&user_mutex);
+    json_error_t error;
+    json_t *root = json_loadb(in, len, 0, &error);
+    if (!root) {
+        log_warn("Error al parsear JSON: %s", error.text);
+        return 0;
+    }
 
+    memset(&f, 0, sizeof(f));
+    char *owned[5];
+    owned[0] = json_field_view(root, "type", &f.type);
+    owned[1] = json_field_view(root, "sender", &f.sender);
+    owned[2] = json_field_view(root, "target", &f.target);
+    owned[3] = json_field_view(root, "content", &f.content);
+    int id_ok = json_id_view(root, &f.id, &owned[4]) == 0;
+    json_decref(root);
+
+    int rc = 0;
+    if (id_ok) {
+        rc = dispatch_frame(wsi, pss, &f);
+    } else {
+        log_warn("'id' de más de %d bytes, solicitud rechazada", REQUEST_ID_MAX_LEN);
+        send_request_error(pss, "id demasiado largo");
+    }
+    for (int i = 0; i < 5; i++) {
+        free(owned[i]);
+    }
+    return rc;
+}
 
+// Agranda el búfer de reensamblado de la sesión al doble hasta cubrir need
+static int rx_reserve(SessionData *pss, size_t need) {
+    if (need <= pss->rx_cap) {
+        return 0;
+    }
+    size_t cap = pss->rx_cap ? pss->rx_cap : 1024;
+    while (cap < need) {
+        cap *= 2;
+    }
+    char *buf = realloc(pss->rx_buf, cap);
+    if (!buf) {
+        return -1;
+    }
+    pss->rx_buf = buf;
+    pss->rx_cap = cap;
+    return 0;
+}
 
-        // Extraer tipo y usuario emisor
-        const char *type = json_string_value(json_object_get(root, "type"));
-        const char *sender = json_string_value(json_object_get(root, "sender"));
+// Mensaje escrito completo: bytes de salida y latencia desde su recepción
+static void metric_sent(const OutMsg *msg) {
+    ThreadMetrics *m = thread_metrics();
+    metric_add(&m->bytes_out, msg->len);
+    metric_add(&m->frames_out, 1);
+    if (msg->rx_ns) {
+        histogram_observe(&m->latency, now_ns() - msg->rx_ns);
+    }
+}
 
-        if (!type || !sender) {
-            printf("Mensaje sin 'type' o 'sender'\n");
-            json_decref(root);
-            break;
+static void metrics_histogram(FILE *f, const char *name, const char *help,
+                              const Histogram *h) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t acumulado = 0;
+    for (int b = 0; b <= METRICS_BUCKETS; b++) {
+        acumulado += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        if (b < METRICS_BUCKETS) {
+            fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name, metric_bounds_ns[b] / 1e9,
+                    (unsigned long long)acumulado);
+        } else {
+            fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)acumulado);
         }
+    }
+    fprintf(f, "%s_sum %.9f\n%s_count %llu\n", name,
+            atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e9,
+            name, (unsigned long long)acumulado);
+}
 
-        if (strcmp(type, "register") == 0) {
-            pthread_mutex_lock(&user_mutex);
-            for (int i = 0; i < MAX_USERS; i++) {
-                if (!users[i].active) {
-                    strcpy(users[i].username, sender);
-                    users[i].wsi = wsi;
-                    strcpy(users[i].status, "ACTIVO");
-
-                    char rip[64];
-                    char name[128];
-
-                    char client_ip[128];  // Buffer para almacenar la IP
-                    lws_get_peer_simple(wsi, client_ip, sizeof(client_ip));
-
-                    if (client_ip) {
-                        strncpy(users[i].ip, client_ip, sizeof(users[i].ip) - 1);
-                        users[i].ip[sizeof(users[i].ip) - 1] = '\0'; // Asegurar terminación
-                    } else {
-                        strcpy(users[i].ip, "Desconocido");
-                    }
-
-                    users[i].active = 1;
-                    users[i].last_activity = time(NULL);
-
-                    // Crear respuesta JSON simple
-                    char timestamp[64];
-                    gen_timestamp(timestamp, sizeof(timestamp));
-
-                    // Crear arreglo de usuarios conectados
-                    json_t *user_list = json_array();
-                    for (int j = 0; j < MAX_USERS; j++) {
-                        if (users[j].active) {
-                            json_array_append_new(user_list, json_string(users[j].username));
-                        }
-                    }
-
-                    // Crear objeto de respuesta
-                    json_t *response = json_object();
-                    json_object_set_new(response, "type", json_string("register_success"));
-                    json_object_set_new(response, "sender", json_string("server"));
-                    json_object_set_new(response, "content", json_string("Registro exitoso"));
-                    json_object_set_new(response, "userList", user_list);
-                    json_object_set_new(response, "timestamp", json_string(timestamp));
-
-                    // Serializar a string
-                    char *response_str = json_dumps(response, JSON_COMPACT);
-
-                    // Enviar mensaje
-                    unsigned char buf[LWS_PRE + 1024];
-                    unsigned char *p = &buf[LWS_PRE];
-                    size_t n = strlen(response_str);
-                    memcpy(p, response_str, n);
-                    lws_write(wsi, p, n, LWS_WRITE_TEXT);
-
-                    // Liberar memoria
-                    free(response_str);
-                    json_decref(response);
-
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&user_mutex);
-
-        } else if (strcmp(type, "broadcast") == 0 ) {
-            const char *content = json_string_value(json_object_get(root, "content"));
-            char timestamp[64];
-            gen_timestamp(timestamp, sizeof(timestamp));
-
-            
+// Acumula c en total, que es local a metrics_render
+static void metric_sum(_Atomic uint64_t *total, const _Atomic uint64_t *c) {
+    atomic_store_explicit(total,
+                          atomic_load_explicit(total, memory_order_relaxed) +
+                          atomic_load_explicit(c, memory_order_relaxed),
+                          memory_order_relaxed);
+}
 
-            if (!content) {
-                printf("Mensaje 'broadcast' inválido: falta 'content'\n");
-                break;
-            }
-            // Reenviar a todos los usuarios activos
-            pthread_mutex_lock(&user_mutex);
-            for (int i = 0; i < MAX_USERS; i++) {
-                if (users[i].active && users[i].wsi) {
-
-                    char response[512];
-                    snprintf(response, sizeof(response),
-                        "{\"type\":\"broadcast\",\"sender\":\"%s\","
-                        "\"content\":\"%s\",\"timestamp\":\"%s\"}",
-                        sender, content, timestamp);
-
-                    unsigned char buf[LWS_PRE + 512];
-                    unsigned char *p = &buf[LWS_PRE];
-                    size_t n = strlen(response);
-                    memcpy(p, response, n);
-                    lws_write(users[i].wsi, p, n, LWS_WRITE_TEXT);
-                }
-            }
-            pthread_mutex_unlock(&user_mutex);
-            printf("Broadcast enviado por %s: %s\n", sender, content);
+static void histogram_sum(Histogram *total, const Histogram *h) {
+    for (int b = 0; b <= METRICS_BUCKETS; b++) {
+        metric_sum(&total->buckets[b], &h->buckets[b]);
+    }
+    metric_sum(&total->sum_ns, &h->sum_ns);
+}
 
-        } else if (strcmp(type, "private")==0) {
+static void metrics_value(FILE *f, const char *name, const char *type, const char *help,
+                          const _Atomic uint64_t *value) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name,
+            (unsigned long long)atomic_load_explicit(value, memory_order_relaxed));
+}
 
-            const char *target = json_string_value(json_object_get(root, "target"));
-            const char *content = json_string_value(json_object_get(root, "content"));
+// Texto de /metrics en el formato de Prometheus, con LWS_PRE libre al inicio.
+// Suma las métricas de todos los hilos sin detenerlos.
+static char *metrics_render(size_t *len) {
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&buf, &size);
+    if (!f) {
+        return NULL;
+    }
+    static const char pre[LWS_PRE];
+    fwrite(pre, 1, LWS_PRE, f);
+
+    ThreadMetrics total;
+    memset(&total, 0, sizeof(total));
+    for (int t = 0; t < service_count; t++) {
+        const ThreadMetrics *m = &service[t].metrics;
+        for (size_t i = 0; i < METRIC_TYPES; i++) {
+            metric_sum(&total.received[i], &m->received[i]);
+        }
+        metric_sum(&total.bytes_in, &m->bytes_in);
+        metric_sum(&total.bytes_out, &m->bytes_out);
+        metric_sum(&total.frames_out, &m->frames_out);
+        metric_sum(&total.queue_msgs, &m->queue_msgs);
+        metric_sum(&total.queue_bytes, &m->queue_bytes);
+        metric_sum(&total.dropped, &m->dropped);
+        metric_sum(&total.overflow_closes, &m->overflow_closes);
+        histogram_sum(&total.latency, &m->latency);
+        histogram_sum(&total.fanout, &m->fanout);
+    }
 
-            if (!target || !content) {
-                printf("Mensaje 'private' inválido\n");
-                break;
-            }
+    fprintf(f, "# HELP chat_messages_received_total Mensajes de clientes por tipo\n"
+               "# TYPE chat_messages_received_total counter\n");
+    for (size_t i = 0; i < METRIC_TYPES; i++) {
+        fprintf(f, "chat_messages_received_total{type=\"%s\"} %llu\n", metric_types[i],
+                (unsigned long long)atomic_load_explicit(&total.received[i], memory_order_relaxed));
+    }
 
-            // Buscar al usuario destino
-            pthread_mutex_lock(&user_mutex);
-            int encontrado = 0;
-            for (int i = 0; i < MAX_USERS; i++) {
-                if (users[i].active && strcmp(users[i].username, target) == 0) {
-                    char response[512];
-                    char timestamp[64];
-                    gen_timestamp(timestamp, sizeof(timestamp));
-
-                    snprintf(response, sizeof(response),
-                        "{\"type\":\"private\",\"sender\":\"%s\",\"target\":\"%s\","  
-                        "\"content\":\"%s\",\"timestamp\":\"%s\"}",
-                        sender, target, content, timestamp);
-
-                    unsigned char buf[LWS_PRE + 512];
-                    unsigned char *p = &buf[LWS_PRE];
-                    size_t n = strlen(response);
-                    memcpy(p, response, n);
-                    lws_write(users[i].wsi, p, n, LWS_WRITE_TEXT);
-
-                    encontrado = 1;
-                    printf("Mensaje privado de %s a %s: %s\n", sender, target, content);
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&user_mutex);
+    int usuarios = user_total();
+    fprintf(f, "# HELP chat_sessions Conexiones WebSocket abiertas por subprotocolo\n"
+               "# TYPE chat_sessions gauge\n"
+               "chat_sessions{protocol=\"chat-protocol\"} %d\n"
+               "chat_sessions{protocol=\"%s\"} %d\n"
+               "# HELP chat_users_registered Usuarios registrados\n"
+               "# TYPE chat_users_registered gauge\n"
+               "chat_users_registered %d\n",
+            atomic_load(&format_sessions[FMT_JSON]), BIN_PROTOCOL,
+            atomic_load(&format_sessions[FMT_BIN]), usuarios);
+
+    metrics_value(f, "chat_received_bytes_total", "counter",
+                  "Bytes de mensajes recibidos", &total.bytes_in);
+    metrics_value(f, "chat_sent_bytes_total", "counter",
+                  "Bytes de mensajes enviados", &total.bytes_out);
+    metrics_value(f, "chat_sent_messages_total", "counter",
+                  "Mensajes enviados completos", &total.frames_out);
+    metrics_value(f, "chat_queue_messages", "gauge",
+                  "Mensajes en las colas de salida", &total.queue_msgs);
+    metrics_value(f, "chat_queue_bytes", "gauge",
+                  "Bytes en las colas de salida", &total.queue_bytes);
+    metrics_value(f, "chat_queue_dropped_total", "counter",
+                  "Mensajes descartados por cola llena", &total.dropped);
+    metrics_value(f, "chat_queue_overflow_closes_total", "counter",
+                  "Conexiones cerradas por cola llena", &total.overflow_closes);
+    metrics_histogram(f, "chat_delivery_latency_seconds",
+                      "Desde la recepción de un mensaje hasta el envío de lo que generó",
+                      &total.latency);
+    metrics_histogram(f, "chat_fanout_seconds",
+                      "Encolar un mensaje a todos sus destinatarios", &total.fanout);
+
+    if (fclose(f) != 0) {
+        free(buf);
+        return NULL;
+    }
+    *len = size - LWS_PRE;
+    return buf;
+}
 
-            if (!encontrado) {
-                printf("Usuario destino '%s' no encontrado o no conectado\n", target);
-            }
+// Respuesta HTTP de /metrics en curso
+typedef struct {
+    char *body; // Con LWS_PRE al inicio
+    size_t len;
+    size_t off;
+} MetricsRequest;
+
+// Atiende GET /metrics (montado sobre el mismo puerto que el chat)
+static int callback_metrics(struct lws *wsi, enum lws_callback_reasons reason,
+                            void *user, void *in, size_t len) {
+    MetricsRequest *req = (MetricsRequest *)user;
+    (void)in;
+    (void)len;
 
-        } else if (strcmp(type, "list_users") == 0) {
-            char timestamp[64];
-            gen_timestamp(timestamp, sizeof(timestamp));
+    switch (reason) {
 
-            // Crear un arreglo JSON
-            json_t *user_list = json_array();
+    case LWS_CALLBACK_HTTP: {
+        unsigned char headers[LWS_PRE + 512];
+        unsigned char *start = &headers[LWS_PRE];
+        unsigned char *p = start;
+        unsigned char *end = &headers[sizeof(headers) - 1];
+
+        free(req->body);
+        req->off = 0;
+        req->body = metrics_render(&req->len);
+        if (!req->body) {
+            return 1;
+        }
+        if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, "text/plain; version=0.0.4",
+                                        (long long)req->len, &p, end) ||
+            lws_finalize_write_http_header(wsi, start, &p, end)) {
+            return 1;
+        }
+        lws_callback_on_writable(wsi);
+        break;
+    }
 
-            pthread_mutex_lock(&user_mutex);
-            for (int i = 0; i < MAX_USERS; i++) {
-                if (users[i].active) {
-                    json_array_append_new(user_list, json_string(users[i].username));
-                }
-            }
-            pthread_mutex_unlock(&user_mutex);
+    case LWS_CALLBACK_HTTP_WRITEABLE: {
+        if (!req->body) {
+            break;
+        }
+        // Lo que ya se envió sirve de LWS_PRE para el siguiente trozo
+        size_t n = req->len - req->off;
+        if (n > OUT_CHUNK_SIZE) {
+            n = OUT_CHUNK_SIZE;
+        }
+        int final = req->off + n == req->len;
+        if (lws_write(wsi, (unsigned char *)&req->body[LWS_PRE + req->off], n,
+                      final ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) != (int)n) {
+            return 1;
+        }
+        req->off += n;
+        if (!final) {
+            lws_callback_on_writable(wsi);
+            break;
+        }
+        free(req->body);
+        req->body = NULL;
+        if (lws_http_transaction_completed(wsi)) {
+            return -1;
+        }
+        break;
+    }
 
-            // Armar la respuesta
-            json_t *response = json_object();
-            json_object_set_new(response, "type", json_string("list_users_response"));
-            json_object_set_new(response, "sender", json_string("server"));
-            json_object_set_new(response, "content", user_list);
-            json_object_set_new(response, "timestamp", json_string(timestamp));
+    case LWS_CALLBACK_CLOSED_HTTP:
+        free(req->body);
+        req->body = NULL;
+        break;
 
-            // Convertir JSON a string
-            char *response_str = json_dumps(response, JSON_COMPACT);
+    default:
+        break;
+    }
 
-            unsigned char buf[LWS_PRE + 1024];
-            unsigned char *p = &buf[LWS_PRE];
-            size_t n = strlen(response_str);
-            memcpy(p, response_str, n);
-            lws_write(wsi, p, n, LWS_WRITE_TEXT);
+    return 0;
+}
 
-            printf("Lista de usuarios enviada a %s\n", sender);
+static int callback_chat(struct lws *wsi, enum lws_callback_reasons reason,
+                         void *user, void *in, size_t len) {
 
-            free(response_str);
-            json_decref(response);
+    SessionData *pss = (SessionData *)user;
+    // Lo que se encole al atender este mensaje mide su latencia desde aquí
+    rx_started_ns = reason == LWS_CALLBACK_RECEIVE ? now_ns() : 0;
 
-        } else if (strcmp(type, "user_info") == 0) {
-            const char *target = json_string_value(json_object_get(root, "target"));
+    switch (reason) {
 
-            if (!target) {
-                printf("Mensaje 'user_info' inválido: falta 'target'\n");
-                break;
-            }
+    case LWS_CALLBACK_ESTABLISHED: {
+        memset(pss, 0, sizeof(*pss));
+        pss->wsi = wsi;
+        pss->tsi = lws_get_tsi(wsi);
+        pss->idle.slot = -1;
+        pss->binary = strcmp(lws_get_protocol(wsi)->name, BIN_PROTOCOL) == 0 ? FMT_BIN : FMT_JSON;
+        pss->queue = calloc(queue_max_msgs, sizeof(OutMsg *));
+        if (!pss->queue) {
+            return -1;
+        }
+        atomic_fetch_add(&format_sessions[pss->binary], 1);
+        if (deflate_enabled) {
+            // Falla sin más si el cliente no negoció la extensión
+            char valor[8];
+            snprintf(valor, sizeof(valor), "%d", deflate_window_bits);
+            lws_set_extension_option(wsi, "permessage-deflate", "server_max_window_bits", valor);
+            snprintf(valor, sizeof(valor), "%d", deflate_level);
+            lws_set_extension_option(wsi, "permessage-deflate", "compression_level", valor);
+        }
+        log_info("Cliente conectado (%s)", pss->binary ? BIN_PROTOCOL : "chat-protocol");
+        break;
+    }
 
-            int encontrado = 0;
-
-            pthread_mutex_lock(&user_mutex);
-            for (int i = 0; i < MAX_USERS; i++) {
-                if (users[i].active && strcmp(users[i].username, target) == 0) {
-                    char timestamp[64];
-                    gen_timestamp(timestamp, sizeof(timestamp));
-        
-                    // Construir contenido del mensaje
-                    json_t *info = json_object();
-                    json_object_set_new(info, "ip", json_string(users[i].ip));
-                    json_object_set_new(info, "status", json_string(users[i].status));
-        
-                    json_t *response = json_object();
-                    json_object_set_new(response, "type", json_string("user_info_response"));
-                    json_object_set_new(response, "sender", json_string("server"));
-                    json_object_set_new(response, "target", json_string(target));
-                    json_object_set_new(response, "content", info);
-                    json_object_set_new(response, "timestamp", json_string(timestamp));
-        
-                    // Serializar a string
-                    char *response_str = json_dumps(response, JSON_COMPACT);
-        
-                    unsigned char buf[LWS_PRE + 1024];
-                    unsigned char *p = &buf[LWS_PRE];
-                    size_t n = strlen(response_str);
-                    memcpy(p, response_str, n);
-                    lws_write(wsi, p, n, LWS_WRITE_TEXT);
-        
-                    printf("Info enviada sobre %s\n", target);
-        
-                    free(response_str);
-                    json_decref(response);
-        
-                    encontrado = 1;
-                    break;
+    case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+        // Otros hilos dejaron entregas en el buzón de este hilo
+        ServiceThread *st = &service[current_tsi];
+
+        pthread_mutex_lock(&st->mail_lock);
+        Mail *m = st->mail_head;
+        st->mail_head = st->mail_tail = NULL;
+        pthread_mutex_unlock(&st->mail_lock);
+
+        while (m) {
+            Mail *next = m->next;
+            if (m->target) {
+                queue_push(m->target, m->out.fmt[m->target->binary]);
+            } else {
+                for (SessionData *s = st->local; s; s = s->local_next) {
+                    queue_push(s, m->out.fmt[s->binary]);
                 }
             }
+            outbound_release(&m->out);
+            free(m);
+            m = next;
+        }
+        break;
+    }
 
-            pthread_mutex_unlock(&user_mutex);
-            if (!encontrado) {
-                printf("Usuario '%s' no encontrado\n", target);
+    case LWS_CALLBACK_SERVER_WRITEABLE: {
+        // Un mensaje por llamada; si quedan más se pide otro turno
+        if (pss->overflow) {
+            metric_add(&thread_metrics()->overflow_closes, 1);
+            log_warn("Cola de salida llena, desconectando cliente lento");
+            lws_close_reason(wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION,
+                             (unsigned char *)"Cola llena", 10);
+            return -1;
+        }
 
+        OutMsg *msg = pss->tx_msg;
+        if (!msg) {
+            msg = queue_pop(pss);
+            if (!msg) {
+                break;
             }
-        
-        } else if (strcmp(type, "change_status") == 0) {
-            const char *new_status = json_string_value(json_object_get(root, "content"));
+            pss->tx_off = 0;
+        }
 
-            if (!new_status) {
-                printf("Mensaje 'change_status' inválido: falta 'content'\n");
-                break;
+        if (!pss->tx_msg && msg->len <= OUT_CHUNK_SIZE) {
+            // lws escribe la cabecera del frame en el LWS_PRE compartido; es la
+            // misma para todos los destinatarios y solo la escribe este hilo
+            int n = lws_write(wsi, &msg->data[LWS_PRE], msg->len,
+                              msg->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+            int completo = n >= (int)msg->len;
+            if (completo) {
+                metric_sent(msg);
             }
-        
-            int actualizado = 0;
-
-            pthread_mutex_lock(&user_mutex);
-            for (int i = 0; i < MAX_USERS; i++) {
-                if (users[i].active && strcmp(users[i].username, sender) == 0) {
-                    strcpy(users[i].status, new_status);
-                    actualizado = 1;
-        
-                    char timestamp[64];
-                    gen_timestamp(timestamp, sizeof(timestamp));
-        
-                    // Contenido del mensaje
-                    json_t *status_obj = json_object();
-                    json_object_set_new(status_obj, "user", json_string(sender));
-                    json_object_set_new(status_obj, "status", json_string(new_status));
-        
-                    // Mensaje completo
-                    json_t *response = json_object();
-                    json_object_set_new(response, "type", json_string("status_update"));
-                    json_object_set_new(response, "sender", json_string("server"));
-                    json_object_set_new(response, "content", status_obj);
-                    json_object_set_new(response, "timestamp", json_string(timestamp));
-        
-                    char *response_str = json_dumps(response, JSON_COMPACT);
-        
-                    // Enviar a todos los usuarios conectados
-                    for (int j = 0; j < MAX_USERS; j++) {
-                        if (users[j].active && users[j].wsi) {
-                            unsigned char buf[LWS_PRE + 1024];
-                            unsigned char *p = &buf[LWS_PRE];
-                            size_t n = strlen(response_str);
-                            memcpy(p, response_str, n);
-                            lws_write(users[j].wsi, p, n, LWS_WRITE_TEXT);
-                        }
-                    }
-        
-                    printf("Estado de %s cambiado a %s\n", sender, new_status);
-        
-                    free(response_str);
-                    json_decref(response);
-                    break;
-                }
+            outmsg_unref(msg);
+            if (!completo) {
+                return -1;
             }
-            pthread_mutex_unlock(&user_mutex);
-        
-            if (!actualizado) {
-                printf("Usuario %s no encontrado para actualizar estado\n", sender);
+        } else {
+            // Mensaje grande: un fragmento por turno para no acaparar el hilo.
+            // Cada trozo se copia junto a un LWS_PRE propio del hilo.
+            unsigned char *scratch = service[pss->tsi].tx_scratch;
+            size_t n = msg->len - pss->tx_off;
+            if (n > OUT_CHUNK_SIZE) {
+                n = OUT_CHUNK_SIZE;
+            }
+            int flags = lws_write_ws_flags(msg->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT,
+                                           pss->tx_off == 0,
+                                           pss->tx_off + n == msg->len);
+            memcpy(&scratch[LWS_PRE], &msg->data[LWS_PRE + pss->tx_off], n);
+
+            pss->tx_msg = NULL;
+            if (lws_write(wsi, &scratch[LWS_PRE], n, flags) < (int)n) {
+                outmsg_unref(msg);
+                return -1;
+            }
+            pss->tx_off += n;
+            if (pss->tx_off < msg->len) {
+                pss->tx_msg = msg;
+            } else {
+                metric_sent(msg);
+                outmsg_unref(msg);
+            }
+        }
 
+        // Con la cola vacía siguen el buzón y el reenvío del historial, si faltan
+        if (!pss->tx_msg && !pss->q_count) {
+            if (pss->offline) {
+                offline_step(pss);
+            } else {
+                history_replay_step(pss);
             }
-        } else if (strcmp(type, "disconnect") == 0) {
-            int encontrado = 0;
-        
-            pthread_mutex_lock(&user_mutex);
-            for (int i = 0; i< MAX_USERS; i++) {
-                if (users[i].active && strcmp(users[i].username, sender) == 0 ){
-                    users[i].active = 0;
-                    users[i].wsi = NULL;
-        
-                    char timestamp[64];
-                    gen_timestamp(timestamp, sizeof(timestamp));
-        
-                    char message[256];
-                    snprintf(message, sizeof(message), "%s ha salido", sender);
-        
-                    // Armar respuesta
-                    json_t *response = json_object();
-                    json_object_set_new(response, "type", json_string("user_disconnected"));
-                    json_object_set_new(response, "sender", json_string("server"));
-                    json_object_set_new(response, "content", json_string(message));
-                    json_object_set_new(response, "timestamp", json_string(timestamp));
-        
-                    char *response_str = json_dumps(response, JSON_COMPACT);
-        
-                    // Enviar a todos los usuarios conectados
-                    for (int j = 0; j < MAX_USERS; j++) {
-                        if (users[j].active && users[j].wsi) {
-                            unsigned char buf[LWS_PRE + 512];
-                            unsigned char *p = &buf[LWS_PRE];
-                            size_t n = strlen(response_str);
-                            memcpy(p, response_str, n);
-                            lws_write(users[j].wsi, p, n, LWS_WRITE_TEXT);
-                        }
-                    }
-        
-                    printf("Usuario %s se desconectó voluntariamente\n", sender);
-        
-                    free(response_str);
-                    json_decref(response);
-                    encontrado = 1;
-                    break;
-                }
+        }
+        if (pss->tx_msg || pss->q_count) {
+            lws_callback_on_writable(wsi);
+        }
+        break;
+    }
+
+    case LWS_CALLBACK_RECEIVE: {
+        int final = lws_is_final_fragment(wsi);
+        metric_add(&thread_metrics()->bytes_in, len);
+
+        if (pss->rx_len + len > max_msg) {
+            log_warn("Mensaje de más de %zu bytes, desconectando cliente", max_msg);
+            lws_close_reason(wsi, LWS_CLOSE_STATUS_MESSAGE_TOO_LARGE,
+                             (unsigned char *)"Mensaje muy grande", 18);
+            return -1;
+        }
+
+        // Mensaje completo en un solo trozo: se reconoce sin copiarlo
+        if (!pss->rx_len && final) {
+            if (pss->binary) {
+                log_sampled(LOGGER_DEBUG, "Mensaje binario recibido (%zu bytes)", len);
+            } else {
+                log_sampled(LOGGER_DEBUG, "Mensaje recibido (%zu bytes): %.*s", len, (int)len, (const char *)in);
             }
-            pthread_mutex_unlock(&user_mutex);
-        
-            if (!encontrado) {
-                printf("Usuario %s no encontrado para desconexión\n", sender);
+            if (handle_message(wsi, pss, (const char *)in, len) != 0) {
+                return -1;
             }
-        
-            lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, (unsigned char *)"Bye", 3);
+            break;
+        }
+
+        // Fragmentos de un mensaje más grande: acumular hasta el último
+        if (rx_reserve(pss, pss->rx_len + len) != 0) {
+            return -1;
+        }
+        memcpy(&pss->rx_buf[pss->rx_len], in, len);
+        pss->rx_len += len;
+        if (!final) {
+            break;
+        }
+
+        size_t total = pss->rx_len;
+        pss->rx_len = 0;
+        log_sampled(LOGGER_DEBUG, "Mensaje recibido (%zu bytes, reensamblado)", total);
+        int rc = handle_message(wsi, pss, pss->rx_buf, total);
+
+        // No retener búferes grandes por un mensaje aislado
+        if (pss->rx_cap > RX_KEEP_BYTES) {
+            free(pss->rx_buf);
+            pss->rx_buf = NULL;
+            pss->rx_cap = 0;
+        }
+        if (rc != 0) {
             return -1;
         }
-        json_decref(root);
         break;
     }
 
     case LWS_CALLBACK_CLOSED: {
-        pthread_mutex_lock(&user_mutex);
-        for (int i = 0; i < MAX_USERS; i++) {
-            if (users[i].wsi == wsi) {
-                printf("Usuario %s se desconectó\n", users[i].username);
-                users[i].active = 0;
-                break;
+        rooms_leave_all(pss);
+        if (pss->user) {
+            log_info("Usuario %s se desconectó", pss->user->username);
+            // Tras salir del directorio ningún otro hilo puede encontrar la sesión
+            session_unregister(pss);
+        }
+        idle_wheel_remove(&service[pss->tsi].idle_wheel, &pss->idle);
+
+        // Descartar entregas de otros hilos que aún apunten a esta sesión
+        ServiceThread *st = &service[pss->tsi];
+        pthread_mutex_lock(&st->mail_lock);
+        Mail **pp = &st->mail_head;
+        Mail *last = NULL;
+        while (*pp) {
+            Mail *m = *pp;
+            if (m->target == pss) {
+                *pp = m->next;
+                outbound_release(&m->out);
+                free(m);
+            } else {
+                last = m;
+                pp = &m->next;
+            }
+        }
+        st->mail_tail = last;
+        pthread_mutex_unlock(&st->mail_lock);
+
+        outmsg_unref(pss->tx_msg);
+        pss->tx_msg = NULL;
+        free(pss->rx_buf);
+        pss->rx_buf = NULL;
+
+        if (pss->queue) {
+            OutMsg *msg;
+            while ((msg = queue_pop(pss))) {
+                outmsg_unref(msg);
             }
+            free(pss->queue);
+            pss->queue = NULL;
+            atomic_fetch_sub(&format_sessions[pss->binary], 1);
+        }
+
+        if (pss->dropped) {
+            log_warn("Se descartaron %lu mensajes por cola llena", pss->dropped);
         }
-        pthread_mutex_unlock(&user_mutex);
         break;
     }
 
@@ -529,18 +2442,55 @@ static struct lws_protocols protocols[] = {
     {
         .name = "chat-protocol",
         .callback = callback_chat,
-        .per_session_data_size = 0,
+        .per_session_data_size = sizeof(SessionData),
+        .rx_buffer_size = 0,
+    },
+    {
+        .name = BIN_PROTOCOL,
+        .callback = callback_chat,
+        .per_session_data_size = sizeof(SessionData),
+        .rx_buffer_size = 0,
+    },
+    {
+        .name = "metrics",
+        .callback = callback_metrics,
+        .per_session_data_size = sizeof(MetricsRequest),
         .rx_buffer_size = 0,
     },
     { NULL, NULL, 0, 0 }
 };
 
+// GET /metrics lo atiende el protocolo "metrics"; el resto sigue igual
+static const struct lws_http_mount metrics_mount = {
+    .mountpoint = "/metrics",
+    .mountpoint_len = 8,
+    .origin = "metrics",
+    .origin_protocol = LWSMPRO_CALLBACK,
+};
+
+// Hilos de servicio adicionales: cada uno atiende sus propias conexiones
+static void *service_loop(void *arg) {
+    ServiceThread *st = (ServiceThread *)arg;
+    current_tsi = st->tsi;
+    while (1)
+        lws_service_tsi(ws_context, 1000, st->tsi);
+    return NULL;
+}
+
 int main(int argc, char *argv[]) {
     struct lws_context_creation_info info;
     memset(&info, 0, sizeof(info));
 
-    if (argc != 2) {
-        printf("Uso: %s <puerto>\n", argv[0]);
+    if (argc < 2) {
+        printf("Uso: %s <puerto> [--max-users N] [--queue-max-msgs N] "
+               "[--queue-max-bytes N] [--queue-policy drop|disconnect] "
+               "[--away-secs N] [--threads N] [--presence-batch-ms N] "
+               "[--max-msg N] [--deflate] [--deflate-window-bits 9-15] "
+               "[--deflate-level 1-9] [--history-msgs N] [--history-bytes N] "
+               "[--history-replay N] [--log-dir DIR] [--log-segment-mb N] "
+               "[--log-commit-ms N] [--offline-max-msgs N] [--offline-max-bytes N] "
+               "[--log-level error|warn|info|debug] [--log-sample N]\n",
+               argv[0]);
         return 1;
     }
 
@@ -550,23 +2500,273 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    printf("Servidor iniciado en el puerto: %d\n", puerto);
+    const char *opt = lws_cmdline_option(argc, (const char **)argv, "--max-users");
+    if (opt) {
+        max_users = atoi(opt);
+        if (max_users <= 0) {
+            printf("Error: --max-users debe ser mayor que 0.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--queue-max-msgs");
+    if (opt) {
+        queue_max_msgs = atoi(opt);
+        if (queue_max_msgs <= 0) {
+            printf("Error: --queue-max-msgs debe ser mayor que 0.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--queue-max-bytes");
+    if (opt) {
+        long bytes = atol(opt);
+        if (bytes <= 0) {
+            printf("Error: --queue-max-bytes debe ser mayor que 0.\n");
+            return 1;
+        }
+        queue_max_bytes = (size_t)bytes;
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--queue-policy");
+    if (opt) {
+        if (strcmp(opt, "disconnect") == 0) {
+            queue_disconnect = 1;
+        } else if (strcmp(opt, "drop") != 0) {
+            printf("Error: --queue-policy debe ser 'drop' o 'disconnect'.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--away-secs");
+    if (opt) {
+        away_secs = atoi(opt);
+        if (away_secs <= 0) {
+            printf("Error: --away-secs debe ser mayor que 0.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--threads");
+    if (opt) {
+        service_count = atoi(opt);
+        if (service_count <= 0 || service_count > MAX_SERVICE_THREADS) {
+            printf("Error: --threads debe estar entre 1 y %d.\n", MAX_SERVICE_THREADS);
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--max-msg");
+    if (opt) {
+        long bytes = atol(opt);
+        if (bytes <= 0) {
+            printf("Error: --max-msg debe ser mayor que 0.\n");
+            return 1;
+        }
+        max_msg = (size_t)bytes;
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--presence-batch-ms");
+    if (opt) {
+        presence_batch_ms = atoi(opt);
+        if (presence_batch_ms < 0) {
+            printf("Error: --presence-batch-ms no puede ser negativo.\n");
+            return 1;
+        }
+    }
+
+    // lws_cmdline_option compara por prefijo: también activa la extensión
+    // si solo se dio --deflate-window-bits o --deflate-level
+    if (lws_cmdline_option(argc, (const char **)argv, "--deflate")) {
+        deflate_enabled = 1;
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--deflate-window-bits");
+    if (opt) {
+        deflate_window_bits = atoi(opt);
+        if (deflate_window_bits < 9 || deflate_window_bits > 15) {
+            printf("Error: --deflate-window-bits debe estar entre 9 y 15.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--deflate-level");
+    if (opt) {
+        deflate_level = atoi(opt);
+        if (deflate_level < 1 || deflate_level > 9) {
+            printf("Error: --deflate-level debe estar entre 1 y 9.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--history-bytes");
+    if (opt) {
+        long bytes = atol(opt);
+        if (bytes <= 0) {
+            printf("Error: --history-bytes debe ser mayor que 0.\n");
+            return 1;
+        }
+        history_bytes = (size_t)bytes;
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--history-replay");
+    if (opt) {
+        history_replay = atoi(opt);
+        if (history_replay < 0) {
+            printf("Error: --history-replay no puede ser negativo.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--history-msgs");
+    if (opt) {
+        history_max = atoi(opt);
+        if (history_max < 0) {
+            printf("Error: --history-msgs no puede ser negativo.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--offline-max-msgs");
+    if (opt) {
+        offline_max_msgs = atoi(opt);
+        if (offline_max_msgs < 0) {
+            printf("Error: --offline-max-msgs no puede ser negativo.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--offline-max-bytes");
+    if (opt) {
+        long bytes = atol(opt);
+        if (bytes <= 0) {
+            printf("Error: --offline-max-bytes debe ser mayor que 0.\n");
+            return 1;
+        }
+        offline_max_bytes = (size_t)bytes;
+    }
+
+    log_dir = lws_cmdline_option(argc, (const char **)argv, "--log-dir");
+    opt = lws_cmdline_option(argc, (const char **)argv, "--log-segment-mb");
+    if (opt) {
+        log_segment_mb = atoi(opt);
+        if (log_segment_mb <= 0 || log_segment_mb > 1024) {
+            printf("Error: --log-segment-mb debe estar entre 1 y 1024.\n");
+            return 1;
+        }
+    }
+
+    opt = lws_cmdline_option(argc, (const char **)argv, "--log-commit-ms");
+    if (opt) {
+        log_commit_ms = atoi(opt);
+        if (log_commit_ms < 0) {
+            printf("Error: --log-commit-ms no puede ser negativo.\n");
+            return 1;
+        }
+    }
+
+    int nivel = LOGGER_INFO;
+    opt = lws_cmdline_option(argc, (const char **)argv, "--log-level");
+    if (opt) {
+        nivel = logger_parse_level(opt);
+        if (nivel < 0) {
+            printf("Error: --log-level debe ser 'error', 'warn', 'info' o 'debug'.\n");
+            return 1;
+        }
+    }
+
+    // Los eventos de cada mensaje (broadcast, privado, sala, cuerpo recibido)
+    // se muestran 1 de cada N; los de conexión y los errores, siempre
+    int muestreo = 1;
+    opt = lws_cmdline_option(argc, (const char **)argv, "--log-sample");
+    if (opt) {
+        muestreo = atoi(opt);
+        if (muestreo <= 0) {
+            printf("Error: --log-sample debe ser mayor que 0.\n");
+            return 1;
+        }
+    }
+    if (logger_start(nivel, muestreo) != 0) {
+        fprintf(stderr, "Error al iniciar la bitácora\n");
+        return 1;
+    }
+
+    if (history_max > 0) {
+        history = calloc(history_max, sizeof(HistoryEntry));
+        history_text = malloc(history_bytes);
+        if (!history || !history_text) {
+            fprintf(stderr, "Error al reservar el historial\n");
+            return 1;
+        }
+    } else if (log_dir) {
+        printf("Error: --log-dir necesita el historial (--history-msgs mayor que 0).\n");
+        return 1;
+    }
+
+    if (log_dir) {
+        if (msglog_open(log_dir, (size_t)log_segment_mb * 1024 * 1024, log_commit_ms) != 0) {
+            fprintf(stderr, "Error al abrir el registro en %s\n", log_dir);
+            return 1;
+        }
+        history_restore();
+        printf("Registro en %s: %llu mensajes recuperados\n", log_dir,
+               (unsigned long long)(history_next - history_first));
+    }
+
+    for (int i = 0; i < USER_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+    for (int i = 0; i < ROOM_SHARDS; i++) {
+        pthread_mutex_init(&room_shards[i].lock, NULL);
+    }
 
     info.port = puerto;
     info.protocols = protocols;
+    info.mounts = &metrics_mount;
     info.gid = -1;
     info.uid = -1;
+    info.count_threads = service_count;
+    if (deflate_enabled) {
+        info.extensions = extensions;
+    }
 
     struct lws_context *context = lws_create_context(&info);
     if (!context) {
         fprintf(stderr, "Error al crear contexto\n");
         return 1;
     }
+    ws_context = context;
+
+    // lws puede haberse compilado con menos hilos (LWS_MAX_SMP)
+    service_count = lws_get_count_threads(context);
+
+    printf("Servidor iniciado en el puerto: %d (máximo %d usuarios, %d hilos)\n",
+           puerto, max_users, service_count);
+
+    for (int t = 0; t < service_count; t++) {
+        ServiceThread *st = &service[t];
+        st->tsi = t;
+        pthread_mutex_init(&st->mail_lock, NULL);
+        if (idle_wheel_init(&st->idle_wheel, away_secs, time(NULL)) != 0) {
+            fprintf(stderr, "Error al reservar la rueda de inactividad\n");
+            return 1;
+        }
+
+        // La inactividad se revisa desde cada hilo de servicio
+        lws_sul_schedule(context, t, &st->idle_sul, idle_tick, LWS_US_PER_SEC);
+    }
+
+    // Los lotes de presencia salen desde el hilo principal
+    if (presence_batch_ms > 0) {
+        lws_sul_schedule(context, 0, &presence_sul, presence_flush,
+                         (lws_usec_t)presence_batch_ms * LWS_US_PER_MS);
+    }
 
     printf("Servidor WebSocket activo\n");
-    pthread_t hilo_inactividad;
-    pthread_create(&hilo_inactividad, NULL, monitor_inactividad, NULL);
 
+    for (int t = 1; t < service_count; t++) {
+        pthread_create(&service[t].thread, NULL, service_loop, &service[t]);
+    }
 
     while (1)
         lws_service(context, 1000);
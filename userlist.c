@@ -0,0 +1,212 @@
+#include "userlist.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binproto.h"
+#include "encode.h"
+
+// Lista de usuarios ya serializada como arreglo JSON ("[\"a\",\"b\"]")
+static pthread_mutex_t userlist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *userlist_text = NULL;
+static size_t userlist_len = 0;
+static size_t userlist_cap = 0;
+static unsigned long userlist_version = 1;
+// La misma lista para el formato binario: registros {id, nombre} seguidos
+static unsigned char *userlist_bin = NULL;
+static size_t userlist_bin_len = 0;
+static size_t userlist_bin_cap = 0;
+static uint32_t userlist_count = 0;
+
+// Nombre de usuario escapado como cadena JSON, con comillas
+static char *userlist_token(const char *username) {
+    json_t *name = json_string(username);
+    char *token = name ? json_dumps(name, JSON_ENCODE_ANY) : NULL;
+    json_decref(name);
+    return token;
+}
+
+// Asume userlist_mutex
+static int userlist_reserve(size_t need) {
+    if (need <= userlist_cap) {
+        return 0;
+    }
+    size_t cap = userlist_cap ? userlist_cap : 256;
+    while (cap < need) {
+        cap *= 2;
+    }
+    char *text = realloc(userlist_text, cap);
+    if (!text) {
+        return -1;
+    }
+    if (!userlist_text) {
+        memcpy(text, "[]", 3);
+        userlist_len = 2;
+    }
+    userlist_text = text;
+    userlist_cap = cap;
+    return 0;
+}
+
+// Asume userlist_mutex
+static int userlist_bin_reserve(size_t need) {
+    if (need <= userlist_bin_cap) {
+        return 0;
+    }
+    size_t cap = userlist_bin_cap ? userlist_bin_cap : 256;
+    while (cap < need) {
+        cap *= 2;
+    }
+    unsigned char *bin = realloc(userlist_bin, cap);
+    if (!bin) {
+        return -1;
+    }
+    userlist_bin = bin;
+    userlist_bin_cap = cap;
+    return 0;
+}
+
+void userlist_add(const User *u) {
+    char *token = userlist_token(u->username);
+    if (!token) {
+        return;
+    }
+    size_t tlen = strlen(token);
+    size_t nlen = strlen(u->username);
+    size_t rec_len = 4 + bin_str_len(nlen);
+
+    pthread_mutex_lock(&userlist_mutex);
+    if (userlist_reserve(userlist_len + tlen + 2) == 0 &&
+        userlist_bin_reserve(userlist_bin_len + rec_len) == 0) {
+        char *end = &userlist_text[userlist_len - 1]; // ']'
+        if (userlist_len > 2) {
+            *end++ = ',';
+        }
+        memcpy(end, token, tlen);
+        end += tlen;
+        memcpy(end, "]", 2);
+        userlist_len = (size_t)(end + 1 - userlist_text);
+
+        unsigned char *p = &userlist_bin[userlist_bin_len];
+        p = bin_put_u32(p, u->id);
+        bin_put_str(p, u->username, nlen);
+        userlist_bin_len += rec_len;
+        userlist_count++;
+        userlist_version++;
+    }
+    pthread_mutex_unlock(&userlist_mutex);
+
+    free(token);
+}
+
+// Dentro de una cadena escapada toda comilla va precedida de '\', así que un
+// elemento solo puede empezar tras '[' o ',' y terminar antes de ',' o ']'.
+void userlist_remove(const User *u) {
+    char *token = userlist_token(u->username);
+    if (!token) {
+        return;
+    }
+    size_t tlen = strlen(token);
+
+    pthread_mutex_lock(&userlist_mutex);
+    char *p = userlist_text;
+    while (p && (p = strstr(p, token))) {
+        char antes = p[-1];
+        char despues = p[tlen];
+        if ((antes == '[' || antes == ',') && (despues == ',' || despues == ']')) {
+            // Quitar el elemento junto con una de sus comas
+            char *desde = p;
+            char *hasta = p + tlen;
+            if (despues == ',') {
+                hasta++;
+            } else if (antes == ',') {
+                desde--;
+            }
+            memmove(desde, hasta, userlist_len + 1 - (size_t)(hasta - userlist_text));
+            userlist_len -= (size_t)(hasta - desde);
+            userlist_version++;
+            break;
+        }
+        p++;
+    }
+
+    // Registro {id, nombre} del formato binario
+    BinReader r = { userlist_bin, userlist_bin + userlist_bin_len, 0 };
+    while (r.p < r.end) {
+        const unsigned char *rec = r.p;
+        uint32_t id = bin_get_u32(&r);
+        size_t nlen;
+        bin_get_str(&r, &nlen);
+        if (r.err) {
+            break;
+        }
+        if (id == u->id) {
+            size_t rec_len = (size_t)(r.p - rec);
+            memmove((unsigned char *)rec, r.p, (size_t)(r.end - r.p));
+            userlist_bin_len -= rec_len;
+            userlist_count--;
+            userlist_version++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&userlist_mutex);
+
+    free(token);
+}
+
+OutMsg *userlist_response(UserlistCache *cache, int registro, int fmt) {
+    char timestamp[64];
+    gen_timestamp(timestamp, sizeof(timestamp));
+
+    pthread_mutex_lock(&userlist_mutex);
+    if (userlist_reserve(3) != 0) {
+        pthread_mutex_unlock(&userlist_mutex);
+        return NULL;
+    }
+
+    if (cache->version != userlist_version ||
+        strcmp(cache->timestamp, timestamp) != 0) {
+        outmsg_unref(cache->list_response[FMT_JSON]);
+        outmsg_unref(cache->list_response[FMT_BIN]);
+        outmsg_unref(cache->register_response);
+        cache->list_response[FMT_JSON] = cache->list_response[FMT_BIN] = NULL;
+        cache->register_response = NULL;
+        cache->version = userlist_version;
+        snprintf(cache->timestamp, sizeof(cache->timestamp), "%s", timestamp);
+    }
+
+    OutMsg **cached = fmt == FMT_JSON && registro ? &cache->register_response
+                                                  : &cache->list_response[fmt];
+    if (!*cached) {
+        if (fmt == FMT_BIN) {
+            unsigned char *p;
+            *cached = bin_msg_new(BIN_S_LIST_USERS, 4 + userlist_bin_len, &p);
+            if (*cached) {
+                p = bin_put_u32(p, userlist_count);
+                if (userlist_bin_len) {
+                    memcpy(p, userlist_bin, userlist_bin_len);
+                }
+            }
+        } else if (registro) {
+            *cached = outmsg_printf(
+                "{\"type\":\"register_success\",\"sender\":\"server\","
+                "\"content\":\"Registro exitoso\",\"userList\":%.*s,"
+                "\"timestamp\":\"%s\"}",
+                (int)userlist_len, userlist_text, timestamp);
+        } else {
+            *cached = outmsg_printf(
+                "{\"type\":\"list_users_response\",\"sender\":\"server\","
+                "\"content\":%.*s,\"timestamp\":\"%s\"}",
+                (int)userlist_len, userlist_text, timestamp);
+        }
+    }
+    if (*cached) {
+        // Se reutiliza en otras solicitudes: no se atribuye a esta recepción
+        (*cached)->rx_ns = 0;
+    }
+    OutMsg *msg = *cached ? outmsg_ref(*cached) : NULL;
+    pthread_mutex_unlock(&userlist_mutex);
+
+    return msg;
+}
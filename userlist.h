@@ -0,0 +1,32 @@
+#ifndef USERLIST_H
+#define USERLIST_H
+
+#include "directory.h"
+#include "outmsg.h"
+
+// Lista de usuarios conectados ya serializada en los dos formatos de salida.
+// Se parcha al entrar y salir usuarios; cada cambio sube su versión.
+
+// Respuestas con la lista ya armadas para un hilo de servicio. Valen mientras
+// no cambie la versión de la lista ni el segundo.
+typedef struct {
+    unsigned long version;
+    char timestamp[64];
+    OutMsg *list_response[2];
+    OutMsg *register_response;
+} UserlistCache;
+
+// Agrega el usuario al final de la lista serializada en ambos formatos
+void userlist_add(const User *u);
+
+// Quita al usuario de la lista serializada
+void userlist_remove(const User *u);
+
+// Respuesta con la lista de usuarios: register_success o list_users_response
+// en JSON, o BIN_S_LIST_USERS en binario (ahí el registro se confirma aparte).
+// Todos los que la piden en el mismo segundo y con la misma versión de la
+// lista reciben los mismos bytes, guardados en cache, que es del hilo que
+// llama; solo se regenera al cambiar alguna de las dos.
+OutMsg *userlist_response(UserlistCache *cache, int registro, int fmt);
+
+#endif